@@ -10,260 +10,4431 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <getopt.h>
+#include <string.h>
 #include <strings.h>
+#include <limits.h>
 #include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <time.h>
+#if defined(__AVX2__) || defined(__SSE4_1__)
+#include <immintrin.h>	/* vector tag compares: build with -mavx2 or -msse4.1 */
+#endif
+#ifdef HAVE_ZLIB
+#include <zlib.h>	/* gzip traces: build with -DHAVE_ZLIB -lz */
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>	/* zstd traces: build with -DHAVE_ZSTD -lzstd */
+#endif
 
 #include "cachelab.h"
+#include "csim.h"
+
+#ifdef CSIM_LIBRARY
+/* Only the csim.h calls are global; the static code main alone uses is
+ * left out of a library build. */
+#pragma GCC diagnostic ignored "-Wunused-function"
+#endif
 
 /* Always use a 64-bit variable to hold memory addresses*/
 typedef unsigned long long int mem_addr_t;
 
-/* a struct that groups cache parameters together */
-typedef struct {
-	int s; /* 2**s cache sets */
-	int b; /* cacheline block size 2**b bytes */
-	int E; /* number of cachelines per set */
-	int S; /* number of sets, derived from S = 2**s */
-	int B; /* cacheline block size (bytes), derived from B = 2**b */
+typedef struct repl_policy repl_policy_t;
+typedef struct prefetcher prefetcher_t;
+typedef struct profiler profiler_t;
+typedef struct classifier classifier_t;
+typedef struct intervals intervals_t;
+typedef struct sampler sampler_t;
+typedef struct tlb tlb_t;
+typedef struct tracer tracer_t;
+
+/* a struct that groups cache parameters together */
+typedef struct {
+	int s; /* 2**s cache sets */
+	int b; /* cacheline block size 2**b bytes */
+	int E; /* number of cachelines per set */
+	int S; /* number of sets, derived from S = 2**s */
+	int B; /* cacheline block size (bytes), derived from B = 2**b */
+
+	long long accesses; /* loads and stores before splitting at block boundaries */
+	long long straddles; /* accesses that touched more than one block */
+
+	long long hits;
+	long long misses;
+	long long evicts;
+	long long dirty_evicts;
+	long long writebacks; /* writes sent to the next level or memory */
+	long long writeback_bytes;
+
+	int write_through; /* 0 = write-back */
+	int no_write_allocate; /* store misses bypass this cache */
+
+	unsigned long long lru_clock; /* bumped once per access, stamps last_used */
+
+	const repl_policy_t *policy; /* replacement policy, one of policies[] */
+	prefetcher_t *prefetcher; /* NULL when prefetching is off */
+	profiler_t *profiler; /* NULL unless profiling */
+	classifier_t *classifier; /* NULL unless classifying misses */
+	intervals_t *intervals; /* NULL unless reporting intervals */
+	sampler_t *sampler; /* NULL unless sampling */
+	tlb_t *tlb; /* NULL unless modelling TLBs */
+	tracer_t *tracer; /* NULL unless -v */
+} cache_param_t;
+
+
+typedef struct {
+	unsigned long long last_used;
+	unsigned int uses; /* accesses since the line was filled */
+	unsigned char valid;
+	unsigned char dirty; /* written since the fill; write-back levels only */
+	unsigned char prefetched; /* filled by a prefetch, no demand hit yet */
+	unsigned char shared; /* -n: other cores may hold copies (MESI S) */
+	mem_addr_t tag;
+} set_line;
+
+/* Tags are also kept per set in a contiguous array that find_tag scans
+ * a vector at a time.  Empty ways hold EMPTY_TAG, and the array is
+ * padded to a multiple of TAG_LANES ways with PAD_TAG, which matches
+ * nothing.  Real tags are below 2**63 since -s/-b, read_config and
+ * csim_create all insist on s + b >= 1. */
+#define EMPTY_TAG	(~0ULL)
+#define PAD_TAG		(~0ULL - 1)
+#define TAG_LANES	4
+#define tag_stride(num_lines)	(((num_lines) + TAG_LANES - 1) & ~(TAG_LANES - 1))
+
+typedef struct {
+	set_line *lines;
+	mem_addr_t *tags;		/* tag_stride(E) entries, 32-byte aligned */
+	int *order;			/* policy-owned, 2 * E ints */
+	unsigned long long state[4];	/* policy-owned per-set words */
+} cache_set;
+
+typedef struct {
+	 cache_set *sets;
+	 set_line *lines; /* every line of every set, one allocation */
+	 mem_addr_t *tags; /* every set's tags[], one allocation */
+	 int *order; /* every set's policy order[], one allocation */
+} cache;
+
+/* a replacement policy; touch is called on a hit, fill after a line is
+ * written and victim when a miss finds the set full */
+struct repl_policy {
+	const char *name;
+	int max_lines;	/* largest E supported, 0 for no limit */
+	int pow2_lines;	/* E must be a power of two */
+	void (*init)(cache_set *set, int num_lines, unsigned long long setIndex);
+	void (*touch)(cache_set *set, int way, int num_lines);
+	void (*fill)(cache_set *set, int way, int num_lines);
+	int (*victim)(cache_set *set, int num_lines);
+};
+
+/* run_sim result flags */
+#define SIM_HIT		0x1
+#define SIM_MISS	0x2
+#define SIM_EVICT	0x4
+#define SIM_DIRTY	0x8	/* the evicted line was dirty */
+#define SIM_PF_USED	0x10	/* first demand hit on a prefetched line */
+#define SIM_PF_UNUSED	0x20	/* the evicted line was prefetched and never used */
+
+/* one decoded trace access */
+typedef struct {
+	mem_addr_t address;
+	int size;
+	int is_write;
+} sim_access_t;
+
+
+static long long bit_pow(int exp) 
+{
+	long long result = 1;
+	result = result << exp;
+	return result;
+}
+
+#ifndef CSIM_LIBRARY
+/*
+ * printUsage - Print usage info
+ */
+void printUsage(char* argv[])
+{
+    printf("Usage: %s [-hv] -s <num> -E <num> -b <num> -t <file> [-p <num>] [-r <policy>]\n", argv[0]);
+    printf("       %*s [-w wb|wt] [-a wa|nwa] [-P <kind>] [-o <file> [-W <num>]] [-3]\n", (int) strlen(argv[0]), "");
+    printf("       %*s [-i <num>[:<diff>]] [-m <mode> [-R]] [-n <num>]\n", (int) strlen(argv[0]), "");
+    printf("       %*s [-T <entries>:<ways>[,<entries>:<ways>]] [-V <item>[,<item>...]]\n", (int) strlen(argv[0]), "");
+    printf("       %s [-h] -c <config> -t <file>\n", argv[0]);
+    printf("Options:\n");
+    printf("  -h         Print this help message.\n");
+    printf("  -v         Print every access with its hits, misses and evictions.\n");
+    printf("  -V <items> Verbose output options (implies -v): file=<path>, binary,\n");
+    printf("             addr=<lo>-<hi> (hex) and set=<lo>[-<hi>] to filter.\n");
+    printf("  -s <num>   Number of set index bits.\n");
+    printf("  -E <num>   Number of lines per set.\n");
+    printf("  -b <num>   Number of block offset bits.\n");
+    printf("  -t <file>  Trace file, plain or (if built with zlib/zstd) .gz/.zst.\n");
+    printf("             Text or tracegen binary, either one compressed or not.\n");
+    printf("  -p <num>   Simulate with <num> worker threads, each owning a range of sets.\n");
+    printf("  -B <num>   Benchmark run_sim with <num> synthetic accesses (no trace needed).\n");
+    printf("  -r <name>  Replacement policy: lru (default), fifo, random, plru, bitplru,\n");
+    printf("             srrip, brrip or lfu.  plru needs a power-of-two E; plru,\n");
+    printf("             bitplru, srrip and brrip need E <= 64.\n");
+    printf("  -w wb|wt   Write-back (default) or write-through.\n");
+    printf("  -a wa|nwa  Write-allocate (default) or no-write-allocate.\n");
+    printf("  -P <kind>  Prefetcher: next[:N] (next N lines), stride[:N] (N strides\n");
+    printf("             ahead per 4 KB region) or stream[:N] (4 stream buffers\n");
+    printf("             of N blocks).\n");
+    printf("  -o <file>  Write a JSON profile: reuse distances, misses per set and hot\n");
+    printf("             sets, working set per window and the blocks that miss most.\n");
+    printf("  -W <num>   Working-set window for -o, in block accesses (default %d).\n", 100000);
+    printf("  -3         Classify misses as compulsory, capacity or conflict.\n");
+    printf("  -i <num>[:<diff>]\n");
+    printf("             Report the counters every <num> accesses and group the\n");
+    printf("             intervals into phases by where their misses fall; an\n");
+    printf("             interval joins a phase within <diff> (default %.2f).\n", 0.05);
+    printf("  -m <mode>  Estimate from a sample: sets:K simulates every Kth set;\n");
+    printf("             intervals:P[:W[:M]] skips through each P accesses, warms up\n");
+    printf("             for W and counts M (default P/10 each).  Prints a 95%%\n");
+    printf("             confidence interval for the misses.\n");
+    printf("  -R         With -m, also run the full trace and report error and speedup.\n");
+    printf("  -n <num>   Simulate <num> cores with private caches kept coherent by\n");
+    printf("             MESI.  Trace records may end in a thread or core id\n");
+    printf("             (\"L 7ff000a0,8,3\"); reports coherence misses,\n");
+    printf("             invalidations and false-sharing hot lines.\n");
+    printf("  -T <entries>:<ways>[,<entries>:<ways>]\n");
+    printf("             Also simulate an L1 (and L2) TLB, once with 4 KB pages and\n");
+    printf("             once with 2 MB pages, and count page walks.\n");
+    printf("  -c <file>  Simulate the multi-level hierarchy described in <file>, one\n");
+    printf("             level per line from L1 down:\n");
+    printf("               <name> s=<num> E=<num> b=<num> [policy=<name>]\n");
+    printf("                      [inclusion=inclusive|exclusive|nine] [write=wb|wt]\n");
+    printf("                      [alloc=wa|nwa]\n");
+    printf("\nExamples:\n");
+    printf("  %s -s 4 -E 1 -b 4 -t traces/yi.trace\n", argv[0]);
+    printf("  %s -v -s 8 -E 2 -b 4 -t traces/yi.trace\n", argv[0]);
+    printf("  %s -s 8 -E 2 -b 4 -t traces/yi.trace -p 4\n", argv[0]);
+    printf("  %s -s 8 -E 16 -b 6 -B 100000000\n", argv[0]);
+    printf("  %s -s 4 -E 8 -b 4 -t traces/yi.trace -r plru\n", argv[0]);
+    printf("  %s -c hierarchy.cfg -t traces/yi.trace\n", argv[0]);
+    printf("  %s -s 4 -E 1 -b 4 -t traces/yi.trace -o profile.json\n", argv[0]);
+    printf("  %s -s 6 -E 8 -b 6 -t threads.trace -n 4\n", argv[0]);
+    printf("  %s -s 6 -E 8 -b 6 -t traces/yi.trace -T 64:4,1536:12\n", argv[0]);
+    exit(0);
+}
+#endif
+
+
+/* build_cache - An empty cache; its sets are NULL if there was not the
+ * memory for it. */
+static cache build_cache(long long num_sets, int num_lines, long long block_size) 
+{
+
+	cache newCache;	
+	int setIndex;
+	int stride = tag_stride(num_lines);
+	long long way;
+
+	//calloc leaves every line invalid with last_used and tag zeroed.
+	newCache.sets = (cache_set *) malloc(sizeof(cache_set) * num_sets);
+	newCache.lines = (set_line *) calloc(num_sets * num_lines, sizeof(set_line));
+	newCache.tags = (mem_addr_t *) aligned_alloc(32, sizeof(mem_addr_t) * num_sets * stride);
+	newCache.order = (int *) malloc(sizeof(int) * 2 * num_sets * num_lines);
+	if (newCache.sets == NULL || newCache.lines == NULL || newCache.tags == NULL || newCache.order == NULL) {
+		free(newCache.sets);
+		free(newCache.lines);
+		free(newCache.tags);
+		free(newCache.order);
+		newCache.sets = NULL;
+		return newCache;
+	}
+
+	for (way = 0; way < num_sets * stride; way ++) {
+		newCache.tags[way] = (way % stride < num_lines) ? EMPTY_TAG : PAD_TAG;
+	}
+
+	for (setIndex = 0; setIndex < num_sets; setIndex ++) 
+	{
+		newCache.sets[setIndex].lines = newCache.lines + (long long) setIndex * num_lines;
+		newCache.sets[setIndex].tags = newCache.tags + (long long) setIndex * stride;
+		newCache.sets[setIndex].order = newCache.order + 2LL * setIndex * num_lines;
+	} 
+
+	return newCache;
+	
+}
+
+static void clear_cache(cache sim_cache, long long num_sets, int num_lines, long long block_size) 
+{
+	free(sim_cache.lines);
+	free(sim_cache.tags);
+	free(sim_cache.order);
+	free(sim_cache.sets);
+}
+
+/*
+ * Replacement policies.
+ *
+ * run_sim finds hits and empty lines itself and asks the policy only
+ * for bookkeeping (touch on a hit, fill after a line is written) and for
+ * a victim when the set is full.  Per-set state lives in cache_set:
+ * state[] holds up to four words and order[] holds 2 * E ints.
+ */
+
+#define RRPV_MAX	3	/* 2-bit re-reference prediction values */
+
+/* LRU: doubly linked recency list, order[0..E) = prev, order[E..2E) = next.
+ * state[0] is the most recently used way, state[1] the least. */
+static void lru_init(cache_set *set, int num_lines, unsigned long long setIndex)
+{
+	int way;
+
+	for (way = 0; way < num_lines; way ++) {
+		set->order[way] = way - 1;
+		set->order[num_lines + way] = (way + 1 < num_lines) ? way + 1 : -1;
+	}
+	set->state[0] = 0;
+	set->state[1] = num_lines - 1;
+}
+
+static void lru_touch(cache_set *set, int way, int num_lines)
+{
+	int *prev = set->order;
+	int *next = set->order + num_lines;
+
+	if ((int) set->state[0] == way) {
+		return;
+	}
+
+	//Unlink way; it is not the head, so prev[way] is valid.
+	next[prev[way]] = next[way];
+	if (next[way] >= 0) {
+		prev[next[way]] = prev[way];
+	} else {
+		set->state[1] = prev[way];
+	}
+
+	//Push it on the front.
+	prev[way] = -1;
+	next[way] = (int) set->state[0];
+	prev[set->state[0]] = way;
+	set->state[0] = way;
+}
+
+static int lru_victim(cache_set *set, int num_lines)
+{
+	return (int) set->state[1];
+}
+
+/* FIFO: ways are filled in order, so a round-robin pointer in state[0]
+ * always names the oldest line once the set is full. */
+static void fifo_init(cache_set *set, int num_lines, unsigned long long setIndex)
+{
+	set->state[0] = 0;
+}
+
+static void no_touch(cache_set *set, int way, int num_lines)
+{
+}
+
+static int fifo_victim(cache_set *set, int num_lines)
+{
+	int way = (int) set->state[0];
+
+	set->state[0] = (way + 1 == num_lines) ? 0 : way + 1;
+	return way;
+}
+
+/* Random: xorshift64 per set, seeded from the set index so the choice
+ * does not depend on how sets are split between worker threads. */
+static void random_init(cache_set *set, int num_lines, unsigned long long setIndex)
+{
+	set->state[0] = 0x9E3779B97F4A7C15ULL ^ (setIndex * 0xBF58476D1CE4E5B9ULL);
+	if (set->state[0] == 0) {
+		set->state[0] = 1;
+	}
+}
+
+static int random_victim(cache_set *set, int num_lines)
+{
+	unsigned long long x = set->state[0];
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	set->state[0] = x;
+	return (int) (x % num_lines);
+}
+
+/* Tree-PLRU: E - 1 node bits in state[0], node n has children 2n and
+ * 2n + 1 and leaves are E + way.  A set bit points the victim search
+ * right. */
+static void plru_init(cache_set *set, int num_lines, unsigned long long setIndex)
+{
+	set->state[0] = 0;
+}
+
+static void plru_touch(cache_set *set, int way, int num_lines)
+{
+	int node = num_lines + way;
+
+	//Point every node on the path away from way.
+	while (node > 1) {
+		if (node & 1) {
+			set->state[0] &= ~(1ULL << (node >> 1));
+		} else {
+			set->state[0] |= 1ULL << (node >> 1);
+		}
+		node >>= 1;
+	}
+}
+
+static int plru_victim(cache_set *set, int num_lines)
+{
+	int node = 1;
+
+	while (node < num_lines) {
+		node = 2 * node + (int) ((set->state[0] >> node) & 1);
+	}
+	return node - num_lines;
+}
+
+/* Bit-PLRU: one MRU bit per way in state[0].  When the last bit would be
+ * set, all the others are cleared.  The victim is the first clear bit. */
+static void bitplru_touch(cache_set *set, int way, int num_lines)
+{
+	unsigned long long all = (num_lines == 64) ? ~0ULL : (1ULL << num_lines) - 1;
+
+	set->state[0] |= 1ULL << way;
+	if (set->state[0] == all) {
+		set->state[0] = 1ULL << way;
+	}
+}
+
+static int bitplru_victim(cache_set *set, int num_lines)
+{
+	unsigned long long all = (num_lines == 64) ? ~0ULL : (1ULL << num_lines) - 1;
+	unsigned long long candidates = ~set->state[0] & all;
+
+	//Only a one-way set can have every bit set.
+	return candidates ? __builtin_ctzll(candidates) : 0;
+}
+
+/* SRRIP/BRRIP: state[v] is the mask of ways whose RRPV is v.  Aging
+ * every line by one shifts the masks up a level, so finding a victim
+ * takes at most RRPV_MAX steps. */
+static void rrip_init(cache_set *set, int num_lines, unsigned long long setIndex)
+{
+	set->state[0] = 0;
+	set->state[1] = 0;
+	set->state[2] = 0;
+	set->state[RRPV_MAX] = (num_lines == 64) ? ~0ULL : (1ULL << num_lines) - 1;
+}
+
+static void rrip_set(cache_set *set, int way, int rrpv)
+{
+	int level;
+
+	for (level = 0; level <= RRPV_MAX; level ++) {
+		set->state[level] &= ~(1ULL << way);
+	}
+	set->state[rrpv] |= 1ULL << way;
+}
+
+static void rrip_touch(cache_set *set, int way, int num_lines)
+{
+	rrip_set(set, way, 0);
+}
+
+static void srrip_fill(cache_set *set, int way, int num_lines)
+{
+	rrip_set(set, way, RRPV_MAX - 1);
+}
+
+static void brrip_fill(cache_set *set, int way, int num_lines)
+{
+	//Insert at "long" about 1 time in 32, otherwise at "distant".  The
+	//choice hashes the tag so it is reproducible across thread counts.
+	mem_addr_t hash = set->lines[way].tag * 0x9E3779B97F4A7C15ULL;
+
+	rrip_set(set, way, (hash >> 59) == 0 ? RRPV_MAX - 1 : RRPV_MAX);
+}
+
+static int rrip_victim(cache_set *set, int num_lines)
+{
+	int level;
+
+	while (set->state[RRPV_MAX] == 0) {
+		for (level = RRPV_MAX; level > 0; level --) {
+			set->state[level] = set->state[level - 1];
+		}
+		set->state[0] = 0;
+	}
+	return __builtin_ctzll(set->state[RRPV_MAX]);
+}
+
+/* LFU: binary min-heap of ways keyed on (uses, last_used), so ties go
+ * to the least recently used line.  order[0..E) is the heap and
+ * order[E..2E) is each way's position in it. */
+static int lfu_less(cache_set *set, int a, int b)
+{
+	set_line *la = &set->lines[a];
+	set_line *lb = &set->lines[b];
+
+	if (la->uses != lb->uses) {
+		return la->uses < lb->uses;
+	}
+	return la->last_used < lb->last_used;
+}
+
+static void lfu_init(cache_set *set, int num_lines, unsigned long long setIndex)
+{
+	int way;
+
+	for (way = 0; way < num_lines; way ++) {
+		set->order[way] = way;
+		set->order[num_lines + way] = way;
+	}
+}
+
+static void lfu_touch(cache_set *set, int way, int num_lines)
+{
+	//The key of way only grows, so sift it down.
+	int *heap = set->order;
+	int *pos = set->order + num_lines;
+	int index = pos[way];
+
+	while (1) {
+		int child = 2 * index + 1;
+
+		if (child >= num_lines) {
+			break;
+		}
+		if (child + 1 < num_lines && lfu_less(set, heap[child + 1], heap[child])) {
+			child ++;
+		}
+		if (!lfu_less(set, heap[child], way)) {
+			break;
+		}
+		heap[index] = heap[child];
+		pos[heap[index]] = index;
+		index = child;
+	}
+	heap[index] = way;
+	pos[way] = index;
+}
+
+static void lfu_fill(cache_set *set, int way, int num_lines)
+{
+	//An invalidated way keeps its old key, so a refill can lower it.
+	int *heap = set->order;
+	int *pos = set->order + num_lines;
+	int index = pos[way];
+
+	while (index > 0 && lfu_less(set, way, heap[(index - 1) / 2])) {
+		heap[index] = heap[(index - 1) / 2];
+		pos[heap[index]] = index;
+		index = (index - 1) / 2;
+	}
+	heap[index] = way;
+	pos[way] = index;
+	lfu_touch(set, way, num_lines);
+}
+
+static int lfu_victim(cache_set *set, int num_lines)
+{
+	return set->order[0];
+}
+
+static const repl_policy_t policies[] = {
+	/* name       max E  pow2  init         touch         fill          victim */
+	{ "lru",      0,     0,    lru_init,    lru_touch,    lru_touch,    lru_victim },
+	{ "fifo",     0,     0,    fifo_init,   no_touch,     no_touch,     fifo_victim },
+	{ "random",   0,     0,    random_init, no_touch,     no_touch,     random_victim },
+	{ "plru",     64,    1,    plru_init,   plru_touch,   plru_touch,   plru_victim },
+	{ "bitplru",  64,    0,    plru_init,   bitplru_touch, bitplru_touch, bitplru_victim },
+	{ "srrip",    64,    0,    rrip_init,   rrip_touch,   srrip_fill,   rrip_victim },
+	{ "brrip",    64,    0,    rrip_init,   rrip_touch,   brrip_fill,   rrip_victim },
+	{ "lfu",      0,     0,    lfu_init,    lfu_touch,    lfu_fill,     lfu_victim },
+	{ NULL,       0,     0,    NULL,        NULL,         NULL,         NULL }
+};
+
+static const repl_policy_t *find_policy(const char *name)
+{
+	int index;
+
+	for (index = 0; policies[index].name != NULL; index ++) {
+		if (strcmp(policies[index].name, name) == 0) {
+			return &policies[index];
+		}
+	}
+	return NULL;
+}
+
+static void init_policy(cache *sim_cache, cache_param_t *par)
+{
+	long long setIndex;
+
+	for (setIndex = 0; setIndex < par->S; setIndex ++) {
+		par->policy->init(&sim_cache->sets[setIndex], par->E, setIndex);
+	}
+}
+
+/* new_cache - derive S and B from par's s and b and build an empty cache
+ * for its policy; its sets are NULL if there was not the memory */
+static cache new_cache(cache_param_t *par)
+{
+	cache sim_cache;
+
+	par->S = bit_pow(par->s);
+	par->B = bit_pow(par->b);
+	sim_cache = build_cache(par->S, par->E, par->B);
+	if (sim_cache.sets != NULL) {
+		init_policy(&sim_cache, par);
+	}
+	return sim_cache;
+}
+
+/* setup_cache - check par's policy against E and build an empty cache,
+ * or exit; who names the cache in error messages */
+static cache setup_cache(cache_param_t *par, const char *who)
+{
+	cache sim_cache;
+
+	if ((par->policy->max_lines && par->E > par->policy->max_lines) ||
+	    (par->policy->pow2_lines && (par->E & (par->E - 1)) != 0)) {
+		printf("%s: Policy %s does not support E=%d\n", who, par->policy->name, par->E);
+		exit(1);
+	}
+
+	sim_cache = new_cache(par);
+	if (sim_cache.sets == NULL) {
+		printf("%s: Could not allocate %d sets of %d lines\n", who, par->S, par->E);
+		exit(1);
+	}
+	return sim_cache;
+}
+
+/*
+ * find_tag - The way holding tag in a set's tags[], or -1 with the first
+ * empty way (or -1 when the set is full) in *empty.  With AVX2 or SSE4.1
+ * one compare checks four or two ways for both at once.
+ */
+static int find_tag(const mem_addr_t *tags, int num_lines, mem_addr_t tag, int *empty)
+{
+	int way;
+
+	*empty = -1;
+#if defined(__AVX2__)
+	int stride = tag_stride(num_lines);
+	__m256i want = _mm256_set1_epi64x((long long) tag);
+	__m256i none = _mm256_set1_epi64x((long long) EMPTY_TAG);
+
+	for (way = 0; way < stride; way += 4) {
+		__m256i have = _mm256_load_si256((const __m256i *) (tags + way));
+		int hit = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(have, want)));
+
+		if (hit) {
+			return way + __builtin_ctz(hit);
+		}
+		if (*empty < 0) {
+			int free_ways = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(have, none)));
+
+			if (free_ways) {
+				*empty = way + __builtin_ctz(free_ways);
+			}
+		}
+	}
+#elif defined(__SSE4_1__)
+	int stride = tag_stride(num_lines);
+	__m128i want = _mm_set1_epi64x((long long) tag);
+	__m128i none = _mm_set1_epi64x((long long) EMPTY_TAG);
+
+	for (way = 0; way < stride; way += 2) {
+		__m128i have = _mm_load_si128((const __m128i *) (tags + way));
+		int hit = _mm_movemask_pd(_mm_castsi128_pd(_mm_cmpeq_epi64(have, want)));
+
+		if (hit) {
+			return way + __builtin_ctz(hit);
+		}
+		if (*empty < 0) {
+			int free_ways = _mm_movemask_pd(_mm_castsi128_pd(_mm_cmpeq_epi64(have, none)));
+
+			if (free_ways) {
+				*empty = way + __builtin_ctz(free_ways);
+			}
+		}
+	}
+#else
+	for (way = 0; way < num_lines; way ++) {
+		if (tags[way] == tag) {
+			return way;
+		}
+		if (tags[way] == EMPTY_TAG && *empty < 0) {
+			*empty = way;
+		}
+	}
+#endif
+	return -1;
+}
+
+/*
+ * cache_lookup - Scan address's set once.  On a hit, update the policy
+ * and return the line; otherwise return NULL and leave the first empty
+ * way (or -1 when the set is full) in *empty.
+ */
+static set_line *cache_lookup(cache *sim_cache, cache_param_t *par, mem_addr_t address, int *empty)
+{
+	int num_lines = par->E;
+
+	mem_addr_t input_tag = address >> (par->s + par->b);
+	unsigned long long setIndex = (address >> par->b) & (par->S - 1);
+
+	cache_set *query_set = &sim_cache->sets[setIndex];
+	set_line *line;
+	int lineIndex;
+
+	par->lru_clock ++;
+	lineIndex = find_tag(query_set->tags, num_lines, input_tag, empty);
+	if (lineIndex < 0) {
+		return NULL;
+	}
+
+	line = &query_set->lines[lineIndex];
+	line->last_used = par->lru_clock;
+	line->uses ++;
+	par->policy->touch(query_set, lineIndex, num_lines);
+	return line;
+}
+
+/* cache_probe - like cache_lookup, but leaves the policy and clock alone */
+static set_line *cache_probe(cache *sim_cache, cache_param_t *par, mem_addr_t address, int *empty)
+{
+	cache_set *query_set = &sim_cache->sets[(address >> par->b) & (par->S - 1)];
+	int lineIndex = find_tag(query_set->tags, par->E, address >> (par->s + par->b), empty);
+
+	return (lineIndex < 0) ? NULL : &query_set->lines[lineIndex];
+}
+
+/*
+ * cache_fill - Write address into way empty, or into the policy's victim
+ * when empty is -1.  The line that was there is copied to *evicted, whose
+ * valid field says whether anything was evicted.  Returns the new line,
+ * which starts clean.
+ */
+static set_line *cache_fill(cache *sim_cache, cache_param_t *par, mem_addr_t address, int empty, set_line *evicted)
+{
+	int num_lines = par->E;
+	unsigned long long setIndex = (address >> par->b) & (par->S - 1);
+	cache_set *query_set = &sim_cache->sets[setIndex];
+	int lineIndex = (empty < 0) ? par->policy->victim(query_set, num_lines) : empty;
+	set_line *line = &query_set->lines[lineIndex];
+
+	*evicted = *line;
+	line->tag = address >> (par->s + par->b);
+	query_set->tags[lineIndex] = line->tag;
+	line->valid = 1;
+	line->dirty = 0;
+	line->prefetched = 0;
+	line->shared = 0;
+	line->last_used = par->lru_clock;
+	line->uses = 1;
+	par->policy->fill(query_set, lineIndex, num_lines);
+	return line;
+}
+
+/* drop_line - invalidate a line of sim_cache */
+static void drop_line(cache *sim_cache, cache_param_t *par, set_line *line)
+{
+	long long index = line - sim_cache->lines;
+
+	line->valid = 0;
+	sim_cache->tags[(index / par->E) * tag_stride(par->E) + index % par->E] = EMPTY_TAG;
+}
+
+/*
+ * cache_invalidate - Drop address's block if present.  Returns -1 if it
+ * was not cached, otherwise the line's dirty bit.
+ */
+static int cache_invalidate(cache *sim_cache, cache_param_t *par, mem_addr_t address)
+{
+	int empty;
+	set_line *line = cache_probe(sim_cache, par, address, &empty);
+
+	if (line == NULL) {
+		return -1;
+	}
+	drop_line(sim_cache, par, line);
+	return line->dirty;
+}
+
+/* line_address - first byte of the block held by line in set setIndex */
+static mem_addr_t line_address(cache_param_t *par, set_line *line, unsigned long long setIndex)
+{
+	return (line->tag << (par->s + par->b)) | (setIndex << par->b);
+}
+
+static void clear_counters(cache_param_t *par)
+{
+	par->accesses = 0;
+	par->straddles = 0;
+	par->hits = 0;
+	par->misses = 0;
+	par->evicts = 0;
+	par->dirty_evicts = 0;
+	par->writebacks = 0;
+	par->writeback_bytes = 0;
+}
+
+static void add_counters(cache_param_t *total, const cache_param_t *part)
+{
+	total->accesses += part->accesses;
+	total->straddles += part->straddles;
+	total->hits += part->hits;
+	total->misses += part->misses;
+	total->evicts += part->evicts;
+	total->dirty_evicts += part->dirty_evicts;
+	total->writebacks += part->writebacks;
+	total->writeback_bytes += part->writeback_bytes;
+}
+
+static void sub_counters(cache_param_t *total, const cache_param_t *part)
+{
+	total->accesses -= part->accesses;
+	total->straddles -= part->straddles;
+	total->hits -= part->hits;
+	total->misses -= part->misses;
+	total->evicts -= part->evicts;
+	total->dirty_evicts -= part->dirty_evicts;
+	total->writebacks -= part->writebacks;
+	total->writeback_bytes -= part->writeback_bytes;
+}
+
+/* write_line - apply a store of size bytes to line under par's write policy */
+static void write_line(cache_param_t *par, set_line *line, int size)
+{
+	if (par->write_through) {
+		par->writebacks ++;
+		par->writeback_bytes += size;
+	} else {
+		line->dirty = 1;
+	}
+}
+
+static int run_sim(cache *sim_cache, cache_param_t *par, mem_addr_t address, int size, int is_write) {
+
+		//One pass over the set finds the hit or the first empty line; the
+		//policy picks the victim.  Nothing is copied or allocated.
+		int empty;
+		int flags;
+		set_line evicted;
+		set_line *line = cache_lookup(sim_cache, par, address, &empty);
+
+		if (line != NULL) {
+			par->hits ++;
+			if (is_write) {
+				write_line(par, line, size);
+			}
+			if (line->prefetched) {
+				line->prefetched = 0;
+				return SIM_HIT | SIM_PF_USED;
+			}
+			return SIM_HIT;
+		}
+
+		par->misses++;
+
+		if (is_write && par->no_write_allocate) {
+			//The store goes straight to memory.
+			par->writebacks ++;
+			par->writeback_bytes += size;
+			return SIM_MISS;
+		}
+
+		//We missed, so evict if necessary and write data into cache.
+		line = cache_fill(sim_cache, par, address, empty, &evicted);
+		if (is_write) {
+			write_line(par, line, size);
+		}
+
+		if (!evicted.valid) {
+			return SIM_MISS;
+		}
+
+		par->evicts++;
+		flags = SIM_MISS | SIM_EVICT;
+		if (evicted.prefetched) {
+			flags |= SIM_PF_UNUSED;
+		}
+		if (evicted.dirty) {
+			par->dirty_evicts ++;
+			par->writebacks ++;
+			par->writeback_bytes += par->B;
+			flags |= SIM_DIRTY;
+		}
+		return flags;
+}
+
+/*
+ * Prefetchers.
+ *
+ * A prefetcher watches the demand stream coming out of run_sim and
+ * brings blocks in ahead of use.  Prefetched lines are tagged; the first
+ * demand hit on one counts it as useful, and evicting one untouched
+ * counts it as useless.  Demand hits and misses never include prefetch
+ * fills.
+ *   next    on a miss, or the first hit on a prefetched line, fetch the
+ *           next <degree> blocks (tagged next-N-line)
+ *   stride  a table of 4 KB regions remembers the last block and stride
+ *           seen in each; once the same stride repeats, fetch <degree>
+ *           strides ahead
+ *   stream  <STREAM_BUFFERS> FIFO stream buffers of <degree> blocks sit
+ *           beside the cache.  A miss that finds its block in a buffer
+ *           moves it into the cache and counts as a hit; other misses
+ *           restart the least recently used buffer after the miss.
+ */
+
+#define PF_NONE		0
+#define PF_NEXT		1
+#define PF_STRIDE	2
+#define PF_STREAM	3
+
+#define STRIDE_ENTRIES	256	/* regions tracked, power of two */
+#define REGION_BITS	12
+#define STREAM_BUFFERS	4
+
+typedef struct {
+	mem_addr_t region;
+	mem_addr_t last_block;
+	long long stride;
+	int confidence; /* 0..3, prefetch at 2 and above */
+} stride_entry;
+
+typedef struct {
+	mem_addr_t first;	/* block number at the head of the FIFO */
+	int count;		/* blocks held: first .. first + count - 1 */
+	unsigned long long last_used;
+} stream_buffer;
+
+struct prefetcher {
+	int kind;
+	int degree;
+	stride_entry table[STRIDE_ENTRIES];
+	stream_buffer streams[STREAM_BUFFERS];
+
+	long long issued;	/* blocks brought in by the prefetcher */
+	long long useful;	/* prefetched blocks later used by a demand access */
+	long long useless;	/* prefetched blocks dropped unused */
+	long long evicts;	/* lines evicted to make room for prefetches */
+};
+
+/* prefetch_block - bring block number block into the cache, tagged as
+ * prefetched, unless it is already there */
+static void prefetch_block(cache *sim_cache, cache_param_t *par, prefetcher_t *pf, mem_addr_t block)
+{
+	mem_addr_t address = block << par->b;
+	set_line evicted;
+	set_line *line;
+	int empty;
+
+	if (cache_probe(sim_cache, par, address, &empty) != NULL) {
+		return;
+	}
+
+	par->lru_clock ++;
+	line = cache_fill(sim_cache, par, address, empty, &evicted);
+	line->prefetched = 1;
+	pf->issued ++;
+
+	if (evicted.valid) {
+		pf->evicts ++;
+		if (evicted.prefetched) {
+			pf->useless ++;
+		}
+		if (evicted.dirty) {
+			par->dirty_evicts ++;
+			par->writebacks ++;
+			par->writeback_bytes += par->B;
+		}
+	}
+}
+
+static void stride_access(cache *sim_cache, cache_param_t *par, prefetcher_t *pf, mem_addr_t block)
+{
+	mem_addr_t region = (block << par->b) >> REGION_BITS;
+	stride_entry *entry = &pf->table[region & (STRIDE_ENTRIES - 1)];
+	long long stride = (long long) (block - entry->last_block);
+	int step;
+
+	if (entry->region != region) {
+		entry->region = region;
+		entry->last_block = block;
+		entry->stride = 0;
+		entry->confidence = 0;
+		return;
+	}
+	if (stride == 0) {
+		return;
+	}
+
+	if (stride == entry->stride) {
+		if (entry->confidence < 3) {
+			entry->confidence ++;
+		}
+	} else if (entry->confidence > 0) {
+		entry->confidence --;
+	} else {
+		entry->stride = stride;
+	}
+	entry->last_block = block;
+
+	if (entry->confidence >= 2) {
+		for (step = 1; step <= pf->degree; step ++) {
+			prefetch_block(sim_cache, par, pf, block + step * entry->stride);
+		}
+	}
+}
+
+/* stream_miss - returns 1 if a stream buffer held the missing block */
+static int stream_miss(cache_param_t *par, prefetcher_t *pf, mem_addr_t block)
+{
+	stream_buffer *lru = &pf->streams[0];
+	int index;
+
+	for (index = 0; index < STREAM_BUFFERS; index ++) {
+		stream_buffer *stream = &pf->streams[index];
+
+		if (stream->count > 0 && block >= stream->first && block - stream->first < (mem_addr_t) stream->count) {
+			//Blocks ahead of the one used are dropped; the buffer
+			//refills behind it to its full depth.
+			int used = (int) (block - stream->first) + 1;
+
+			pf->useful ++;
+			pf->useless += used - 1;
+			pf->issued += used;
+			stream->first = block + 1;
+			stream->last_used = par->lru_clock;
+			return 1;
+		}
+		if (stream->last_used < lru->last_used) {
+			lru = stream;
+		}
+	}
+
+	pf->useless += lru->count;
+	pf->issued += pf->degree;
+	lru->first = block + 1;
+	lru->count = pf->degree;
+	lru->last_used = par->lru_clock;
+	return 0;
+}
+
+/* prefetch_access - let the prefetcher see a demand access to address
+ * that run_sim answered with flags; returns the flags, with a miss a
+ * stream buffer served turned into a hit */
+static int prefetch_access(cache *sim_cache, cache_param_t *par, prefetcher_t *pf,
+		     mem_addr_t address, int flags)
+{
+	mem_addr_t block = address >> par->b;
+	int step;
+
+	if (flags & SIM_PF_USED) {
+		pf->useful ++;
+	}
+	if (flags & SIM_PF_UNUSED) {
+		pf->useless ++;
+	}
+
+	switch (pf->kind) {
+		case PF_NEXT:
+			if (flags & (SIM_MISS | SIM_PF_USED)) {
+				for (step = 1; step <= pf->degree; step ++) {
+					prefetch_block(sim_cache, par, pf, block + step);
+				}
+			}
+			break;
+		case PF_STRIDE:
+			stride_access(sim_cache, par, pf, block);
+			break;
+		case PF_STREAM:
+			if ((flags & SIM_MISS) && stream_miss(par, pf, block)) {
+				//The block came from a stream buffer, not memory.
+				par->misses --;
+				par->hits ++;
+				flags = (flags & ~SIM_MISS) | SIM_HIT;
+			}
+			break;
+	}
+	return flags;
+}
+
+/* parse_prefetcher - read next[:N], stride[:N] or stream[:N] into *pf */
+static int parse_prefetcher(const char *spec, prefetcher_t *pf)
+{
+	const char *colon = strchr(spec, ':');
+	size_t len = colon ? (size_t) (colon - spec) : strlen(spec);
+
+	bzero(pf, sizeof(*pf));
+	if (len == 4 && strncmp(spec, "next", len) == 0) {
+		pf->kind = PF_NEXT;
+		pf->degree = 1;
+	} else if (len == 6 && strncmp(spec, "stride", len) == 0) {
+		pf->kind = PF_STRIDE;
+		pf->degree = 2;
+	} else if (len == 6 && strncmp(spec, "stream", len) == 0) {
+		pf->kind = PF_STREAM;
+		pf->degree = 4;
+	} else {
+		return -1;
+	}
+
+	if (colon != NULL) {
+		pf->degree = atoi(colon + 1);
+	}
+	return (pf->degree > 0) ? 0 : -1;
+}
+
+static void print_prefetcher(cache_param_t *par, prefetcher_t *pf)
+{
+	printf("prefetches:%lld useful:%lld useless:%lld prefetch_evictions:%lld\n",
+	       pf->issued, pf->useful, pf->useless, pf->evicts);
+	printf("accuracy:%.2f%% coverage:%.2f%%\n",
+	       pf->issued ? 100.0 * pf->useful / pf->issued : 0.0,
+	       (pf->useful + par->misses) ? 100.0 * pf->useful / (pf->useful + par->misses) : 0.0);
+}
+
+/*
+ * Block maps.
+ *
+ * An open-addressing hash table from block number to a 64-bit value,
+ * with linear probing and backward-shift deletion so that lookups never
+ * see tombstones.  It doubles when three quarters full.
+ */
+
+#define MAP_EMPTY	(~0ULL)	/* no real block number is all ones */
+
+typedef struct {
+	mem_addr_t key;
+	unsigned long long value;
+} map_entry;
+
+typedef struct {
+	map_entry *entries;
+	unsigned long long mask;	/* capacity - 1, capacity a power of two */
+	unsigned long long count;
+} block_map;
+
+static void map_init(block_map *map, unsigned long long capacity)
+{
+	unsigned long long index;
+	unsigned long long size = 16;
+
+	while (size < capacity) {
+		size <<= 1;
+	}
+	capacity = size;
+
+	map->entries = (map_entry *) malloc(sizeof(map_entry) * capacity);
+	if (map->entries == NULL) {
+		printf("Could not allocate a block map of %llu entries\n", capacity);
+		exit(1);
+	}
+	for (index = 0; index < capacity; index ++) {
+		map->entries[index].key = MAP_EMPTY;
+	}
+	map->mask = capacity - 1;
+	map->count = 0;
+}
+
+static void map_free(block_map *map)
+{
+	free(map->entries);
+	map->entries = NULL;
+}
+
+static unsigned long long map_slot(block_map *map, mem_addr_t key)
+{
+	key ^= key >> 33;
+	key *= 0xFF51AFD7ED558CCDULL;
+	key ^= key >> 33;
+	return key & map->mask;
+}
+
+/* map_find - the value stored for key, or NULL */
+static unsigned long long *map_find(block_map *map, mem_addr_t key)
+{
+	unsigned long long index = map_slot(map, key);
+
+	while (map->entries[index].key != MAP_EMPTY) {
+		if (map->entries[index].key == key) {
+			return &map->entries[index].value;
+		}
+		index = (index + 1) & map->mask;
+	}
+	return NULL;
+}
+
+/* map_insert - the value stored for key, adding it with value 0 (and
+ * setting *added) if it is new; the pointer is valid until the next
+ * insert */
+static unsigned long long *map_insert(block_map *map, mem_addr_t key, int *added)
+{
+	unsigned long long index;
+
+	if ((map->count + 1) * 4 > (map->mask + 1) * 3) {
+		block_map bigger;
+		unsigned long long old;
+
+		map_init(&bigger, (map->mask + 1) * 2);
+		for (old = 0; old <= map->mask; old ++) {
+			if (map->entries[old].key != MAP_EMPTY) {
+				*map_insert(&bigger, map->entries[old].key, added) = map->entries[old].value;
+			}
+		}
+		map_free(map);
+		*map = bigger;
+	}
+
+	index = map_slot(map, key);
+	while (map->entries[index].key != MAP_EMPTY) {
+		if (map->entries[index].key == key) {
+			*added = 0;
+			return &map->entries[index].value;
+		}
+		index = (index + 1) & map->mask;
+	}
+
+	map->entries[index].key = key;
+	map->entries[index].value = 0;
+	map->count ++;
+	*added = 1;
+	return &map->entries[index].value;
+}
+
+/* map_remove - drop key if present */
+static void map_remove(block_map *map, mem_addr_t key)
+{
+	unsigned long long index = map_slot(map, key);
+	unsigned long long next;
+
+	while (map->entries[index].key != key) {
+		if (map->entries[index].key == MAP_EMPTY) {
+			return;
+		}
+		index = (index + 1) & map->mask;
+	}
+
+	//Shift later members of the probe run back over the hole.
+	for (next = (index + 1) & map->mask; map->entries[next].key != MAP_EMPTY; next = (next + 1) & map->mask) {
+		unsigned long long home = map_slot(map, map->entries[next].key);
+
+		if (((next - home) & map->mask) >= ((next - index) & map->mask)) {
+			map->entries[index] = map->entries[next];
+			index = next;
+		}
+	}
+	map->entries[index].key = MAP_EMPTY;
+	map->count --;
+}
+
+/*
+ * Profiling.
+ *
+ * With -o, every block access run_sim sees is also fed to a profiler
+ * that writes a JSON report at the end:
+ *   reuse_distance   histogram of how many distinct blocks were touched
+ *                    between two accesses to the same block, in
+ *                    power-of-two buckets, plus first touches ("cold")
+ *   set_misses       misses and evictions per set, and the hot sets
+ *                    with at least twice the mean misses; these are
+ *                    where conflict misses pile up
+ *   working_set      distinct blocks touched in each window of accesses
+ *   top_miss_blocks  the blocks that missed most
+ * Reuse distances come from a Fenwick tree over access times in which
+ * only each block's latest access is marked, so one distance costs
+ * O(log n).  When the tree fills up, live blocks are renumbered in
+ * order of their latest access and the tree is rebuilt.
+ */
+
+#define RD_BUCKETS	48	/* bucket 0 is distance 0, bucket k is [2**(k-1), 2**k) */
+#define TOP_K		20
+#define DEFAULT_WINDOW	100000
+
+typedef struct {
+	mem_addr_t block;
+	long long last_time;	/* latest access, as a position in the tree */
+	long long window;	/* latest working-set window that touched it */
+	long long misses;
+} block_profile;
+
+struct profiler {
+	block_map map;		/* block number -> index into blocks[] */
+	block_profile *blocks;
+	long long num_blocks;
+	long long max_blocks;
+
+	int *tree;		/* Fenwick tree, 1-based */
+	long long tree_size;
+	long long now;		/* next access time */
+
+	long long accesses;
+	long long cold;
+	long long reuse[RD_BUCKETS];
+
+	long long *set_misses;
+	long long *set_evicts;
+
+	long long window_size;
+	long long window;	/* current window number */
+	long long window_blocks;	/* distinct blocks in the current window */
+	long long window_accesses;
+	long long *working_set;	/* distinct blocks per finished window */
+	long long max_windows;
+};
+
+static void tree_add(profiler_t *prof, long long pos, int delta)
+{
+	for (pos ++; pos <= prof->tree_size; pos += pos & -pos) {
+		prof->tree[pos] += delta;
+	}
+}
+
+/* tree_sum - marked positions in [0, pos] */
+static long long tree_sum(profiler_t *prof, long long pos)
+{
+	long long sum = 0;
+
+	for (pos ++; pos > 0; pos -= pos & -pos) {
+		sum += prof->tree[pos];
+	}
+	return sum;
+}
+
+static void init_profiler(profiler_t *prof, cache_param_t *par, long long window_size)
+{
+	bzero(prof, sizeof(*prof));
+	map_init(&prof->map, 1 << 16);
+	prof->max_blocks = 1 << 16;
+	prof->blocks = (block_profile *) malloc(sizeof(block_profile) * prof->max_blocks);
+	prof->tree_size = 1 << 20;
+	prof->tree = (int *) calloc(prof->tree_size + 1, sizeof(int));
+	prof->set_misses = (long long *) calloc(par->S, sizeof(long long));
+	prof->set_evicts = (long long *) calloc(par->S, sizeof(long long));
+	prof->window_size = window_size;
+	prof->max_windows = 1024;
+	prof->working_set = (long long *) malloc(sizeof(long long) * prof->max_windows);
+
+	if (prof->blocks == NULL || prof->tree == NULL || prof->set_misses == NULL ||
+	    prof->set_evicts == NULL || prof->working_set == NULL) {
+		printf("Could not allocate the profiler\n");
+		exit(1);
+	}
+}
+
+static void free_profiler(profiler_t *prof)
+{
+	map_free(&prof->map);
+	free(prof->blocks);
+	free(prof->tree);
+	free(prof->set_misses);
+	free(prof->set_evicts);
+	free(prof->working_set);
+}
+
+static profiler_t *compare_prof;
+
+static int compare_last_time(const void *a, const void *b)
+{
+	long long ta = compare_prof->blocks[*(const long long *) a].last_time;
+	long long tb = compare_prof->blocks[*(const long long *) b].last_time;
+
+	return (ta > tb) - (ta < tb);
+}
+
+/* compact_profiler - renumber every block's latest access to 0..n-1,
+ * keeping their order, and rebuild the tree (growing it if it would be
+ * more than half full) */
+static void compact_profiler(profiler_t *prof)
+{
+	long long *order = (long long *) malloc(sizeof(long long) * prof->num_blocks);
+	long long index;
+
+	if (order == NULL) {
+		printf("Could not allocate the profiler\n");
+		exit(1);
+	}
+	for (index = 0; index < prof->num_blocks; index ++) {
+		order[index] = index;
+	}
+	compare_prof = prof;
+	qsort(order, prof->num_blocks, sizeof(long long), compare_last_time);
+
+	if (prof->num_blocks * 2 > prof->tree_size) {
+		prof->tree_size *= 2;
+		free(prof->tree);
+		prof->tree = (int *) malloc(sizeof(int) * (prof->tree_size + 1));
+		if (prof->tree == NULL) {
+			printf("Could not allocate the profiler\n");
+			exit(1);
+		}
+	}
+	bzero(prof->tree, sizeof(int) * (prof->tree_size + 1));
+
+	for (index = 0; index < prof->num_blocks; index ++) {
+		prof->blocks[order[index]].last_time = index;
+		tree_add(prof, index, 1);
+	}
+	prof->now = prof->num_blocks;
+	free(order);
+}
+
+static void profile_access(profiler_t *prof, cache_param_t *par, mem_addr_t address, int flags)
+{
+	mem_addr_t block = address >> par->b;
+	unsigned long long setIndex = block & (par->S - 1);
+	unsigned long long *slot;
+	block_profile *record;
+	int added;
+
+	slot = map_insert(&prof->map, block, &added);
+	if (added) {
+		if (prof->num_blocks == prof->max_blocks) {
+			prof->max_blocks *= 2;
+			prof->blocks = (block_profile *) realloc(prof->blocks, sizeof(block_profile) * prof->max_blocks);
+			if (prof->blocks == NULL) {
+				printf("Could not allocate the profiler\n");
+				exit(1);
+			}
+		}
+		*slot = prof->num_blocks;
+		record = &prof->blocks[prof->num_blocks ++];
+		record->block = block;
+		record->last_time = -1;
+		record->window = -1;
+		record->misses = 0;
+	}
+	record = &prof->blocks[*slot];
+
+	//Reuse distance.
+	if (prof->now == prof->tree_size) {
+		compact_profiler(prof);
+	}
+	if (record->last_time < 0) {
+		prof->cold ++;
+	} else {
+		long long distance = tree_sum(prof, prof->now - 1) - tree_sum(prof, record->last_time);
+		int bucket = 0;
+
+		while (distance > 0) {
+			bucket ++;
+			distance >>= 1;
+		}
+		prof->reuse[bucket] ++;
+		tree_add(prof, record->last_time, -1);
+	}
+	tree_add(prof, prof->now, 1);
+	record->last_time = prof->now ++;
+	prof->accesses ++;
+
+	//Working set.
+	if (record->window != prof->window) {
+		record->window = prof->window;
+		prof->window_blocks ++;
+	}
+	if (++ prof->window_accesses == prof->window_size) {
+		if (prof->window == prof->max_windows) {
+			prof->max_windows *= 2;
+			prof->working_set = (long long *) realloc(prof->working_set, sizeof(long long) * prof->max_windows);
+			if (prof->working_set == NULL) {
+				printf("Could not allocate the profiler\n");
+				exit(1);
+			}
+		}
+		prof->working_set[prof->window ++] = prof->window_blocks;
+		prof->window_blocks = 0;
+		prof->window_accesses = 0;
+	}
+
+	//Misses per set and per block.
+	if (flags & SIM_MISS) {
+		record->misses ++;
+		prof->set_misses[setIndex] ++;
+	}
+	if (flags & SIM_EVICT) {
+		prof->set_evicts[setIndex] ++;
+	}
+}
+
+/* write_profile - dump the profile as JSON to file */
+static void write_profile(profiler_t *prof, cache_param_t *par, const char *file)
+{
+	FILE *out = fopen(file, "w");
+	long long top[TOP_K];
+	int num_top = 0;
+	long long total_misses = 0;
+	long long index;
+	int bucket;
+	int last_bucket = 0;
+	int pos;
+
+	if (out == NULL) {
+		printf("Could not open profile output %s\n", file);
+		exit(1);
+	}
+
+	fprintf(out, "{\n  \"config\": {\"s\": %d, \"E\": %d, \"b\": %d, \"policy\": \"%s\"},\n",
+		par->s, par->E, par->b, par->policy->name);
+	fprintf(out, "  \"block_accesses\": %lld,\n", prof->accesses);
+	fprintf(out, "  \"distinct_blocks\": %lld,\n", prof->num_blocks);
+
+	for (bucket = 0; bucket < RD_BUCKETS; bucket ++) {
+		if (prof->reuse[bucket] != 0) {
+			last_bucket = bucket;
+		}
+	}
+	fprintf(out, "  \"reuse_distance\": {\n    \"cold\": %lld,\n    \"buckets\": [", prof->cold);
+	for (bucket = 0; bucket <= last_bucket; bucket ++) {
+		long long low = bucket ? 1LL << (bucket - 1) : 0;
+		long long high = bucket ? (1LL << bucket) - 1 : 0;
+
+		fprintf(out, "%s\n      {\"min\": %lld, \"max\": %lld, \"count\": %lld}",
+			bucket ? "," : "", low, high, prof->reuse[bucket]);
+	}
+	fprintf(out, "\n    ]\n  },\n");
+
+	fprintf(out, "  \"set_misses\": [");
+	for (index = 0; index < par->S; index ++) {
+		fprintf(out, "%s%lld", index ? ", " : "", prof->set_misses[index]);
+		total_misses += prof->set_misses[index];
+	}
+	fprintf(out, "],\n  \"set_evictions\": [");
+	for (index = 0; index < par->S; index ++) {
+		fprintf(out, "%s%lld", index ? ", " : "", prof->set_evicts[index]);
+	}
+
+	//Hot sets: at least twice the mean, worst first.
+	for (index = 0; index < par->S; index ++) {
+		if (prof->set_misses[index] == 0 || prof->set_misses[index] * par->S < 2 * total_misses) {
+			continue;
+		}
+		for (pos = num_top; pos > 0 && prof->set_misses[top[pos - 1]] < prof->set_misses[index]; pos --) {
+			if (pos < TOP_K) {
+				top[pos] = top[pos - 1];
+			}
+		}
+		if (pos < TOP_K) {
+			top[pos] = index;
+			if (num_top < TOP_K) {
+				num_top ++;
+			}
+		}
+	}
+	fprintf(out, "],\n  \"hot_sets\": [");
+	for (pos = 0; pos < num_top; pos ++) {
+		fprintf(out, "%s\n    {\"set\": %lld, \"misses\": %lld, \"times_mean\": %.2f}",
+			pos ? "," : "", top[pos], prof->set_misses[top[pos]],
+			(double) prof->set_misses[top[pos]] * par->S / total_misses);
+	}
+	fprintf(out, "%s],\n", num_top ? "\n  " : "");
+
+	fprintf(out, "  \"working_set\": {\n    \"window\": %lld,\n    \"windows\": [", prof->window_size);
+	for (index = 0; index <= prof->window; index ++) {
+		long long blocks = (index < prof->window) ? prof->working_set[index] : prof->window_blocks;
+		long long accesses = (index < prof->window) ? prof->window_size : prof->window_accesses;
+
+		if (accesses == 0) {
+			break;
+		}
+		fprintf(out, "%s\n      {\"start\": %lld, \"accesses\": %lld, \"blocks\": %lld, \"bytes\": %lld}",
+			index ? "," : "", index * prof->window_size, accesses, blocks, blocks * par->B);
+	}
+	fprintf(out, "%s]\n  },\n", prof->accesses ? "\n    " : "");
+
+	//Top missing blocks.
+	num_top = 0;
+	for (index = 0; index < prof->num_blocks; index ++) {
+		if (prof->blocks[index].misses == 0) {
+			continue;
+		}
+		for (pos = num_top; pos > 0 && prof->blocks[top[pos - 1]].misses < prof->blocks[index].misses; pos --) {
+			if (pos < TOP_K) {
+				top[pos] = top[pos - 1];
+			}
+		}
+		if (pos < TOP_K) {
+			top[pos] = index;
+			if (num_top < TOP_K) {
+				num_top ++;
+			}
+		}
+	}
+	fprintf(out, "  \"top_miss_blocks\": [");
+	for (pos = 0; pos < num_top; pos ++) {
+		block_profile *record = &prof->blocks[top[pos]];
+
+		fprintf(out, "%s\n    {\"address\": \"0x%llx\", \"set\": %llu, \"misses\": %lld}",
+			pos ? "," : "", record->block << par->b, record->block & (par->S - 1), record->misses);
+	}
+	fprintf(out, "%s]\n}\n", num_top ? "\n  " : "");
+	fclose(out);
+}
+
+/*
+ * Miss classification.
+ *
+ * With -3, every miss is sorted into one of the three C's:
+ *   compulsory  the first access to the block
+ *   capacity    a fully associative LRU cache of the same size would
+ *               also have missed
+ *   conflict    anything else; the set mapping is to blame
+ * The fully associative shadow cache is a doubly linked LRU list over
+ * S * E nodes.  A single block map serves as both its tag store and
+ * the set of blocks ever seen: a block's value is its node plus one
+ * while it is in the shadow cache and 0 once it has been pushed out, so
+ * each access costs one hash lookup.  The shadow sees only demand
+ * accesses and follows the write-allocate policy of the real cache.
+ */
+
+#define NO_NODE	(~0U)
+
+typedef struct {
+	mem_addr_t block;
+	unsigned int prev;
+	unsigned int next;
+} shadow_node;
+
+struct classifier {
+	block_map map;		/* block number -> shadow node + 1, or 0 */
+	shadow_node *nodes;
+	unsigned int num_nodes;	/* nodes in use */
+	unsigned int max_nodes;	/* S * E */
+	unsigned int head;	/* most recently used */
+	unsigned int tail;	/* least recently used */
+
+	long long compulsory;
+	long long capacity;
+	long long conflict;
+};
+
+static void init_classifier(classifier_t *cls, cache_param_t *par)
+{
+	unsigned long long lines = (unsigned long long) par->S * par->E;
+
+	if (lines >= NO_NODE) {
+		printf("Cache too large to classify misses\n");
+		exit(1);
+	}
+	cls->max_nodes = (unsigned int) lines;
+	cls->nodes = (shadow_node *) malloc(sizeof(shadow_node) * cls->max_nodes);
+	if (cls->nodes == NULL) {
+		printf("Could not allocate the shadow cache\n");
+		exit(1);
+	}
+	map_init(&cls->map, 2 * lines);
+	cls->num_nodes = 0;
+	cls->head = NO_NODE;
+	cls->tail = NO_NODE;
+	cls->compulsory = 0;
+	cls->capacity = 0;
+	cls->conflict = 0;
+}
+
+static void free_classifier(classifier_t *cls)
+{
+	map_free(&cls->map);
+	free(cls->nodes);
+}
+
+static void shadow_unlink(classifier_t *cls, unsigned int node)
+{
+	shadow_node *n = &cls->nodes[node];
+
+	if (n->prev != NO_NODE) {
+		cls->nodes[n->prev].next = n->next;
+	} else {
+		cls->head = n->next;
+	}
+	if (n->next != NO_NODE) {
+		cls->nodes[n->next].prev = n->prev;
+	} else {
+		cls->tail = n->prev;
+	}
+}
+
+static void shadow_push(classifier_t *cls, unsigned int node)
+{
+	cls->nodes[node].prev = NO_NODE;
+	cls->nodes[node].next = cls->head;
+	if (cls->head != NO_NODE) {
+		cls->nodes[cls->head].prev = node;
+	} else {
+		cls->tail = node;
+	}
+	cls->head = node;
+}
+
+/* shadow_access - access the shadow cache; returns 1 on a miss and sets
+ * *first if the block had never been seen */
+static int shadow_access(classifier_t *cls, mem_addr_t block, int allocate, int *first)
+{
+	unsigned long long *value = map_insert(&cls->map, block, first);
+	unsigned int node;
+
+	if (*value != 0) {
+		node = (unsigned int) (*value - 1);
+		if (node != cls->head) {
+			shadow_unlink(cls, node);
+			shadow_push(cls, node);
+		}
+		return 0;
+	}
+	if (!allocate) {
+		return 1;
+	}
+
+	if (cls->num_nodes < cls->max_nodes) {
+		node = cls->num_nodes ++;
+	} else {
+		//Push out the LRU block; it stays in the map as seen.
+		node = cls->tail;
+		shadow_unlink(cls, node);
+		*map_find(&cls->map, cls->nodes[node].block) = 0;
+	}
+	cls->nodes[node].block = block;
+	shadow_push(cls, node);
+	*value = node + 1;
+	return 1;
+}
+
+/* classify_access - run a demand block access that run_sim answered
+ * with flags through the shadow cache and classify it if it missed */
+static void classify_access(classifier_t *cls, cache_param_t *par, mem_addr_t address, int is_write, int flags)
+{
+	int allocate = !(is_write && par->no_write_allocate);
+	int first;
+	int shadow_miss = shadow_access(cls, address >> par->b, allocate, &first);
+
+	if (!(flags & SIM_MISS)) {
+		return;
+	}
+	if (first) {
+		cls->compulsory ++;
+	} else if (shadow_miss) {
+		cls->capacity ++;
+	} else {
+		cls->conflict ++;
+	}
+}
+
+static void print_classifier(classifier_t *cls)
+{
+	printf("compulsory:%lld capacity:%lld conflict:%lld\n",
+	       cls->compulsory, cls->capacity, cls->conflict);
+}
+
+/*
+ * Interval statistics and phases.
+ *
+ * With -i N, the counters are reported for every N trace accesses, and
+ * each interval gets a signature: the fraction of its block accesses
+ * that missed in each of PHASE_GROUPS groups of sets.  Intervals are
+ * clustered online: an interval joins the phase whose mean signature
+ * is nearest (Manhattan distance) if that is within the threshold, and
+ * starts a new phase otherwise.  At the end every phase is listed with
+ * its share of the trace and the interval closest to its mean, which
+ * can stand in for the whole phase when sampling.
+ */
+
+#define PHASE_GROUPS	16	/* set groups in a signature */
+#define PHASE_THRESHOLD	0.05	/* default distance to join a phase */
+
+typedef struct {
+	double sum[PHASE_GROUPS];	/* of member signatures, for the mean */
+	long long intervals;
+	long long hits;
+	long long misses;
+	long long evicts;
+} phase_t;
+
+struct intervals {
+	long long length;	/* trace accesses per interval */
+	double threshold;
+
+	long long start_hits;	/* counters when the interval began */
+	long long start_misses;
+	long long start_evicts;
+	long long start_accesses;
+	long long blocks;	/* block accesses in the interval */
+	long long group_misses[PHASE_GROUPS];
+
+	long long num_intervals;	/* reported so far */
+	float *signatures;	/* PHASE_GROUPS per full interval */
+	int *phase_of;		/* phase of each full interval */
+	long long num_full;
+	long long max_full;
+
+	phase_t *phases;
+	int num_phases;
+	int max_phases;
+};
+
+/* parse_intervals - read N[:diff] into *iv */
+static int parse_intervals(const char *spec, intervals_t *iv)
+{
+	const char *colon = strchr(spec, ':');
+
+	bzero(iv, sizeof(*iv));
+	iv->length = atoll(spec);
+	iv->threshold = PHASE_THRESHOLD;
+	if (colon != NULL) {
+		iv->threshold = atof(colon + 1);
+	}
+	return (iv->length > 0 && iv->threshold >= 0) ? 0 : -1;
+}
+
+static double phase_distance(phase_t *phase, const float *signature)
+{
+	double distance = 0;
+	int g;
+
+	for (g = 0; g < PHASE_GROUPS; g ++) {
+		distance += fabs(phase->sum[g] / phase->intervals - signature[g]);
+	}
+	return distance;
+}
+
+/* interval_block - count a block access that run_sim answered with flags */
+static void interval_block(intervals_t *iv, cache_param_t *par, mem_addr_t address, int flags)
+{
+	iv->blocks ++;
+	if (flags & SIM_MISS) {
+		iv->group_misses[((address >> par->b) & (par->S - 1)) % PHASE_GROUPS] ++;
+	}
+}
+
+/* close_interval - report the interval that just ended and place it in
+ * a phase; partial (the trace ended first) intervals are reported only */
+static void close_interval(intervals_t *iv, cache_param_t *par, int partial)
+{
+	long long hits = par->hits - iv->start_hits;
+	long long misses = par->misses - iv->start_misses;
+	long long evicts = par->evicts - iv->start_evicts;
+	long long accesses = par->accesses - iv->start_accesses;
+	float *signature;
+	int best = -1;
+	double best_distance = 0;
+	int g;
+
+	printf("interval:%lld accesses:%lld hits:%lld misses:%lld evictions:%lld miss_rate:%.4f",
+	       iv->num_intervals, accesses, hits, misses, evicts,
+	       (hits + misses) ? (double) misses / (hits + misses) : 0.0);
+
+	if (partial) {
+		printf(" phase:-\n");
+	} else {
+		if (iv->num_full == iv->max_full) {
+			iv->max_full = iv->max_full ? 2 * iv->max_full : 1024;
+			iv->signatures = (float *) realloc(iv->signatures, sizeof(float) * PHASE_GROUPS * iv->max_full);
+			iv->phase_of = (int *) realloc(iv->phase_of, sizeof(int) * iv->max_full);
+			if (iv->signatures == NULL || iv->phase_of == NULL) {
+				printf("Could not allocate interval signatures\n");
+				exit(1);
+			}
+		}
+		signature = &iv->signatures[iv->num_full * PHASE_GROUPS];
+		for (g = 0; g < PHASE_GROUPS; g ++) {
+			signature[g] = iv->blocks ? (float) iv->group_misses[g] / iv->blocks : 0.0f;
+		}
+
+		for (g = 0; g < iv->num_phases; g ++) {
+			double distance = phase_distance(&iv->phases[g], signature);
+
+			if (best < 0 || distance < best_distance) {
+				best = g;
+				best_distance = distance;
+			}
+		}
+		if (best < 0 || best_distance > iv->threshold) {
+			if (iv->num_phases == iv->max_phases) {
+				iv->max_phases = iv->max_phases ? 2 * iv->max_phases : 16;
+				iv->phases = (phase_t *) realloc(iv->phases, sizeof(phase_t) * iv->max_phases);
+				if (iv->phases == NULL) {
+					printf("Could not allocate phases\n");
+					exit(1);
+				}
+			}
+			best = iv->num_phases ++;
+			bzero(&iv->phases[best], sizeof(phase_t));
+		}
+
+		for (g = 0; g < PHASE_GROUPS; g ++) {
+			iv->phases[best].sum[g] += signature[g];
+		}
+		iv->phases[best].intervals ++;
+		iv->phases[best].hits += hits;
+		iv->phases[best].misses += misses;
+		iv->phases[best].evicts += evicts;
+		iv->phase_of[iv->num_full ++] = best;
+		printf(" phase:%d\n", best);
+	}
+
+	iv->num_intervals ++;
+	iv->start_hits = par->hits;
+	iv->start_misses = par->misses;
+	iv->start_evicts = par->evicts;
+	iv->start_accesses = par->accesses;
+	iv->blocks = 0;
+	bzero(iv->group_misses, sizeof(iv->group_misses));
+}
+
+/* print_phases - summarize the phases */
+static void print_phases(intervals_t *iv)
+{
+	long long index;
+	int p;
+
+
+	for (p = 0; p < iv->num_phases; p ++) {
+		phase_t *phase = &iv->phases[p];
+		long long representative = -1;
+		double best_distance = 0;
+
+		for (index = 0; index < iv->num_full; index ++) {
+			if (iv->phase_of[index] == p) {
+				double distance = phase_distance(phase, &iv->signatures[index * PHASE_GROUPS]);
+
+				if (representative < 0 || distance < best_distance) {
+					representative = index;
+					best_distance = distance;
+				}
+			}
+		}
+		printf("phase:%d intervals:%lld weight:%.2f%% miss_rate:%.4f evictions:%lld representative:%lld\n",
+		       p, phase->intervals, 100.0 * phase->intervals / iv->num_full,
+		       (phase->hits + phase->misses) ? (double) phase->misses / (phase->hits + phase->misses) : 0.0,
+		       phase->evicts, representative);
+	}
+}
+
+static void free_intervals(intervals_t *iv)
+{
+	free(iv->signatures);
+	free(iv->phase_of);
+	free(iv->phases);
+}
+
+/*
+ * Sampling.
+ *
+ * -m trades accuracy for speed in one of two ways:
+ *   sets:K          only sets whose index is a multiple of K are
+ *                   simulated; accesses to the others are dropped
+ *                   before run_sim
+ *   intervals:P:W:M the trace is cut into periods of P accesses; the
+ *                   first P - W - M of each are skipped, the next W
+ *                   warm the cache up and only the last M are counted
+ * Either way the sampled units (sets or measured windows) give a ratio
+ * estimate: the counters scale by the accesses of the whole trace over
+ * the accesses of the sampled units, and the spread of misses across
+ * units gives a 95% confidence interval for the miss total.
+ */
+
+#define SAMPLE_SETS		1
+#define SAMPLE_INTERVALS	2
+
+typedef struct {
+	long long accesses;	/* block accesses (sets) or trace accesses (windows) */
+	long long misses;
+} sample_unit;
+
+struct sampler {
+	int kind;
+	long long every;	/* sets: K */
+	long long period;	/* intervals: P, W and M */
+	long long warm;
+	long long measure;
+
+	long long total;	/* accesses of the whole trace, in unit terms */
+	long long position;	/* trace accesses so far */
+	cache_param_t start;	/* counters when the window being measured began */
+	cache_param_t kept;	/* measured counters */
+	int measuring;
+
+	sample_unit *units;
+	long long num_units;
+	long long max_units;
+	long long population;	/* units the trace has in all */
+};
+
+/* parse_sampler - read sets:K or intervals:P[:W[:M]] into *sp */
+static int parse_sampler(const char *spec, sampler_t *sp)
+{
+	bzero(sp, sizeof(*sp));
+	if (strncmp(spec, "sets:", 5) == 0) {
+		sp->kind = SAMPLE_SETS;
+		sp->every = atoll(spec + 5);
+		return (sp->every > 0) ? 0 : -1;
+	}
+	if (strncmp(spec, "intervals:", 10) == 0) {
+		char *rest;
+
+		sp->kind = SAMPLE_INTERVALS;
+		sp->period = strtoll(spec + 10, &rest, 10);
+		sp->warm = sp->period / 10;
+		sp->measure = sp->period / 10;
+		if (*rest == ':') {
+			sp->warm = strtoll(rest + 1, &rest, 10);
+			if (*rest == ':') {
+				sp->measure = strtoll(rest + 1, &rest, 10);
+			}
+		}
+		return (sp->period > 0 && sp->warm >= 0 && sp->measure > 0 &&
+			sp->warm + sp->measure <= sp->period) ? 0 : -1;
+	}
+	return -1;
+}
+
+static void init_sampler(sampler_t *sp, cache_param_t *par)
+{
+	if (sp->kind == SAMPLE_SETS) {
+		if (sp->every > par->S) {
+			sp->every = par->S;
+		}
+		sp->max_units = (par->S + sp->every - 1) / sp->every;
+		sp->num_units = sp->max_units;
+		sp->population = par->S;
+		sp->units = (sample_unit *) calloc(sp->max_units, sizeof(sample_unit));
+		if (sp->units == NULL) {
+			printf("Could not allocate %lld sampled sets\n", sp->max_units);
+			exit(1);
+		}
+	}
+}
+
+/* sample_access - called for every trace access; 0 if it is to be
+ * skipped entirely */
+static int sample_access(sampler_t *sp, cache_param_t *par)
+{
+	long long offset;
+
+	if (sp->kind != SAMPLE_INTERVALS) {
+		return 1;
+	}
+
+	offset = sp->position % sp->period;
+	sp->position ++;
+	if (offset < sp->period - sp->warm - sp->measure) {
+		return 0;
+	}
+	if (offset == sp->period - sp->measure) {
+		if (sp->num_units == sp->max_units) {
+			sp->max_units = sp->max_units ? 2 * sp->max_units : 1024;
+			sp->units = (sample_unit *) realloc(sp->units, sizeof(sample_unit) * sp->max_units);
+			if (sp->units == NULL) {
+				printf("Could not allocate sample windows\n");
+				exit(1);
+			}
+		}
+		sp->units[sp->num_units].accesses = 0;
+		sp->units[sp->num_units].misses = 0;
+		sp->num_units ++;
+		sp->start = *par;
+		sp->measuring = 1;
+	}
+	if (sp->measuring) {
+		sp->units[sp->num_units - 1].accesses ++;
+	}
+	return 1;
+}
+
+/* sample_end_access - close the measured window after its last access */
+static void sample_end_access(sampler_t *sp, cache_param_t *par)
+{
+	if (sp->measuring && sp->position % sp->period == 0) {
+		add_counters(&sp->kept, par);
+		sub_counters(&sp->kept, &sp->start);
+		sp->measuring = 0;
+	}
+}
+
+/* sample_set - 0 if the block access to address falls in a set that is
+ * not sampled */
+static int sample_set(sampler_t *sp, cache_param_t *par, mem_addr_t address)
+{
+	unsigned long long setIndex;
+
+	if (sp->kind != SAMPLE_SETS) {
+		return 1;
+	}
+	setIndex = (address >> par->b) & (par->S - 1);
+	sp->total ++;
+	if (setIndex % sp->every != 0) {
+		return 0;
+	}
+	sp->units[setIndex / sp->every].accesses ++;
+	return 1;
+}
+
+/* sample_result - count a sampled block access run_sim answered with flags */
+static void sample_result(sampler_t *sp, cache_param_t *par, mem_addr_t address, int flags)
+{
+	if (!(flags & SIM_MISS)) {
+		return;
+	}
+	if (sp->kind == SAMPLE_SETS) {
+		sp->units[((address >> par->b) & (par->S - 1)) / sp->every].misses ++;
+	} else if (sp->measuring) {
+		sp->units[sp->num_units - 1].misses ++;
+	}
+}
+
+/*
+ * finish_sampler - replace par's event counters with estimates for the
+ * whole trace; *half_width gets the 95% confidence half-width of the
+ * miss estimate
+ */
+static void finish_sampler(sampler_t *sp, cache_param_t *par, double *half_width)
+{
+	long long sampled = 0;
+	long long misses = 0;
+	double ratio;
+	double scale;
+	double spread = 0;
+	double mean;
+	double fraction;
+	long long index;
+
+	if (sp->kind == SAMPLE_SETS) {
+		sp->kept = *par;
+	} else {
+		//A trace that ends inside a window still counts what it measured.
+		if (sp->measuring) {
+			add_counters(&sp->kept, par);
+			sub_counters(&sp->kept, &sp->start);
+			sp->measuring = 0;
+		}
+		sp->total = sp->position;
+		sp->population = (sp->position + sp->period - 1) / sp->period;
+	}
+
+	for (index = 0; index < sp->num_units; index ++) {
+		sampled += sp->units[index].accesses;
+		misses += sp->units[index].misses;
+	}
+	ratio = sampled ? (double) misses / sampled : 0.0;
+	scale = sampled ? (double) sp->total / sampled : 0.0;
+
+	par->hits = (long long) (sp->kept.hits * scale + 0.5);
+	par->misses = (long long) (sp->kept.misses * scale + 0.5);
+	par->evicts = (long long) (sp->kept.evicts * scale + 0.5);
+	par->dirty_evicts = (long long) (sp->kept.dirty_evicts * scale + 0.5);
+	par->writebacks = (long long) (sp->kept.writebacks * scale + 0.5);
+	par->writeback_bytes = (long long) (sp->kept.writeback_bytes * scale + 0.5);
+
+	//Standard error of a ratio estimator under simple random sampling.
+	*half_width = 0;
+	if (sp->num_units > 1 && sampled > 0) {
+		for (index = 0; index < sp->num_units; index ++) {
+			double residual = sp->units[index].misses - ratio * sp->units[index].accesses;
+
+			spread += residual * residual;
+		}
+		spread /= sp->num_units - 1;
+		mean = (double) sampled / sp->num_units;
+		fraction = (double) sp->num_units / sp->population;
+		if (fraction > 1) {
+			fraction = 1;
+		}
+		*half_width = 1.96 * sp->total * sqrt((1 - fraction) * spread / sp->num_units) / mean;
+	}
+}
+
+static void print_sampler(sampler_t *sp, cache_param_t *par, double half_width)
+{
+	long long demand = par->hits + par->misses;
+
+	if (sp->kind == SAMPLE_SETS) {
+		printf("sampled: sets %lld of %lld (1/%lld)", sp->num_units, sp->population, sp->every);
+	} else {
+		printf("sampled: windows %lld of %lld (%lld of every %lld accesses, %lld warm-up)",
+		       sp->num_units, sp->population, sp->measure, sp->period, sp->warm);
+	}
+	printf(" misses:%lld +/-%.0f miss_rate:%.4f +/-%.4f (95%%)\n", par->misses, half_width,
+	       demand ? (double) par->misses / demand : 0.0, demand ? half_width / demand : 0.0);
+}
+
+static void free_sampler(sampler_t *sp)
+{
+	free(sp->units);
+}
+
+/*
+ * Trace input.
+ *
+ * Traces are read by a decoder thread that fills a small ring of large
+ * chunks while the simulator parses the previous ones, so reading and
+ * decompressing overlap with simulation.  Each chunk ends on a line
+ * boundary (the decoder carries a partial last line over to the next
+ * chunk), so the parser never sees a record cut in two.  Chunks are
+ * handed over a megabyte at a time, so a mutex and condition variable
+ * cost nothing here and let whichever side is ahead sleep.
+ *
+ * The format is detected from the first bytes of the file: gzip needs
+ * a build with -DHAVE_ZLIB -lz and zstd one with -DHAVE_ZSTD -lzstd;
+ * anything else is read as plain text.
+ *
+ * Once decompressed, a trace that starts with TRACE_MAGIC is binary
+ * (tracegen -f binary writes these): fixed records of TRACE_RECORD
+ * bytes, little-endian, holding the address (8 bytes), size (4),
+ * thread id (2, NO_THREAD for none), operation character (1) and a
+ * spare byte.  Binary chunks end on a record boundary instead.
+ */
+
+#define TRACE_CHUNK	(1 << 20)	/* bytes per chunk */
+#define TRACE_CHUNKS	4		/* chunks in the ring */
+
+#define TRACE_MAGIC	"CSIMTRC1"
+#define TRACE_MAGIC_LEN	8
+#define TRACE_RECORD	16
+#define NO_THREAD	0xFFFF
+
+#define TRACE_PLAIN	0
+#define TRACE_GZIP	1
+#define TRACE_ZSTD	2
+
+typedef struct {
+	char *data;
+	long length;	/* bytes of whole lines, a partial line may follow */
+} trace_chunk;
+
+typedef struct {
+	int kind;
+	FILE *file;
+#ifdef HAVE_ZLIB
+	gzFile gz;
+#endif
+#ifdef HAVE_ZSTD
+	ZSTD_DStream *zstream;
+	ZSTD_inBuffer zin;
+	void *zin_buf;
+	size_t zin_size;
+	size_t zpending;	/* nonzero while a frame is unfinished */
+#endif
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	trace_chunk chunks[TRACE_CHUNKS];
+	unsigned long head;	/* chunks filled by the decoder */
+	unsigned long tail;	/* chunks released by the simulator */
+	int binary;		/* set before the first chunk is handed over */
+	int done;		/* the decoder has filled its last chunk */
+	int error;		/* ... because decompression failed */
+	int closing;		/* the simulator has stopped reading */
+
+	//Simulator-private.
+	const char *pos;
+	const char *end;
+	int holding;		/* pos points into chunks[tail] */
+} trace_reader_t;
+
+/* trace_read - read up to n decoded bytes; 0 at the end, -1 on error */
+static long trace_read(trace_reader_t *reader, char *buf, long n)
+{
+	switch (reader->kind) {
+#ifdef HAVE_ZLIB
+		case TRACE_GZIP: {
+			int got = gzread(reader->gz, buf, (unsigned int) n);
+			int errnum = Z_OK;
+
+			//A truncated file reads as a clean end; gzerror tells them apart.
+			if (got == 0) {
+				gzerror(reader->gz, &errnum);
+			}
+			return (errnum == Z_OK) ? got : -1;
+		}
+#endif
+#ifdef HAVE_ZSTD
+		case TRACE_ZSTD: {
+			ZSTD_outBuffer out = { buf, (size_t) n, 0 };
+
+			while (out.pos < out.size) {
+				size_t ret;
+
+				if (reader->zin.pos == reader->zin.size) {
+					reader->zin.size = fread(reader->zin_buf, 1, reader->zin_size, reader->file);
+					reader->zin.pos = 0;
+					if (reader->zin.size == 0) {
+						//A truncated file ends inside a frame.
+						if (out.pos == 0 && reader->zpending != 0) {
+							return -1;
+						}
+						break;
+					}
+				}
+				ret = ZSTD_decompressStream(reader->zstream, &out, &reader->zin);
+				if (ZSTD_isError(ret)) {
+					return -1;
+				}
+				reader->zpending = ret;
+			}
+			return (long) out.pos;
+		}
+#endif
+		default:
+			return (long) fread(buf, 1, n, reader->file);
+	}
+}
+
+static void *run_decoder(void *arg)
+{
+	trace_reader_t *reader = (trace_reader_t *) arg;
+	trace_chunk *prev = NULL;
+	long carry = 0;
+	int first = 1;
+
+	while (1) {
+		trace_chunk *chunk;
+		long filled;
+		long got = 1;
+		long line_end;
+
+		pthread_mutex_lock(&reader->lock);
+		while (reader->head - reader->tail == TRACE_CHUNKS && !reader->closing) {
+			pthread_cond_wait(&reader->changed, &reader->lock);
+		}
+		pthread_mutex_unlock(&reader->lock);
+		if (reader->closing) {
+			break;
+		}
+
+		//Only this thread writes chunks, and chunks[head] is free.
+		chunk = &reader->chunks[reader->head % TRACE_CHUNKS];
+		if (carry > 0) {
+			memcpy(chunk->data, prev->data + prev->length, carry);
+		}
+		for (filled = carry; filled < TRACE_CHUNK; filled += got) {
+			got = trace_read(reader, chunk->data + filled, TRACE_CHUNK - filled);
+			if (got <= 0) {
+				break;
+			}
+		}
+
+		if (first) {
+			first = 0;
+			if (filled >= TRACE_MAGIC_LEN && memcmp(chunk->data, TRACE_MAGIC, TRACE_MAGIC_LEN) == 0) {
+				reader->binary = 1;
+				filled -= TRACE_MAGIC_LEN;
+				memmove(chunk->data, chunk->data + TRACE_MAGIC_LEN, filled);
+			}
+		}
+
+		//Keep a line cut short by an error out of the parser as well.
+		line_end = filled;
+		if (reader->binary) {
+			if (got != 0) {
+				line_end -= filled % TRACE_RECORD;
+			}
+		} else if (got != 0) {
+			while (line_end > 0 && chunk->data[line_end - 1] != '\n') {
+				line_end --;
+			}
+			if (line_end == 0) {
+				//No newline at all; not a trace, but let the parser decide.
+				line_end = filled;
+			}
+		}
+		chunk->length = line_end;
+		carry = filled - line_end;
+		prev = chunk;
+
+		pthread_mutex_lock(&reader->lock);
+		reader->head ++;
+		if (got <= 0) {
+			reader->done = 1;
+			reader->error = (got < 0);
+		}
+		pthread_cond_broadcast(&reader->changed);
+		pthread_mutex_unlock(&reader->lock);
+		if (got <= 0) {
+			break;
+		}
+	}
+	return NULL;
+}
+
+/* trace_open - start reading the trace in file; NULL if it cannot be opened */
+static trace_reader_t *trace_open(const char *file)
+{
+	trace_reader_t *reader;
+	unsigned char magic[4] = { 0, 0, 0, 0 };
+	int index;
+
+	reader = (trace_reader_t *) calloc(1, sizeof(trace_reader_t));
+	if (reader == NULL) {
+		printf("Could not allocate a trace reader\n");
+		exit(1);
+	}
+	reader->file = fopen(file, "rb");
+	if (reader->file == NULL) {
+		free(reader);
+		return NULL;
+	}
+
+	if (fread(magic, 1, sizeof(magic), reader->file) == sizeof(magic)) {
+		if (magic[0] == 0x1F && magic[1] == 0x8B) {
+			reader->kind = TRACE_GZIP;
+		} else if (magic[0] == 0x28 && magic[1] == 0xB5 && magic[2] == 0x2F && magic[3] == 0xFD) {
+			reader->kind = TRACE_ZSTD;
+		}
+	}
+	rewind(reader->file);
+
+	switch (reader->kind) {
+		case TRACE_GZIP:
+#ifdef HAVE_ZLIB
+			fclose(reader->file);
+			reader->file = NULL;
+			reader->gz = gzopen(file, "rb");
+			if (reader->gz == NULL) {
+				free(reader);
+				return NULL;
+			}
+			gzbuffer(reader->gz, 1 << 17);
+			break;
+#else
+			printf("%s is gzip-compressed; rebuild with -DHAVE_ZLIB -lz to read it\n", file);
+			exit(1);
+#endif
+		case TRACE_ZSTD:
+#ifdef HAVE_ZSTD
+			reader->zstream = ZSTD_createDStream();
+			reader->zin_size = ZSTD_DStreamInSize();
+			reader->zin_buf = malloc(reader->zin_size);
+			if (reader->zstream == NULL || reader->zin_buf == NULL) {
+				printf("Could not set up zstd decompression\n");
+				exit(1);
+			}
+			ZSTD_initDStream(reader->zstream);
+			reader->zin.src = reader->zin_buf;
+			reader->zin.size = 0;
+			reader->zin.pos = 0;
+			break;
+#else
+			printf("%s is zstd-compressed; rebuild with -DHAVE_ZSTD -lzstd to read it\n", file);
+			exit(1);
+#endif
+		default:
+			break;
+	}
+
+	for (index = 0; index < TRACE_CHUNKS; index ++) {
+		reader->chunks[index].data = (char *) malloc(TRACE_CHUNK);
+		if (reader->chunks[index].data == NULL) {
+			printf("Could not allocate trace buffers\n");
+			exit(1);
+		}
+	}
+	pthread_mutex_init(&reader->lock, NULL);
+	pthread_cond_init(&reader->changed, NULL);
+	pthread_create(&reader->thread, NULL, run_decoder, reader);
+	return reader;
+}
+
+/* trace_chunk_next - move on to the next filled chunk; 0 at the end */
+static int trace_chunk_next(trace_reader_t *reader)
+{
+	trace_chunk *chunk;
+
+	pthread_mutex_lock(&reader->lock);
+	if (reader->holding) {
+		reader->tail ++;
+		reader->holding = 0;
+		pthread_cond_broadcast(&reader->changed);
+	}
+	while (reader->head == reader->tail && !reader->done) {
+		pthread_cond_wait(&reader->changed, &reader->lock);
+	}
+	if (reader->head == reader->tail) {
+		pthread_mutex_unlock(&reader->lock);
+		if (reader->error) {
+			printf("Could not decompress the trace file\n");
+			exit(1);
+		}
+		return 0;
+	}
+	chunk = &reader->chunks[reader->tail % TRACE_CHUNKS];
+	pthread_mutex_unlock(&reader->lock);
+
+	reader->pos = chunk->data;
+	reader->end = chunk->data + chunk->length;
+	reader->holding = 1;
+	return 1;
+}
+
+static int is_space(char c)
+{
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+}
+
+static int hex_digit(char c)
+{
+	if (c >= '0' && c <= '9') {
+		return c - '0';
+	}
+	if (c >= 'a' && c <= 'f') {
+		return c - 'a' + 10;
+	}
+	if (c >= 'A' && c <= 'F') {
+		return c - 'A' + 10;
+	}
+	return -1;
+}
+
+/* trace_next_binary - the next record of a binary trace */
+static int trace_next_binary(trace_reader_t *reader, char *trace_cmd, mem_addr_t *address, int *size,
+		      long long *thread)
+{
+	const unsigned char *p;
+	unsigned int id;
+	int index;
+
+	while (reader->end - reader->pos < TRACE_RECORD) {
+		if (!trace_chunk_next(reader)) {
+			return 0;
+		}
+	}
+	p = (const unsigned char *) reader->pos;
+	reader->pos += TRACE_RECORD;
+
+	*address = 0;
+	for (index = 7; index >= 0; index --) {
+		*address = (*address << 8) | p[index];
+	}
+	*size = (int) (p[8] | (p[9] << 8) | (p[10] << 16) | ((unsigned int) p[11] << 24));
+	id = p[12] | (p[13] << 8);
+	*trace_cmd = (char) p[14];
+	if (thread != NULL) {
+		*thread = (id == NO_THREAD) ? -1 : (long long) id;
+	}
+	return 1;
+}
+
+/*
+ * trace_next - the next record, parsed the way fscanf(" %c %llx,%d")
+ * would; returns 0 at the end of the trace or at a malformed record.
+ * A thread or core id may follow the size after a comma; *thread gets
+ * it, or -1 when there is none (thread may be NULL).
+ */
+static int trace_next(trace_reader_t *reader, char *trace_cmd, mem_addr_t *address, int *size,
+	       long long *thread)
+{
+	const char *p;
+	const char *end;
+	int digits = 0;
+	int negative = 0;
+
+	//The first chunk says whether the trace is binary.
+	if (!reader->holding && !trace_chunk_next(reader)) {
+		return 0;
+	}
+	if (reader->binary) {
+		return trace_next_binary(reader, trace_cmd, address, size, thread);
+	}
+
+	while (1) {
+		for (p = reader->pos; p < reader->end && is_space(*p); p ++) {
+		}
+		if (p < reader->end) {
+			break;
+		}
+		if (!trace_chunk_next(reader)) {
+			return 0;
+		}
+	}
+	end = reader->end;
+
+	*trace_cmd = *p++;
+	while (p < end && is_space(*p)) {
+		p ++;
+	}
+	if (p + 1 < end && p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+		p += 2;
+	}
+	*address = 0;
+	for (; p < end && hex_digit(*p) >= 0; p ++, digits ++) {
+		*address = (*address << 4) | hex_digit(*p);
+	}
+	if (digits == 0 || p == end || *p != ',') {
+		return 0;
+	}
+
+	p ++;
+	while (p < end && is_space(*p)) {
+		p ++;
+	}
+	if (p < end && (*p == '-' || *p == '+')) {
+		negative = (*p == '-');
+		p ++;
+	}
+	*size = 0;
+	for (digits = 0; p < end && *p >= '0' && *p <= '9'; p ++, digits ++) {
+		*size = *size * 10 + (*p - '0');
+	}
+	if (digits == 0) {
+		return 0;
+	}
+	if (negative) {
+		*size = -*size;
+	}
+
+	if (thread != NULL) {
+		*thread = -1;
+	}
+	if (p + 1 < end && *p == ',' && p[1] >= '0' && p[1] <= '9') {
+		long long id = 0;
+
+		for (p ++; p < end && *p >= '0' && *p <= '9'; p ++) {
+			id = id * 10 + (*p - '0');
+		}
+		if (thread != NULL) {
+			*thread = id;
+		}
+	}
+
+	reader->pos = p;
+	return 1;
+}
+
+static void trace_close(trace_reader_t *reader)
+{
+	int index;
+
+	pthread_mutex_lock(&reader->lock);
+	reader->closing = 1;
+	pthread_cond_broadcast(&reader->changed);
+	pthread_mutex_unlock(&reader->lock);
+	pthread_join(reader->thread, NULL);
+
+#ifdef HAVE_ZLIB
+	if (reader->gz != NULL) {
+		gzclose(reader->gz);
+	}
+#endif
+#ifdef HAVE_ZSTD
+	if (reader->zstream != NULL) {
+		ZSTD_freeDStream(reader->zstream);
+		free(reader->zin_buf);
+	}
+#endif
+	if (reader->file != NULL) {
+		fclose(reader->file);
+	}
+	for (index = 0; index < TRACE_CHUNKS; index ++) {
+		free(reader->chunks[index].data);
+	}
+	pthread_mutex_destroy(&reader->lock);
+	pthread_cond_destroy(&reader->changed);
+	free(reader);
+}
+
+/* access_end - one past the last byte of an access; a size of 0 still
+ * touches one byte */
+static mem_addr_t access_end(mem_addr_t address, int size)
+{
+	return address + (size > 0 ? size : 1);
+}
+
+/* block_end - one past the last byte of the block of 2**b bytes that
+ * holds address, or end if that comes first */
+static mem_addr_t block_end(mem_addr_t address, int b, mem_addr_t end)
+{
+	mem_addr_t next = (address | ((1ULL << b) - 1)) + 1;
+
+	return (next < end) ? next : end;
+}
+
+/*
+ * TLBs.
+ *
+ * With -T, every trace access is also looked up in a TLB, split at page
+ * boundaries like data accesses are at block boundaries.  Each TLB level
+ * is an ordinary LRU cache whose block size is the page size, so the
+ * cache engine does the work.  The TLBs are simulated twice, once with
+ * 4 KB pages and once with 2 MB pages, as though the whole footprint
+ * were mapped with one size or the other; comparing the two shows what
+ * huge pages would buy.  A miss in the last TLB level is a page walk,
+ * which reads one entry per page-table level: four for 4 KB pages and
+ * three for 2 MB pages on x86-64.
+ */
+
+#define TLB_LEVELS	2
+#define TLB_SIZES	2
+
+typedef struct {
+	const char *name;
+	int page_bits;
+	int walk_levels;	/* page-table entries read per walk */
+	cache sim_cache[TLB_LEVELS];
+	cache_param_t par[TLB_LEVELS];
+	long long lookups;
+	long long walks;
+} page_tlb;
+
+struct tlb {
+	int num_levels;
+	int entries[TLB_LEVELS];
+	int ways[TLB_LEVELS];
+	page_tlb sizes[TLB_SIZES];
+};
+
+/* parse_tlb - read <entries>:<ways>[,<entries>:<ways>] into *tlb */
+static int parse_tlb(const char *spec, tlb_t *tlb)
+{
+	int used = 0;
+	int level;
+
+	bzero(tlb, sizeof(*tlb));
+	if (sscanf(spec, "%d:%d%n,%d:%d%n", &tlb->entries[0], &tlb->ways[0], &used,
+		   &tlb->entries[1], &tlb->ways[1], &used) >= 2 && spec[used] == '\0') {
+		tlb->num_levels = (tlb->ways[1] > 0) ? 2 : 1;
+	}
+	if (tlb->num_levels == 0) {
+		return -1;
+	}
+
+	for (level = 0; level < tlb->num_levels; level ++) {
+		int sets;
+
+		if (tlb->ways[level] <= 0 || tlb->entries[level] <= 0 ||
+		    tlb->entries[level] % tlb->ways[level] != 0) {
+			return -1;
+		}
+		sets = tlb->entries[level] / tlb->ways[level];
+		if ((sets & (sets - 1)) != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void init_tlb(tlb_t *tlb, const char *who)
+{
+	static const char *names[TLB_SIZES] = { "4K", "2M" };
+	static const int page_bits[TLB_SIZES] = { 12, 21 };
+	static const int walk_levels[TLB_SIZES] = { 4, 3 };
+	int i;
+	int level;
+
+	for (i = 0; i < TLB_SIZES; i ++) {
+		page_tlb *t = &tlb->sizes[i];
+
+		t->name = names[i];
+		t->page_bits = page_bits[i];
+		t->walk_levels = walk_levels[i];
+		for (level = 0; level < tlb->num_levels; level ++) {
+			cache_param_t *par = &t->par[level];
+			int sets = tlb->entries[level] / tlb->ways[level];
+
+			bzero(par, sizeof(*par));
+			par->policy = &policies[0];
+			par->E = tlb->ways[level];
+			par->b = t->page_bits;
+			for (par->s = 0; (1 << par->s) < sets; par->s ++) {
+			}
+			t->sim_cache[level] = setup_cache(par, who);
+		}
+	}
+}
+
+static void free_tlb(tlb_t *tlb)
+{
+	int i;
+	int level;
+
+	for (i = 0; i < TLB_SIZES; i ++) {
+		for (level = 0; level < tlb->num_levels; level ++) {
+			page_tlb *t = &tlb->sizes[i];
+
+			clear_cache(t->sim_cache[level], t->par[level].S, t->par[level].E, t->par[level].B);
+		}
+	}
+}
+
+/* tlb_lookup - translate the page holding address, filling every level
+ * that missed */
+static void tlb_lookup(tlb_t *tlb, page_tlb *t, mem_addr_t address)
+{
+	int empty[TLB_LEVELS];
+	set_line evicted;
+	int level;
+
+	t->lookups ++;
+	for (level = 0; level < tlb->num_levels; level ++) {
+		if (cache_lookup(&t->sim_cache[level], &t->par[level], address, &empty[level]) != NULL) {
+			t->par[level].hits ++;
+			break;
+		}
+		t->par[level].misses ++;
+	}
+	if (level == tlb->num_levels) {
+		t->walks ++;
+	}
+
+	while (-- level >= 0) {
+		cache_fill(&t->sim_cache[level], &t->par[level], address, empty[level], &evicted);
+		if (evicted.valid) {
+			t->par[level].evicts ++;
+		}
+	}
+}
+
+/* tlb_access - translate every page [address, address + size) touches */
+static void tlb_access(tlb_t *tlb, mem_addr_t address, int size)
+{
+	mem_addr_t last = access_end(address, size) - 1;
+	int i;
+
+	for (i = 0; i < TLB_SIZES; i ++) {
+		page_tlb *t = &tlb->sizes[i];
+		mem_addr_t page;
+
+		for (page = address >> t->page_bits; page <= (last >> t->page_bits); page ++) {
+			tlb_lookup(tlb, t, page << t->page_bits);
+		}
+	}
+}
+
+static void print_tlb(tlb_t *tlb)
+{
+	int i;
+	int level;
+
+	for (i = 0; i < TLB_SIZES; i ++) {
+		page_tlb *t = &tlb->sizes[i];
+
+		printf("tlb_%s lookups:%lld", t->name, t->lookups);
+		for (level = 0; level < tlb->num_levels; level ++) {
+			cache_param_t *par = &t->par[level];
+			long long lookups = par->hits + par->misses;
+
+			printf(" L%d_misses:%lld (%.2f%%, reach %lld KB)", level + 1, par->misses,
+			       lookups ? 100.0 * par->misses / lookups : 0.0,
+			       ((long long) tlb->entries[level] << t->page_bits) >> 10);
+		}
+		printf(" walks:%lld walk_refs:%lld\n", t->walks, t->walks * t->walk_levels);
+	}
+}
+
+/*
+ * Verbose output.
+ *
+ * With -v every trace access gets a line in the cachelab reference
+ * format, "L 10,4 miss eviction", with one result per block it touched;
+ * M lines show the load and the store.  Lines are formatted by hand into
+ * a TRACER_BUFFER-byte buffer that goes out in one fwrite when full, so
+ * logging a long trace costs little more than the I/O.  -V adds, as a
+ * comma-separated list:
+ *   file=<path>       write the events to <path> rather than stdout
+ *   binary            write TRACER_RECORD-byte records instead of text,
+ *                     after TRACER_MAGIC: address (8 bytes), size (4),
+ *                     SIM_ flags (1), 'L' or 'S' (1) and two spare bytes,
+ *                     little-endian, one record per block
+ *   addr=<lo>-<hi>    only blocks with lo <= address < hi (hex)
+ *   set=<lo>[-<hi>]   only blocks in sets lo to hi inclusive
+ * An access none of whose blocks pass the filters is left out.
+ */
+
+#define TRACER_BUFFER	(4 << 20)
+#define TRACER_LINE	64		/* room kept for one header or block result */
+#define TRACER_MAGIC	"CSIMEVT1"
+#define TRACER_RECORD	16
+
+struct tracer {
+	const char *file;		/* NULL for stdout */
+	int binary;
+	mem_addr_t addr_lo;		/* addr_hi == 0: no address filter */
+	mem_addr_t addr_hi;
+	long long set_lo;		/* set_hi < 0: no set filter */
+	long long set_hi;
+
+	FILE *out;
+	char *buffer;
+	long length;
+	long line_start;		/* where the open line's header begins */
+	int in_line;			/* a header is written, no newline yet */
+	int matched;			/* some block of the open line passed */
+};
+
+/* parse_tracer - read the -V list into *tr */
+static int parse_tracer(char *spec, tracer_t *tr)
+{
+	char *item;
+	char *end;
+
+	for (item = strtok(spec, ","); item != NULL; item = strtok(NULL, ",")) {
+		if (strcmp(item, "binary") == 0) {
+			tr->binary = 1;
+		} else if (strncmp(item, "file=", 5) == 0 && item[5] != '\0') {
+			tr->file = item + 5;
+		} else if (strncmp(item, "addr=", 5) == 0) {
+			tr->addr_lo = strtoull(item + 5, &end, 16);
+			if (*end != '-') {
+				return -1;
+			}
+			tr->addr_hi = strtoull(end + 1, &end, 16);
+			if (*end != '\0' || tr->addr_hi <= tr->addr_lo) {
+				return -1;
+			}
+		} else if (strncmp(item, "set=", 4) == 0) {
+			tr->set_lo = strtoll(item + 4, &end, 10);
+			tr->set_hi = tr->set_lo;
+			if (*end == '-') {
+				tr->set_hi = strtoll(end + 1, &end, 10);
+			}
+			if (*end != '\0' || tr->set_lo < 0 || tr->set_hi < tr->set_lo) {
+				return -1;
+			}
+		} else {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void init_tracer(tracer_t *tr, const char *who)
+{
+	tr->out = stdout;
+	if (tr->file != NULL) {
+		tr->out = fopen(tr->file, tr->binary ? "wb" : "w");
+		if (tr->out == NULL) {
+			printf("%s: Could not open %s\n", who, tr->file);
+			exit(1);
+		}
+	}
+	tr->buffer = malloc(TRACER_BUFFER);
+	if (tr->buffer == NULL) {
+		printf("%s: Could not allocate the verbose buffer\n", who);
+		exit(1);
+	}
+	tr->length = 0;
+	tr->in_line = 0;
+	if (tr->binary) {
+		memcpy(tr->buffer, TRACER_MAGIC, 8);
+		tr->length = 8;
+	}
+}
+
+static void flush_tracer(tracer_t *tr)
+{
+	if (tr->length > 0 && fwrite(tr->buffer, 1, tr->length, tr->out) != (size_t) tr->length) {
+		printf("Could not write verbose output\n");
+		exit(1);
+	}
+	tr->length = 0;
+	tr->line_start = 0;
+}
+
+/* flush_tracer_lines - write out the finished lines, keeping an open one */
+static void flush_tracer_lines(tracer_t *tr)
+{
+	long done = tr->in_line ? tr->line_start : tr->length;
+
+	if (done > 0 && fwrite(tr->buffer, 1, done, tr->out) != (size_t) done) {
+		printf("Could not write verbose output\n");
+		exit(1);
+	}
+	memmove(tr->buffer, tr->buffer + done, tr->length - done);
+	tr->length -= done;
+	tr->line_start = 0;
+}
+
+static void close_tracer(tracer_t *tr)
+{
+	flush_tracer(tr);
+	if (fflush(tr->out) != 0 || (tr->out != stdout && fclose(tr->out) != 0)) {
+		printf("Could not write verbose output\n");
+		exit(1);
+	}
+	free(tr->buffer);
+}
+
+/* put_hex and put_dec append to the buffer; the caller makes room */
+static void put_hex(tracer_t *tr, mem_addr_t value)
+{
+	char digits[16];
+	int n = 0;
+
+	do {
+		digits[n ++] = "0123456789abcdef"[value & 0xF];
+		value >>= 4;
+	} while (value != 0);
+	while (n > 0) {
+		tr->buffer[tr->length ++] = digits[-- n];
+	}
+}
+
+static void put_dec(tracer_t *tr, int value)
+{
+	char digits[12];
+	unsigned int v = (value < 0) ? 0U - (unsigned int) value : (unsigned int) value;
+	int n = 0;
+
+	if (value < 0) {
+		tr->buffer[tr->length ++] = '-';
+	}
+	do {
+		digits[n ++] = (char) ('0' + v % 10);
+		v /= 10;
+	} while (v != 0);
+	while (n > 0) {
+		tr->buffer[tr->length ++] = digits[-- n];
+	}
+}
+
+static void put_word(tracer_t *tr, const char *word)
+{
+	tr->buffer[tr->length ++] = ' ';
+	while (*word != '\0') {
+		tr->buffer[tr->length ++] = *word ++;
+	}
+}
+
+/* tracer_begin - open the line for one trace access; op is 'L', 'S' or 'M' */
+static void tracer_begin(tracer_t *tr, char op, mem_addr_t address, int size)
+{
+	tr->in_line = 1;
+	tr->matched = 0;
+	if (tr->binary) {
+		return;
+	}
+	if (TRACER_BUFFER - tr->length < TRACER_LINE) {
+		flush_tracer(tr);
+	}
+	tr->line_start = tr->length;
+	tr->buffer[tr->length ++] = op;
+	tr->buffer[tr->length ++] = ' ';
+	put_hex(tr, address);
+	tr->buffer[tr->length ++] = ',';
+	put_dec(tr, size);
+}
+
+/* tracer_end - finish the line, or take it back if nothing passed */
+static void tracer_end(tracer_t *tr)
+{
+	tr->in_line = 0;
+	if (tr->binary) {
+		return;
+	}
+	if (tr->matched) {
+		tr->buffer[tr->length ++] = '\n';
+	} else {
+		tr->length = tr->line_start;
+	}
+}
+
+/* tracer_block - log the result of one block of the open access */
+static void tracer_block(tracer_t *tr, cache_param_t *par, mem_addr_t address, int size, int is_write, int flags)
+{
+	unsigned char *p;
+	long long set;
+	int index;
+
+	if (tr->addr_hi != 0 && (address < tr->addr_lo || address >= tr->addr_hi)) {
+		return;
+	}
+	set = (long long) ((address >> par->b) & (par->S - 1));
+	if (tr->set_hi >= 0 && (set < tr->set_lo || set > tr->set_hi)) {
+		return;
+	}
+	tr->matched = 1;
+
+	if (tr->binary) {
+		if (TRACER_BUFFER - tr->length < TRACER_RECORD) {
+			flush_tracer(tr);
+		}
+		p = (unsigned char *) tr->buffer + tr->length;
+		for (index = 0; index < 8; index ++) {
+			p[index] = (unsigned char) (address >> (8 * index));
+		}
+		for (index = 0; index < 4; index ++) {
+			p[8 + index] = (unsigned char) ((unsigned int) size >> (8 * index));
+		}
+		p[12] = (unsigned char) flags;
+		p[13] = is_write ? 'S' : 'L';
+		p[14] = 0;
+		p[15] = 0;
+		tr->length += TRACER_RECORD;
+		return;
+	}
+
+	//The header stays put: with matched set it can no longer be taken back.
+	if (TRACER_BUFFER - tr->length < TRACER_LINE) {
+		flush_tracer(tr);
+	}
+	put_word(tr, (flags & SIM_HIT) ? "hit" : "miss");
+	if (flags & SIM_EVICT) {
+		put_word(tr, (flags & SIM_DIRTY) ? "eviction dirty" : "eviction");
+	}
+	if (flags & SIM_PF_USED) {
+		put_word(tr, "prefetch_used");
+	}
+	if (flags & SIM_PF_UNUSED) {
+		put_word(tr, "prefetch_unused");
+	}
+}
+
+/* check_interval - close the interval if the last access completed it */
+static void check_interval(cache_param_t *par)
+{
+	if (par->intervals != NULL && par->accesses - par->intervals->start_accesses == par->intervals->length) {
+		if (par->tracer != NULL && par->tracer->file == NULL) {
+			//Keep the interval lines in order with the events.
+			flush_tracer_lines(par->tracer);
+		}
+		close_interval(par->intervals, par, 0);
+	}
+}
+
+/*
+ * sim_access - Run one trace load or store.  An access that crosses
+ * block boundaries touches every block it overlaps, one run_sim each;
+ * returns their flags or'ed together.
+ */
+static int sim_access(cache *sim_cache, cache_param_t *par, mem_addr_t address, int size, int is_write)
+{
+	mem_addr_t end = access_end(address, size);
+	mem_addr_t next;
+	int all_flags = 0;
+	int opened = 0;
+
+	par->accesses ++;
+	if (((address ^ (end - 1)) >> par->b) != 0) {
+		par->straddles ++;
+	}
+	if (par->sampler != NULL && !sample_access(par->sampler, par)) {
+		return 0;
+	}
+	if (par->tlb != NULL) {
+		tlb_access(par->tlb, address, size);
+	}
+	if (par->tracer != NULL && !par->tracer->in_line) {
+		tracer_begin(par->tracer, is_write ? 'S' : 'L', address, size);
+		opened = 1;
+	}
+
+	for (; address < end; address = next) {
+		int flags;
+
+		next = block_end(address, par->b, end);
+		if (par->sampler != NULL && !sample_set(par->sampler, par, address)) {
+			continue;
+		}
+		flags = run_sim(sim_cache, par, address, next - address, is_write);
+		if (par->prefetcher != NULL) {
+			flags = prefetch_access(sim_cache, par, par->prefetcher, address, flags);
+		}
+		if (par->profiler != NULL) {
+			profile_access(par->profiler, par, address, flags);
+		}
+		if (par->classifier != NULL) {
+			classify_access(par->classifier, par, address, is_write, flags);
+		}
+		if (par->intervals != NULL) {
+			interval_block(par->intervals, par, address, flags);
+		}
+		if (par->sampler != NULL) {
+			sample_result(par->sampler, par, address, flags);
+		}
+		if (par->tracer != NULL) {
+			tracer_block(par->tracer, par, address, next - address, is_write, flags);
+		}
+		all_flags |= flags;
+	}
+	if (par->sampler != NULL) {
+		sample_end_access(par->sampler, par);
+	}
+	if (opened) {
+		tracer_end(par->tracer);
+	}
+
+	//A line the caller opened (an 'M') is closed, and checked, by it.
+	if (par->tracer == NULL || !par->tracer->in_line) {
+		check_interval(par);
+	}
+	return all_flags;
+}
+
+/* run_trace - simulate every load and store in the trace */
+static void run_trace(cache *sim_cache, cache_param_t *par, trace_reader_t *read_trace)
+{
+	char trace_cmd;
+	mem_addr_t address;
+	int size;
+
+	while (trace_next(read_trace, &trace_cmd, &address, &size, NULL)) {
+		switch(trace_cmd) {
+			case 'I':
+				break;
+			case 'L':
+				sim_access(sim_cache, par, address, size, 0);
+				break;
+			case 'S':
+				sim_access(sim_cache, par, address, size, 1);
+				break;
+			case 'M':
+				if (par->tracer != NULL) {
+					tracer_begin(par->tracer, 'M', address, size);
+				}
+				sim_access(sim_cache, par, address, size, 0);
+				if (par->tracer != NULL) {
+					//The load may end an interval; the 'M'
+					//line, still open, then prints after it.
+					check_interval(par);
+				}
+				sim_access(sim_cache, par, address, size, 1);
+				if (par->tracer != NULL) {
+					tracer_end(par->tracer);
+					check_interval(par);
+				}
+				break;
+			default:
+				break;
+		}
+	}
+}
+
+/*
+ * run_reference - Simulate the whole trace again without sampling and
+ * compare it with the estimate in *sampled, which took seconds.
+ */
+static void run_reference(cache_param_t *sampled, const char *trace_file, double seconds, double half_width)
+{
+	cache_param_t par = *sampled;
+	cache sim_cache;
+	trace_reader_t *read_trace;
+	struct timespec start, end;
+	double full_seconds;
+	long long demand;
+
+	clear_counters(&par);
+	par.sampler = NULL;
+	sim_cache = setup_cache(&par, "reference");
+	read_trace = trace_open(trace_file);
+	if (read_trace == NULL) {
+		printf("Could not reopen trace file %s\n", trace_file);
+		exit(1);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	run_trace(&sim_cache, &par, read_trace);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	trace_close(read_trace);
+	full_seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	demand = par.hits + par.misses;
+	printf("reference: hits:%lld misses:%lld evictions:%lld miss_rate:%.4f\n",
+	       par.hits, par.misses, par.evicts, demand ? (double) par.misses / demand : 0.0);
+	printf("sampling error: misses:%+lld (%.2f%%, %s the interval) time:%.3fs full:%.3fs speedup:%.1fx\n",
+	       sampled->misses - par.misses,
+	       par.misses ? 100.0 * (sampled->misses - par.misses) / par.misses : 0.0,
+	       fabs((double) sampled->misses - par.misses) <= half_width ? "inside" : "outside",
+	       seconds, full_seconds, seconds > 0 ? full_seconds / seconds : 0.0);
+	clear_cache(sim_cache, par.S, par.E, par.B);
+}
+
+/* print_summary - printSummary() the counters; it takes ints, so counts
+ * past INT_MAX are printed in the same format here instead */
+static void print_summary(cache_param_t *par)
+{
+	if (par->hits > INT_MAX || par->misses > INT_MAX || par->evicts > INT_MAX) {
+		printf("hits:%lld misses:%lld evictions:%lld\n", par->hits, par->misses, par->evicts);
+	} else {
+		printSummary(par->hits, par->misses, par->evicts);
+	}
+}
+
+/* print_straddles - how many loads and stores crossed a block boundary */
+static void print_straddles(cache_param_t *par)
+{
+	printf("accesses:%lld straddles:%lld (%.2f%%)\n", par->accesses, par->straddles,
+	       par->accesses ? 100.0 * par->straddles / par->accesses : 0.0);
+}
+
+/*
+ * run_benchmark - Time run_sim over <num_accesses> synthetic addresses.
+ * The addresses are drawn up front from a working set four times the
+ * cache capacity, so only the simulator itself is measured.
+ */
+static void run_benchmark(cache *sim_cache, cache_param_t *par, long long num_accesses)
+{
+	const int pool_size = 1 << 20; /* power of two */
+	unsigned long long span = 4ULL * par->S * par->E * par->B;
+	unsigned long long x = 88172645463325252ULL;
+	mem_addr_t *pool;
+	struct timespec start, end;
+	double seconds;
+	long long index;
+
+	pool = (mem_addr_t *) malloc(sizeof(mem_addr_t) * pool_size);
+	if (pool == NULL) {
+		printf("Could not allocate benchmark addresses\n");
+		exit(1);
+	}
+
+	for (index = 0; index < pool_size; index ++) {
+		//xorshift64
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		pool[index] = x % span;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (index = 0; index < num_accesses; index ++) {
+		run_sim(sim_cache, par, pool[index & (pool_size - 1)], 1, 0);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("%s s=%d E=%d b=%d: %lld accesses in %.3f s, %.2f M accesses/sec\n",
+	       par->policy->name, par->s, par->E, par->b, num_accesses, seconds, num_accesses / seconds / 1e6);
+	free(pool);
+}
+
+/*
+ * Parallel simulation.
+ *
+ * Accesses to different sets never interact, so the sets are split into
+ * contiguous ranges and each range is owned by one worker thread.  The
+ * main thread decodes the trace and routes every address to the worker
+ * that owns its set through a single-producer/single-consumer ring.
+ * Each set still sees its accesses in trace order, so the summed
+ * counters are identical to the single-threaded run.
+ */
+
+#define RING_SIZE	8192	/* accesses per worker ring, power of two */
+#define RING_BATCH	64	/* accesses the reader queues before publishing */
+
+typedef struct {
+	sim_access_t buf[RING_SIZE];
+	atomic_ulong head;	/* written by the reader */
+	char pad1[64];
+	atomic_ulong tail;	/* written by the worker */
+	char pad2[64];
+	atomic_int done;	/* reader has published its last address */
+	unsigned long pending;	/* reader-private: next unpublished slot */
+} access_ring;
+
+typedef struct {
+	pthread_t thread;
+	cache sim_cache;
+	cache_param_t par;
+	access_ring ring;
+} sim_worker;
+
+static void *run_worker(void *arg)
+{
+	sim_worker *w = (sim_worker *) arg;
+	access_ring *ring = &w->ring;
+	unsigned long tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+	while (1) {
+		unsigned long head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+		if (tail == head) {
+			if (atomic_load_explicit(&ring->done, memory_order_acquire) &&
+			    tail == atomic_load_explicit(&ring->head, memory_order_acquire)) {
+				break;
+			}
+			sched_yield();
+			continue;
+		}
+
+		for (; tail != head; tail ++) {
+			sim_access_t *access = &ring->buf[tail & (RING_SIZE - 1)];
+
+			run_sim(&w->sim_cache, &w->par, access->address, access->size, access->is_write);
+		}
+		atomic_store_explicit(&ring->tail, tail, memory_order_release);
+	}
+	return NULL;
+}
+
+static void ring_publish(access_ring *ring)
+{
+	atomic_store_explicit(&ring->head, ring->pending, memory_order_release);
+}
+
+static void ring_push(access_ring *ring, mem_addr_t address, int size, int is_write)
+{
+	sim_access_t *access;
+
+	//Wait for the worker to free a slot if the ring is full.
+	while (ring->pending - atomic_load_explicit(&ring->tail, memory_order_acquire) == RING_SIZE) {
+		ring_publish(ring);
+		sched_yield();
+	}
+
+	access = &ring->buf[ring->pending & (RING_SIZE - 1)];
+	access->address = address;
+	access->size = size;
+	access->is_write = is_write;
+	ring->pending ++;
+	if ((ring->pending & (RING_BATCH - 1)) == 0) {
+		ring_publish(ring);
+	}
+}
+
+static cache_param_t run_parallel(cache sim_cache, cache_param_t par, long long num_sets,
+			   trace_reader_t *read_trace, int num_workers)
+{
+	char trace_cmd;
+	mem_addr_t address;
+	int size;
+	int index;
+	sim_worker *workers;
+
+	if (num_workers > num_sets) {
+		num_workers = num_sets;
+	}
+
+	workers = (sim_worker *) calloc(num_workers, sizeof(sim_worker));
+	if (workers == NULL) {
+		printf("Could not allocate %d workers\n", num_workers);
+		exit(1);
+	}
+
+	for (index = 0; index < num_workers; index ++) {
+		workers[index].sim_cache = sim_cache;
+		workers[index].par = par;
+		clear_counters(&workers[index].par);
+		pthread_create(&workers[index].thread, NULL, run_worker, &workers[index]);
+	}
+
+	while (trace_next(read_trace, &trace_cmd, &address, &size, NULL)) {
+		mem_addr_t end = access_end(address, size);
+		mem_addr_t piece;
+		mem_addr_t next;
+		int repeat;
+
+		if (trace_cmd != 'L' && trace_cmd != 'S' && trace_cmd != 'M') {
+			continue;
+		}
+
+		//'M' is a load then a store; both may straddle blocks.
+		for (repeat = (trace_cmd == 'M'); repeat >= 0; repeat --) {
+			int is_write = (trace_cmd != 'L' && repeat == 0);
+
+			par.accesses ++;
+			if (((address ^ (end - 1)) >> par.b) != 0) {
+				par.straddles ++;
+			}
+
+			for (piece = address; piece < end; piece = next) {
+				//Worker w owns sets [w * S / workers, (w + 1) * S / workers).
+				unsigned long long setIndex = (piece >> par.b) & (num_sets - 1);
+
+				next = block_end(piece, par.b, end);
+				ring_push(&workers[(setIndex * num_workers) / num_sets].ring,
+					  piece, next - piece, is_write);
+			}
+		}
+	}
+
+	for (index = 0; index < num_workers; index ++) {
+		ring_publish(&workers[index].ring);
+		atomic_store_explicit(&workers[index].ring.done, 1, memory_order_release);
+	}
+
+	for (index = 0; index < num_workers; index ++) {
+		pthread_join(workers[index].thread, NULL);
+		add_counters(&par, &workers[index].par);
+	}
+
+	free(workers);
+	return par;
+}
+
+/*
+ * Cache hierarchy.
+ *
+ * levels[0] is closest to the CPU.  A level's inclusion policy says how
+ * it relates to the levels above it:
+ *   inclusive  holds everything above; evicting a block back-invalidates
+ *              every copy above, merging any dirty data into the victim
+ *   exclusive  holds only victims of the level above; a hit moves the
+ *              block up and a miss does not allocate
+ *   nine       neither; fills on demand misses, never back-invalidates
+ * Block sizes may only grow going down, so one block above always maps
+ * to a single block below.
+ */
+
+#define MAX_LEVELS	4
+
+#define INCL_NINE	0
+#define INCL_INCLUSIVE	1
+#define INCL_EXCLUSIVE	2
+
+/* requests a level receives from the level above */
+#define ACCESS_READ		0	/* demand fetch; the requester fills */
+#define ACCESS_WRITE		1	/* store, or a store written through */
+#define ACCESS_WRITEBACK	2	/* dirty victim from above */
+#define ACCESS_VICTIM		3	/* clean victim for an exclusive level */
+
+typedef struct {
+	char name[16];
+	cache sim_cache;
+	cache_param_t par;
+	int inclusion;
+} cache_level_t;
+
+typedef struct {
+	cache_level_t levels[MAX_LEVELS];
+	int num_levels;
+	long long mem_reads;	/* blocks fetched from memory */
+	long long mem_writes;	/* writebacks and written-through stores */
+	long long mem_write_bytes;
+} hierarchy_t;
+
+static int level_access(hierarchy_t *hier, int i, mem_addr_t address, int op, int size);
+
+/* back_invalidate - drop every copy of the block at address (size bytes)
+ * from the levels above i; returns 1 if any of them was dirty */
+static int back_invalidate(hierarchy_t *hier, int i, mem_addr_t address, long long size)
+{
+	int dirty = 0;
+	int j;
+	mem_addr_t offset;
+
+	for (j = 0; j < i; j ++) {
+		cache_level_t *upper = &hier->levels[j];
+
+		for (offset = 0; offset < size; offset += upper->par.B) {
+			if (cache_invalidate(&upper->sim_cache, &upper->par, address + offset) > 0) {
+				dirty = 1;
+			}
+		}
+	}
+	return dirty;
+}
+
+/* write_down - send size bytes of data for block from level i to the
+ * level below, counting them as level i's writeback traffic */
+static void write_down(hierarchy_t *hier, int i, mem_addr_t block, int op, int size)
+{
+	cache_param_t *par = &hier->levels[i].par;
+
+	par->writebacks ++;
+	par->writeback_bytes += size;
+	level_access(hier, i + 1, block, op, size);
+}
+
+/* send_victim - hand a line evicted from level i to the level below */
+static void send_victim(hierarchy_t *hier, int i, set_line *evicted, mem_addr_t address)
+{
+	cache_level_t *level = &hier->levels[i];
+	int exclusive_below = (i + 1 < hier->num_levels &&
+			       hier->levels[i + 1].inclusion == INCL_EXCLUSIVE);
+
+	level->par.evicts ++;
+
+	if (level->inclusion == INCL_INCLUSIVE && back_invalidate(hier, i, address, level->par.B)) {
+		evicted->dirty = 1;
+	}
+
+	if (evicted->dirty) {
+		level->par.dirty_evicts ++;
+		write_down(hier, i, address, ACCESS_WRITEBACK, level->par.B);
+	} else if (exclusive_below) {
+		level_access(hier, i + 1, address, ACCESS_VICTIM, level->par.B);
+	}
+}
+
+/* fill_level - allocate block in level i (empty as from cache_lookup),
+ * pass any victim down, and return the new line */
+static set_line *fill_level(hierarchy_t *hier, int i, mem_addr_t block, int empty)
+{
+	cache_level_t *level = &hier->levels[i];
+	set_line evicted;
+	set_line *line = cache_fill(&level->sim_cache, &level->par, block, empty, &evicted);
+
+	if (evicted.valid) {
+		send_victim(hier, i, &evicted,
+			    line_address(&level->par, &evicted, (block >> level->par.b) & (level->par.S - 1)));
+	}
+	return line;
+}
+
+/*
+ * level_access - Perform op for address at level i, recursing into the
+ * levels below as needed.  size is the number of bytes a write carries.
+ * For ACCESS_READ returns 1 when the block came up dirty out of an
+ * exclusive level, so the requester fills it dirty.
+ */
+static int level_access(hierarchy_t *hier, int i, mem_addr_t address, int op, int size)
+{
+	cache_level_t *level;
+	cache_param_t *par;
+	set_line *line;
+	int empty;
+	int dirty = 0;
+	mem_addr_t block;
+
+	if (i == hier->num_levels) {
+		if (op == ACCESS_READ) {
+			hier->mem_reads ++;
+		} else if (op != ACCESS_VICTIM) {
+			hier->mem_writes ++;
+			hier->mem_write_bytes += size;
+		}
+		return 0;
+	}
+
+	level = &hier->levels[i];
+	par = &level->par;
+	block = address & ~((mem_addr_t) par->B - 1);
+	line = cache_lookup(&level->sim_cache, par, block, &empty);
+
+	if (line != NULL) {
+		if (op == ACCESS_READ || op == ACCESS_WRITE) {
+			par->hits ++;
+		}
+
+		if (op == ACCESS_WRITE || op == ACCESS_WRITEBACK) {
+			if (par->write_through) {
+				write_down(hier, i, block, op, size);
+			} else {
+				line->dirty = 1;
+			}
+		} else if (op == ACCESS_READ && i > 0 && level->inclusion == INCL_EXCLUSIVE) {
+			//The block moves up to the requester.
+			dirty = line->dirty;
+			drop_line(&level->sim_cache, par, line);
+		}
+		return dirty;
+	}
+
+	if (op == ACCESS_WRITEBACK || op == ACCESS_VICTIM) {
+		//A whole block arrived from above, so allocate without fetching.
+		//Write-through levels pass dirty data on, and only an exclusive
+		//one keeps a (clean) copy.
+		dirty = (op == ACCESS_WRITEBACK);
+		if (par->write_through) {
+			if (dirty) {
+				write_down(hier, i, block, op, size);
+			}
+			if (level->inclusion != INCL_EXCLUSIVE) {
+				return 0;
+			}
+			dirty = 0;
+			//The levels below may have back-invalidated a way here.
+			cache_probe(&level->sim_cache, par, block, &empty);
+		}
+		fill_level(hier, i, block, empty)->dirty = dirty;
+		return 0;
+	}
+
+	par->misses ++;
+
+	if (i > 0 && level->inclusion == INCL_EXCLUSIVE) {
+		//Exclusive levels only take victims; pass the request down.
+		return level_access(hier, i + 1, block, op, size);
+	}
+
+	if (op == ACCESS_WRITE && par->no_write_allocate) {
+		write_down(hier, i, block, ACCESS_WRITE, size);
+		return 0;
+	}
+
+	dirty = level_access(hier, i + 1, block, ACCESS_READ, par->B);
+	//An inclusive level's eviction during the fetch may have
+	//back-invalidated a way of this set, so look for an empty one again.
+	cache_probe(&level->sim_cache, par, block, &empty);
+	line = fill_level(hier, i, block, empty);
+
+	if (par->write_through) {
+		//Nothing stays dirty here: pass on the store, or data that came
+		//up dirty out of an exclusive level.
+		if (dirty) {
+			write_down(hier, i, block, ACCESS_WRITEBACK, par->B);
+		} else if (op == ACCESS_WRITE) {
+			write_down(hier, i, block, ACCESS_WRITE, size);
+		}
+		dirty = 0;
+	} else if (op == ACCESS_WRITE) {
+		dirty = 1;
+	}
+	line->dirty = dirty;
+	return 0;
+}
+
+/*
+ * read_config - Parse a hierarchy description, one level per line from
+ * the CPU outwards:
+ *     <name> s=<num> E=<num> b=<num> [policy=<name>]
+ *            [inclusion=inclusive|exclusive|nine] [write=wb|wt]
+ *            [alloc=wa|nwa]
+ * Blank lines and text after '#' are ignored.
+ */
+static void read_config(const char *config_file, hierarchy_t *hier)
+{
+	FILE *config = fopen(config_file, "r");
+	char line[512];
+	int line_num = 0;
+
+	if (config == NULL) {
+		printf("Could not open config file %s\n", config_file);
+		exit(1);
+	}
+
+	hier->num_levels = 0;
+	while (fgets(line, sizeof(line), config) != NULL) {
+		char *comment = strchr(line, '#');
+		char *token;
+		cache_level_t *level;
+
+		line_num ++;
+		if (comment != NULL) {
+			*comment = '\0';
+		}
+
+		token = strtok(line, " \t\r\n");
+		if (token == NULL) {
+			continue;
+		}
+		if (hier->num_levels == MAX_LEVELS) {
+			printf("%s:%d: at most %d levels are supported\n", config_file, line_num, MAX_LEVELS);
+			exit(1);
+		}
+
+		level = &hier->levels[hier->num_levels ++];
+		bzero(level, sizeof(*level));
+		snprintf(level->name, sizeof(level->name), "%s", token);
+		level->par.policy = &policies[0];
+		level->inclusion = INCL_NINE;
+
+		while ((token = strtok(NULL, " \t\r\n")) != NULL) {
+			char *value = strchr(token, '=');
+
+			if (value == NULL) {
+				printf("%s:%d: expected key=value, got '%s'\n", config_file, line_num, token);
+				exit(1);
+			}
+			*value ++ = '\0';
+
+			if (strcmp(token, "s") == 0) {
+				level->par.s = atoi(value);
+			} else if (strcmp(token, "E") == 0) {
+				level->par.E = atoi(value);
+			} else if (strcmp(token, "b") == 0) {
+				level->par.b = atoi(value);
+			} else if (strcmp(token, "policy") == 0 && find_policy(value) != NULL) {
+				level->par.policy = find_policy(value);
+			} else if (strcmp(token, "inclusion") == 0 && strcmp(value, "nine") == 0) {
+				level->inclusion = INCL_NINE;
+			} else if (strcmp(token, "inclusion") == 0 && strcmp(value, "inclusive") == 0) {
+				level->inclusion = INCL_INCLUSIVE;
+			} else if (strcmp(token, "inclusion") == 0 && strcmp(value, "exclusive") == 0) {
+				level->inclusion = INCL_EXCLUSIVE;
+			} else if (strcmp(token, "write") == 0 && strcmp(value, "wb") == 0) {
+				level->par.write_through = 0;
+			} else if (strcmp(token, "write") == 0 && strcmp(value, "wt") == 0) {
+				level->par.write_through = 1;
+			} else if (strcmp(token, "alloc") == 0 && strcmp(value, "wa") == 0) {
+				level->par.no_write_allocate = 0;
+			} else if (strcmp(token, "alloc") == 0 && strcmp(value, "nwa") == 0) {
+				level->par.no_write_allocate = 1;
+			} else {
+				printf("%s:%d: bad setting %s=%s\n", config_file, line_num, token, value);
+				exit(1);
+			}
+		}
+
+		if (level->par.E <= 0 || level->par.s < 0 || level->par.b < 0) {
+			printf("%s:%d: level %s needs s, E and b\n", config_file, line_num, level->name);
+			exit(1);
+		}
+		//Same limits as csim_create; s + b >= 1 keeps real tags off EMPTY_TAG.
+		if (level->par.s > 30 || level->par.b > 30 || level->par.s + level->par.b < 1) {
+			printf("%s:%d: level %s needs s and b at most 30 and s + b at least 1\n", config_file,
+			       line_num, level->name);
+			exit(1);
+		}
+		if (hier->num_levels > 1) {
+			cache_level_t *above = level - 1;
+
+			if (level->par.b < above->par.b ||
+			    (level->inclusion == INCL_EXCLUSIVE && level->par.b != above->par.b)) {
+				printf("%s:%d: level %s block size must be %s that of %s\n", config_file, line_num,
+				       level->name, level->inclusion == INCL_EXCLUSIVE ? "equal to" : "at least",
+				       above->name);
+				exit(1);
+			}
+		}
+	}
+	fclose(config);
+
+	if (hier->num_levels == 0) {
+		printf("%s: no cache levels\n", config_file);
+		exit(1);
+	}
+}
 
-	int hits;
-	int misses;
-	int evicts;
-} cache_param_t;
+static void print_hierarchy(hierarchy_t *hier)
+{
+	int i;
+
+	print_straddles(&hier->levels[0].par);
+
+	for (i = 0; i < hier->num_levels; i ++) {
+		cache_param_t *par = &hier->levels[i].par;
+
+		printf("%-6s hits:%lld misses:%lld evictions:%lld writebacks:%lld dirty_evictions:%lld writeback_bytes:%lld\n",
+		       hier->levels[i].name, par->hits, par->misses, par->evicts, par->writebacks,
+		       par->dirty_evicts, par->writeback_bytes);
+	}
+	printf("%-6s reads:%lld writes:%lld read_bytes:%lld write_bytes:%lld\n", "memory",
+	       hier->mem_reads, hier->mem_writes,
+	       hier->mem_reads * hier->levels[hier->num_levels - 1].par.B, hier->mem_write_bytes);
+}
+
+/* hier_access - run one trace load or store through the hierarchy,
+ * split at L1 block boundaries */
+static void hier_access(hierarchy_t *hier, mem_addr_t address, int size, int op)
+{
+	cache_param_t *par = &hier->levels[0].par;
+	mem_addr_t end = access_end(address, size);
+	mem_addr_t next;
+
+	par->accesses ++;
+	if (((address ^ (end - 1)) >> par->b) != 0) {
+		par->straddles ++;
+	}
+
+	for (; address < end; address = next) {
+		next = block_end(address, par->b, end);
+		level_access(hier, 0, address, op, next - address);
+	}
+}
+
+static void run_hierarchy(hierarchy_t *hier, trace_reader_t *read_trace)
+{
+	char trace_cmd;
+	mem_addr_t address;
+	int size;
+
+	while (trace_next(read_trace, &trace_cmd, &address, &size, NULL)) {
+		switch(trace_cmd) {
+			case 'L':
+				hier_access(hier, address, size, ACCESS_READ);
+				break;
+			case 'S':
+				hier_access(hier, address, size, ACCESS_WRITE);
+				break;
+			case 'M':
+				hier_access(hier, address, size, ACCESS_READ);
+				hier_access(hier, address, size, ACCESS_WRITE);
+				break;
+			default:
+				break;
+		}
+	}
+}
 
+/*
+ * Multi-core coherence.
+ *
+ * With -n N, each of N cores has a private cache of the -s/-E/-b
+ * geometry, kept coherent with MESI by snooping the other cores on
+ * every miss and on every write to a shared line:
+ *   M  valid, dirty          E  valid, clean, only copy
+ *   S  valid, clean, shared  I  not valid
+ * A trace record may name its thread or core after the size, as in
+ * "S 7ff000a0,8,3".  Ids get cores in order of first appearance,
+ * wrapping around when there are more ids than cores; untagged records
+ * run on core 0.
+ *
+ * A miss on a block the core lost to another core's write is a
+ * coherence miss.  Each core keeps a mask of the bytes it touched in
+ * every line it holds; a write that invalidates a copy whose mask does
+ * not overlap the bytes written is false sharing, since the two cores
+ * never used the same data.  The blocks with the most false-sharing
+ * invalidations are listed at the end.
+ */
+
+#define MAX_CORES	64	/* cores are bits in shared_block masks */
+#define HOT_LINES	10
 
 typedef struct {
-	int last_used;
-	int valid;
-	mem_addr_t tag;
-	char *block;
-} set_line;
+	cache sim_cache;
+	cache_param_t par;
+	unsigned long long *touched;	/* byte mask per line, parallel to sim_cache.lines */
+	block_map lost;			/* blocks taken by other cores' writes */
+	long long coherence_misses;
+	long long invalidations;	/* copies lost to other cores' writes */
+	long long upgrades;		/* writes to a line in S */
+} core_t;
 
 typedef struct {
-	set_line *lines;
-} cache_set;
+	mem_addr_t block;
+	long long invalidations;
+	long long false_sharing;
+	long long coherence_misses;
+	unsigned long long cores;	/* cores that lost or took the block */
+	unsigned long long writers;	/* cores whose writes invalidated it */
+} shared_block;
 
 typedef struct {
-	 cache_set *sets;
-} cache;
+	core_t *cores;
+	int num_cores;
+	block_map ids;			/* trace thread id -> core */
+	int next_core;
 
+	block_map index;		/* block number -> index into blocks[] */
+	shared_block *blocks;
+	long long num_blocks;
+	long long max_blocks;
 
-int verbosity;
+	long long transfers;		/* misses served by another core's copy */
+} coherence_t;
 
-long long bit_pow(int exp) 
+static void init_coherence(coherence_t *coh, cache_param_t *par, int num_cores, const char *who)
 {
-	long long result = 1;
-	result = result << exp;
-	return result;
+	int c;
+
+	bzero(coh, sizeof(*coh));
+	coh->num_cores = num_cores;
+	coh->cores = (core_t *) calloc(num_cores, sizeof(core_t));
+	if (coh->cores == NULL) {
+		printf("Could not allocate %d cores\n", num_cores);
+		exit(1);
+	}
+	for (c = 0; c < num_cores; c ++) {
+		core_t *core = &coh->cores[c];
+
+		core->par = *par;
+		core->sim_cache = setup_cache(&core->par, who);
+		core->touched = (unsigned long long *) calloc((size_t) core->par.S * core->par.E,
+							      sizeof(unsigned long long));
+		if (core->touched == NULL) {
+			printf("Could not allocate core %d\n", c);
+			exit(1);
+		}
+		map_init(&core->lost, 1024);
+	}
+	map_init(&coh->ids, 64);
+	map_init(&coh->index, 1024);
 }
 
-/*
- * printUsage - Print usage info
- */
-void printUsage(char* argv[])
+static void free_coherence(coherence_t *coh)
 {
-    printf("Usage: %s [-hv] -s <num> -E <num> -b <num> -t <file>\n", argv[0]);
-    printf("Options:\n");
-    printf("  -h         Print this help message.\n");
-    printf("  -v         Optional verbose flag.\n");
-    printf("  -s <num>   Number of set index bits.\n");
-    printf("  -E <num>   Number of lines per set.\n");
-    printf("  -b <num>   Number of block offset bits.\n");
-    printf("  -t <file>  Trace file.\n");
-    printf("\nExamples:\n");
-    printf("  %s -s 4 -E 1 -b 4 -t traces/yi.trace\n", argv[0]);
-    printf("  %s -v -s 8 -E 2 -b 4 -t traces/yi.trace\n", argv[0]);
-    exit(0);
+	int c;
+
+	for (c = 0; c < coh->num_cores; c ++) {
+		core_t *core = &coh->cores[c];
+
+		clear_cache(core->sim_cache, core->par.S, core->par.E, core->par.B);
+		free(core->touched);
+		map_free(&core->lost);
+	}
+	free(coh->cores);
+	map_free(&coh->ids);
+	map_free(&coh->index);
+	free(coh->blocks);
 }
 
+/* core_of - the core that runs trace thread id, or core 0 when the
+ * record had none (id < 0) */
+static int core_of(coherence_t *coh, long long id)
+{
+	unsigned long long *core;
+	int added;
+
+	if (id < 0) {
+		return 0;
+	}
+	core = map_insert(&coh->ids, (mem_addr_t) id, &added);
+	if (added) {
+		*core = coh->next_core;
+		coh->next_core = (coh->next_core + 1) % coh->num_cores;
+	}
+	return (int) *core;
+}
 
-cache build_cache(long long num_sets, int num_lines, long long block_size) 
+/* shared_record - the coherence record of block, created on first use */
+static shared_block *shared_record(coherence_t *coh, mem_addr_t block)
 {
+	int added;
+	unsigned long long *slot = map_insert(&coh->index, block, &added);
 
-	cache newCache;	
-	cache_set set;
-	set_line line;
-	int setIndex;
-	int lineIndex;
+	if (added) {
+		if (coh->num_blocks == coh->max_blocks) {
+			coh->max_blocks = coh->max_blocks ? 2 * coh->max_blocks : 1024;
+			coh->blocks = (shared_block *) realloc(coh->blocks, sizeof(shared_block) * coh->max_blocks);
+			if (coh->blocks == NULL) {
+				printf("Could not allocate coherence records\n");
+				exit(1);
+			}
+		}
+		bzero(&coh->blocks[coh->num_blocks], sizeof(shared_block));
+		coh->blocks[coh->num_blocks].block = block;
+		*slot = coh->num_blocks ++;
+	}
+	return &coh->blocks[*slot];
+}
 
-	newCache.sets = (cache_set *) malloc(sizeof(cache_set) * num_sets);
+/* byte_mask - the bytes of its block that [address, address + size)
+ * covers, one bit per byte (per B/64 bytes for blocks over 64 bytes) */
+static unsigned long long byte_mask(cache_param_t *par, mem_addr_t address, int size)
+{
+	unsigned long long first = address & (par->B - 1);
+	unsigned long long last = first + (size > 0 ? size : 1) - 1;
 
-	for (setIndex = 0; setIndex < num_sets; setIndex ++) 
-	{
-		
-		set.lines =  (set_line *) malloc(sizeof(set_line) * num_lines);
-		newCache.sets[setIndex] = set;
+	if (par->B > 64) {
+		first = first * 64 / par->B;
+		last = last * 64 / par->B;
+	}
+	if (last - first == 63) {
+		return ~0ULL;
+	}
+	return ((1ULL << (last - first + 1)) - 1) << first;
+}
 
-		for (lineIndex = 0; lineIndex < num_lines; lineIndex ++) 
-		{
-			
-			line.last_used = 0;
-			line.valid = 0;
-			line.tag = 0; 
-			set.lines[lineIndex] = line;	
-		}
-		
-	} 
+/* flush_line - a snooped core writes its dirty copy back */
+static void flush_line(core_t *core, set_line *line)
+{
+	if (line->dirty) {
+		core->par.writebacks ++;
+		core->par.writeback_bytes += core->par.B;
+		line->dirty = 0;
+	}
+}
 
-	return newCache;
-	
+/* snoop_read - other cores see core c read address; returns 1 if any of
+ * them had a copy, which is now shared */
+static int snoop_read(coherence_t *coh, int c, mem_addr_t address)
+{
+	int found = 0;
+	int o;
+
+	for (o = 0; o < coh->num_cores; o ++) {
+		core_t *other = &coh->cores[o];
+		set_line *line;
+		int empty;
+
+		if (o == c || (line = cache_probe(&other->sim_cache, &other->par, address, &empty)) == NULL) {
+			continue;
+		}
+		flush_line(other, line);
+		line->shared = 1;
+		found = 1;
+	}
+	return found;
 }
 
-void clear_cache(cache sim_cache, long long num_sets, int num_lines, long long block_size) 
+/* snoop_write - other cores drop their copies of address because core c
+ * writes the bytes in mask; returns 1 if any of them had a copy */
+static int snoop_write(coherence_t *coh, int c, mem_addr_t address, unsigned long long mask)
 {
-	int setIndex;
-	
+	mem_addr_t block = address >> coh->cores[c].par.b;
+	int found = 0;
+	int o;
 
-	for (setIndex = 0; setIndex < num_sets; setIndex ++) 
-	{
-		cache_set set = sim_cache.sets[setIndex];
-		
-		if (set.lines != NULL) {	
-			free(set.lines);
+	for (o = 0; o < coh->num_cores; o ++) {
+		core_t *other = &coh->cores[o];
+		set_line *line;
+		shared_block *record;
+		int empty;
+		int added;
+
+		if (o == c || (line = cache_probe(&other->sim_cache, &other->par, address, &empty)) == NULL) {
+			continue;
 		}
-		
-	} 
-	if (sim_cache.sets != NULL) {
-		free(sim_cache.sets);
+		flush_line(other, line);
+		drop_line(&other->sim_cache, &other->par, line);
+		other->invalidations ++;
+		map_insert(&other->lost, block, &added);
+
+		record = shared_record(coh, block);
+		record->invalidations ++;
+		if ((other->touched[line - other->sim_cache.lines] & mask) == 0) {
+			record->false_sharing ++;
+		}
+		record->cores |= (1ULL << o) | (1ULL << c);
+		record->writers |= 1ULL << c;
+		found = 1;
 	}
+	return found;
 }
 
-int find_empty_line(cache_set query_set, cache_param_t par) {
-	int num_lines = par.E;
-	int index;
-	set_line line;
+/* core_access - core c loads or stores the size bytes at address, all in
+ * one block */
+static void core_access(coherence_t *coh, int c, mem_addr_t address, int size, int is_write)
+{
+	core_t *core = &coh->cores[c];
+	cache_param_t *par = &core->par;
+	mem_addr_t block = address >> par->b;
+	unsigned long long mask = byte_mask(par, address, size);
+	set_line *line;
+	set_line evicted;
+	int empty;
+
+	line = cache_lookup(&core->sim_cache, par, address, &empty);
+	if (line != NULL) {
+		par->hits ++;
+		if (is_write && line->shared) {
+			core->upgrades ++;
+			snoop_write(coh, c, address, mask);
+		}
+	} else {
+		int shared = 0;
 
-	for (index = 0; index < num_lines; index ++) {
-		line = query_set.lines[index];
-		if (line.valid == 0) {
-			return index;
+		par->misses ++;
+		if (map_find(&core->lost, block) != NULL) {
+			map_remove(&core->lost, block);
+			core->coherence_misses ++;
+			shared_record(coh, block)->coherence_misses ++;
 		}
+
+		//A store miss is a read for ownership.
+		if (is_write ? snoop_write(coh, c, address, mask) : (shared = snoop_read(coh, c, address))) {
+			coh->transfers ++;
+		}
+
+		line = cache_fill(&core->sim_cache, par, address, empty, &evicted);
+		if (evicted.valid) {
+			par->evicts ++;
+			if (evicted.dirty) {
+				par->dirty_evicts ++;
+				par->writebacks ++;
+				par->writeback_bytes += par->B;
+			}
+		}
+		line->shared = shared;
+		core->touched[line - core->sim_cache.lines] = 0;
 	}
-	//Control flow should not fall here. Method is only called if cache_full flag is set to false.
-	return -1;
+
+	if (is_write) {
+		write_line(par, line, size);
+		line->shared = 0;
+	}
+	core->touched[line - core->sim_cache.lines] |= mask;
 }
 
-int find_evict_line(cache_set query_set, cache_param_t par, int *used_lines) {
-	
-	//Returns index of least recently used line.
-	//used_lines[0] gives least recently used line, used_lines[1] gives current lru counter or most recently used line.
-	int num_lines = par.E;
-	int max_used = query_set.lines[0].last_used;
-	int min_used = query_set.lines[0].last_used;
-	int min_used_index = 0;
-
-	set_line line; 
-	int lineIndex;
+/* cores_access - split a trace access at block boundaries for core c */
+static void cores_access(coherence_t *coh, int c, mem_addr_t address, int size, int is_write)
+{
+	cache_param_t *par = &coh->cores[c].par;
+	mem_addr_t end = access_end(address, size);
+	mem_addr_t next;
+
+	par->accesses ++;
+	if (((address ^ (end - 1)) >> par->b) != 0) {
+		par->straddles ++;
+	}
+	for (; address < end; address = next) {
+		next = block_end(address, par->b, end);
+		core_access(coh, c, address, next - address, is_write);
+	}
+}
+
+static void run_cores(coherence_t *coh, trace_reader_t *read_trace)
+{
+	char trace_cmd;
+	mem_addr_t address;
+	int size;
+	long long thread;
 
-	for (lineIndex = 1; lineIndex < num_lines; lineIndex ++) {
-		line = query_set.lines[lineIndex];
+	while (trace_next(read_trace, &trace_cmd, &address, &size, &thread)) {
+		int c = core_of(coh, thread);
 
-		if (min_used > line.last_used) {
-			min_used_index = lineIndex;	
-			min_used = line.last_used;
+		switch(trace_cmd) {
+			case 'L':
+				cores_access(coh, c, address, size, 0);
+				break;
+			case 'S':
+				cores_access(coh, c, address, size, 1);
+				break;
+			case 'M':
+				cores_access(coh, c, address, size, 0);
+				cores_access(coh, c, address, size, 1);
+				break;
+			default:
+				break;
 		}
+	}
+}
+
+static int compare_false_sharing(const void *a, const void *b)
+{
+	const shared_block *x = (const shared_block *) a;
+	const shared_block *y = (const shared_block *) b;
 
-		if (max_used < line.last_used) {
-			max_used = line.last_used;
+	if (x->false_sharing != y->false_sharing) {
+		return (x->false_sharing < y->false_sharing) ? 1 : -1;
+	}
+	if (x->invalidations != y->invalidations) {
+		return (x->invalidations < y->invalidations) ? 1 : -1;
+	}
+	return (x->block > y->block) ? 1 : (x->block < y->block) ? -1 : 0;
+}
+
+static void print_core_list(unsigned long long cores)
+{
+	int c;
+	const char *sep = "";
+
+	for (c = 0; c < MAX_CORES; c ++) {
+		if (cores & (1ULL << c)) {
+			printf("%s%d", sep, c);
+			sep = ",";
 		}
 	}
+}
+
+static void print_coherence(coherence_t *coh)
+{
+	cache_param_t total;
+	long long invalidations = 0;
+	long long false_sharing = 0;
+	long long coherence_misses = 0;
+	long long index;
+	int shown = 0;
+	int c;
+
+	bzero(&total, sizeof(total));
+	for (c = 0; c < coh->num_cores; c ++) {
+		core_t *core = &coh->cores[c];
+
+		printf("core:%d hits:%lld misses:%lld evictions:%lld coherence_misses:%lld invalidations:%lld upgrades:%lld\n",
+		       c, core->par.hits, core->par.misses, core->par.evicts,
+		       core->coherence_misses, core->invalidations, core->upgrades);
+		add_counters(&total, &core->par);
+		coherence_misses += core->coherence_misses;
+	}
+	for (index = 0; index < coh->num_blocks; index ++) {
+		invalidations += coh->blocks[index].invalidations;
+		false_sharing += coh->blocks[index].false_sharing;
+	}
+
+	print_summary(&total);
+	printf("dirty_evictions:%lld writebacks:%lld writeback_bytes:%lld\n",
+	       total.dirty_evicts, total.writebacks, total.writeback_bytes);
+	print_straddles(&total);
+	printf("coherence_misses:%lld invalidations:%lld false_sharing:%lld (%.2f%%) transfers:%lld\n",
+	       coherence_misses, invalidations, false_sharing,
+	       invalidations ? 100.0 * false_sharing / invalidations : 0.0, coh->transfers);
 
-	used_lines[0] = min_used;
-	used_lines[1] = max_used;
-	return min_used_index;
+	qsort(coh->blocks, coh->num_blocks, sizeof(shared_block), compare_false_sharing);
+	for (index = 0; index < coh->num_blocks && shown < HOT_LINES; index ++) {
+		shared_block *record = &coh->blocks[index];
+
+		if (record->false_sharing == 0) {
+			break;
+		}
+		if (shown ++ == 0) {
+			printf("false-sharing hot lines:\n");
+		}
+		printf("  0x%llx false_sharing:%lld invalidations:%lld coherence_misses:%lld cores:",
+		       record->block << coh->cores[0].par.b, record->false_sharing,
+		       record->invalidations, record->coherence_misses);
+		print_core_list(record->cores);
+		printf(" writers:");
+		print_core_list(record->writers);
+		printf("\n");
+	}
 }
 
-cache_param_t run_sim(cache sim_cache, cache_param_t par, mem_addr_t address) {
-		
-		int lineIndex;
-		int cache_full = 1;
+/*
+ * Library interface.
+ *
+ * The calls declared in csim.h wrap one single-level cache; build with
+ * -DCSIM_LIBRARY to leave main out.  The analyses that main wires up
+ * from the command line (profiling, sampling, TLBs, ...) are not
+ * exposed, except for the prefetcher.  Everything else in this file is
+ * static, so nothing collides with the program that links it.
+ */
 
-		int num_lines = par.E;
-		int prev_hits = par.hits;
+#if CSIM_HIT != SIM_HIT || CSIM_MISS != SIM_MISS || CSIM_EVICT != SIM_EVICT || \
+    CSIM_DIRTY != SIM_DIRTY || CSIM_PF_USED != SIM_PF_USED || CSIM_PF_UNUSED != SIM_PF_UNUSED
+#error "csim.h flags must match run_sim's"
+#endif
 
-		int tag_size = (64 - (par.s + par.b));
-		mem_addr_t input_tag = address >> (par.s + par.b);
-		unsigned long long temp = address << (tag_size);
-		unsigned long long setIndex = temp >> (tag_size + par.b);
-		
-  		cache_set query_set = sim_cache.sets[setIndex];
+#define BATCH_CHUNK	256	/* accesses decoded per pass in csim_access_batch */
+#define BATCH_AHEAD	8	/* how far ahead the batch loop prefetches sets */
 
-		for (lineIndex = 0; lineIndex < num_lines; lineIndex ++) 	{
-			
-			set_line line = query_set.lines[lineIndex];
-			
-			if (line.valid) {
-					
-				if (line.tag == input_tag) {
-						
-					line.last_used ++;
-					par.hits ++;
-					query_set.lines[lineIndex] = line;
-				}
+struct csim {
+	cache sim_cache;
+	cache_param_t par;
+	prefetcher_t prefetcher;
+};
 
-			} else if (!(line.valid) && (cache_full)) {
-				//We found an empty line
-				cache_full = 0;		
-			}
+csim_t *csim_create(const csim_config_t *config)
+{
+	csim_t *sim;
+	const repl_policy_t *policy = find_policy(config->policy != NULL ? config->policy : "lru");
 
-		}	
+	//Check everything setup_cache would exit on but memory.
+	if (policy == NULL || config->s < 0 || config->s > 30 || config->b < 0 || config->b > 30 ||
+	    config->s + config->b < 1 || config->E < 1 ||
+	    (policy->max_lines && config->E > policy->max_lines) ||
+	    (policy->pow2_lines && (config->E & (config->E - 1)) != 0)) {
+		return NULL;
+	}
 
-		if (prev_hits == par.hits) {
-			//Miss in cache;
-			par.misses++;
-		} else {
-			//Data is in cache
-			return par;
+	sim = (csim_t *) calloc(1, sizeof(csim_t));
+	if (sim == NULL) {
+		return NULL;
+	}
+	if (config->prefetcher != NULL) {
+		if (parse_prefetcher(config->prefetcher, &sim->prefetcher) < 0) {
+			free(sim);
+			return NULL;
 		}
+		sim->par.prefetcher = &sim->prefetcher;
+	}
 
-		//We missed, so evict if necessary and write data into cache.
-		
-		int *used_lines = (int*) malloc(sizeof(int) * 2);
-		int min_used_index = find_evict_line(query_set, par, used_lines);	
+	sim->par.s = config->s;
+	sim->par.E = config->E;
+	sim->par.b = config->b;
+	sim->par.policy = policy;
+	sim->par.write_through = config->write_through;
+	sim->par.no_write_allocate = config->no_write_allocate;
+	sim->sim_cache = new_cache(&sim->par);
+	if (sim->sim_cache.sets == NULL) {
+		free(sim);
+		return NULL;
+	}
+	return sim;
+}
 
-		if (cache_full) 
-		{
-			par.evicts++;
+int csim_access(csim_t *sim, unsigned long long address, int size, int is_write)
+{
+	return sim_access(&sim->sim_cache, &sim->par, address, size, is_write);
+}
+
+/*
+ * csim_access_batch - The addresses are decoded a chunk at a time in a
+ * loop with no dependences between iterations, which the compiler can
+ * vectorize; the simulation loop then prefetches the tag rows find_tag
+ * will scan a few accesses ahead and sends accesses that fit in one
+ * block straight to run_sim.
+ */
+long long csim_access_batch(csim_t *sim, const unsigned long long *addresses,
+			    const unsigned char *is_write, long long count, int size)
+{
+	cache_param_t *par = &sim->par;
+	unsigned long long set_mask = par->S - 1;
+	unsigned long long block_mask = par->B - 1;
+	unsigned long long last = (size > 0 ? size : 1) - 1;
+	int plain = (par->prefetcher == NULL);
+	int stride = tag_stride(par->E);
+	long long misses = par->misses;
+	unsigned int sets[BATCH_CHUNK];
+	unsigned char straddles[BATCH_CHUNK];
+	long long base;
+
+	for (base = 0; base < count; base += BATCH_CHUNK) {
+		const unsigned long long *chunk = addresses + base;
+		int n = (count - base < BATCH_CHUNK) ? (int) (count - base) : BATCH_CHUNK;
+		int i;
 
-			//Found least-recently-used line, overwrite it.
-			query_set.lines[min_used_index].tag = input_tag;
-			query_set.lines[min_used_index].last_used = used_lines[1] + 1;
-		
+		for (i = 0; i < n; i ++) {
+			sets[i] = (unsigned int) ((chunk[i] >> par->b) & set_mask);
+			straddles[i] = ((chunk[i] & block_mask) + last) > block_mask;
 		}
 
-		else
-	        {
-			int empty_index = find_empty_line(query_set, par);
+		for (i = 0; i < n; i ++) {
+			int write = (is_write != NULL) ? is_write[base + i] : 0;
 
-			//Found first empty line, write to it.
-			query_set.lines[empty_index].tag = input_tag;
-			query_set.lines[empty_index].valid = 1;
-			query_set.lines[empty_index].last_used = used_lines[1] + 1;
-		}						
+#ifdef __GNUC__
+			if (i + BATCH_AHEAD < n) {
+				__builtin_prefetch(&sim->sim_cache.tags[(size_t) sets[i + BATCH_AHEAD] * stride]);
+			}
+#endif
+			if (plain && !straddles[i]) {
+				par->accesses ++;
+				run_sim(&sim->sim_cache, par, chunk[i], size, write);
+			} else {
+				sim_access(&sim->sim_cache, par, chunk[i], size, write);
+			}
+		}
+	}
+	return par->misses - misses;
+}
+
+void csim_get_stats(const csim_t *sim, csim_stats_t *stats)
+{
+	bzero(stats, sizeof(*stats));
+	stats->accesses = sim->par.accesses;
+	stats->straddles = sim->par.straddles;
+	stats->hits = sim->par.hits;
+	stats->misses = sim->par.misses;
+	stats->evictions = sim->par.evicts;
+	stats->dirty_evictions = sim->par.dirty_evicts;
+	stats->writebacks = sim->par.writebacks;
+	stats->writeback_bytes = sim->par.writeback_bytes;
+	if (sim->par.prefetcher != NULL) {
+		stats->prefetches = sim->prefetcher.issued;
+		stats->useful_prefetches = sim->prefetcher.useful;
+	}
+}
+
+void csim_reset_stats(csim_t *sim)
+{
+	clear_counters(&sim->par);
+	sim->prefetcher.issued = 0;
+	sim->prefetcher.useful = 0;
+	sim->prefetcher.useless = 0;
+	sim->prefetcher.evicts = 0;
+}
 
-		free(used_lines);
-		return par;
+void csim_destroy(csim_t *sim)
+{
+	clear_cache(sim->sim_cache, sim->par.S, sim->par.E, sim->par.B);
+	free(sim);
 }
 
+#ifndef CSIM_LIBRARY
 int main(int argc, char **argv)
 {
 	
 	cache sim_cache;
 	cache_param_t par;
 	bzero(&par, sizeof(par));
+	par.policy = &policies[0];
 
 	long long num_sets;
 	long long block_size;	
 
  
-	FILE *read_trace;
-	char trace_cmd;
-	mem_addr_t address;
-	int size;
+	trace_reader_t *read_trace;
 	
-	char *trace_file;
+	int verbosity = 0;
+	char *trace_file = NULL;
+	char *config_file = NULL;
+	prefetcher_t prefetcher;
+	profiler_t profiler;
+	classifier_t classifier;
+	int classify = 0;
+	intervals_t intervals;
+	sampler_t sampler;
+	int reference = 0;
+	struct timespec start, end;
+	double seconds = 0;
+	double half_width = 0;
+	char *profile_file = NULL;
+	long long profile_window = DEFAULT_WINDOW;
+	int num_workers = 1;
+	int num_cores = 1;
+	coherence_t coherence;
+	tlb_t tlb;
+	tracer_t tracer;
+	long long bench_accesses = 0;
 	char c;
-    while( (c=getopt(argc,argv,"s:E:b:t:vh")) != -1)
+
+	bzero(&tracer, sizeof(tracer));
+	tracer.set_hi = -1;
+    while( (c=getopt(argc,argv,"s:E:b:t:p:B:r:c:w:a:P:o:W:3i:m:Rn:T:vV:h")) != -1)
 	{
         switch(c)
 		{
@@ -279,9 +4450,102 @@ int main(int argc, char **argv)
         case 't':
             trace_file = optarg;
             break;
+        case 'p':
+            num_workers = atoi(optarg);
+            break;
+        case 'B':
+            bench_accesses = atoll(optarg);
+            break;
+        case 'r':
+            par.policy = find_policy(optarg);
+            if (par.policy == NULL) {
+                printf("%s: Unknown replacement policy '%s'\n", argv[0], optarg);
+                printUsage(argv);
+                exit(1);
+            }
+            break;
+        case 'c':
+            config_file = optarg;
+            break;
+        case 'w':
+            if (strcmp(optarg, "wb") != 0 && strcmp(optarg, "wt") != 0) {
+                printf("%s: Write policy must be wb or wt\n", argv[0]);
+                exit(1);
+            }
+            par.write_through = (strcmp(optarg, "wt") == 0);
+            break;
+        case 'a':
+            if (strcmp(optarg, "wa") != 0 && strcmp(optarg, "nwa") != 0) {
+                printf("%s: Allocation policy must be wa or nwa\n", argv[0]);
+                exit(1);
+            }
+            par.no_write_allocate = (strcmp(optarg, "nwa") == 0);
+            break;
+        case 'P':
+            if (parse_prefetcher(optarg, &prefetcher) < 0) {
+                printf("%s: Prefetcher must be next[:N], stride[:N] or stream[:N]\n", argv[0]);
+                exit(1);
+            }
+            par.prefetcher = &prefetcher;
+            break;
+        case 'o':
+            profile_file = optarg;
+            break;
+        case 'W':
+            profile_window = atoll(optarg);
+            if (profile_window <= 0) {
+                printf("%s: Window must be positive\n", argv[0]);
+                exit(1);
+            }
+            break;
+        case '3':
+            classify = 1;
+            break;
+        case 'i':
+            if (parse_intervals(optarg, &intervals) < 0) {
+                printf("%s: Intervals must be N[:diff] with N > 0\n", argv[0]);
+                exit(1);
+            }
+            par.intervals = &intervals;
+            break;
+        case 'm':
+            if (parse_sampler(optarg, &sampler) < 0) {
+                printf("%s: Sampling must be sets:K or intervals:P[:W[:M]] with W + M <= P\n", argv[0]);
+                exit(1);
+            }
+            par.sampler = &sampler;
+            break;
+        case 'R':
+            reference = 1;
+            break;
+        case 'T':
+            if (parse_tlb(optarg, &tlb) < 0) {
+                printf("%s: TLB must be <entries>:<ways>[,<entries>:<ways>] with power-of-two sets\n", argv[0]);
+                exit(1);
+            }
+            par.tlb = &tlb;
+            break;
+        case 'n':
+            num_cores = atoi(optarg);
+            if (num_cores < 1 || num_cores > MAX_CORES) {
+                printf("%s: Cores must be between 1 and %d\n", argv[0], MAX_CORES);
+                exit(1);
+            }
+            break;
         case 'v':
             verbosity = 1;
             break;
+        case 'V':
+            if (parse_tracer(optarg, &tracer) < 0) {
+                printf("%s: -V takes file=<path>, binary, addr=<lo>-<hi> and set=<lo>[-<hi>]\n", argv[0]);
+                exit(1);
+            }
+            if (tracer.binary && tracer.file == NULL) {
+                printf("%s: -V binary needs file=<path>\n", argv[0]);
+                exit(1);
+            }
+            verbosity = 1;
+            break;
         case 'h':
             printUsage(argv);
             exit(0);
@@ -291,54 +4555,187 @@ int main(int argc, char **argv)
         }
     }
 
-    if (par.s == 0 || par.E == 0 || par.b == 0 || trace_file == NULL) 
+    if (config_file != NULL) 
+	{
+		hierarchy_t hier;
+		int i;
+
+		if (trace_file == NULL || num_workers > 1 || par.prefetcher != NULL || profile_file != NULL || classify ||
+		    par.intervals != NULL || par.sampler != NULL || num_cores > 1 || par.tlb != NULL || verbosity) {
+			printf("%s: -c needs -t and cannot be combined with -p, -P, -o, -3, -i, -m, -n, -T or -v\n", argv[0]);
+			exit(1);
+		}
+
+		bzero(&hier, sizeof(hier));
+		read_config(config_file, &hier);
+		for (i = 0; i < hier.num_levels; i ++) {
+			hier.levels[i].sim_cache = setup_cache(&hier.levels[i].par, hier.levels[i].name);
+		}
+
+		read_trace = trace_open(trace_file);
+		if (read_trace == NULL) {
+			printf("%s: Could not open trace file %s\n", argv[0], trace_file);
+			exit(1);
+		}
+		run_hierarchy(&hier, read_trace);
+		trace_close(read_trace);
+
+		print_hierarchy(&hier);
+		for (i = 0; i < hier.num_levels; i ++) {
+			clear_cache(hier.levels[i].sim_cache, hier.levels[i].par.S,
+				    hier.levels[i].par.E, hier.levels[i].par.B);
+		}
+		return 0;
+	}
+
+    if (par.s == 0 || par.E == 0 || par.b == 0 || (trace_file == NULL && bench_accesses == 0)) 
 	{
         printf("%s: Missing required command line argument\n", argv[0]);
         printUsage(argv);
         exit(1);
     }
 
-	
+
+	if (num_cores > 1) {
+		if (trace_file == NULL || num_workers > 1 || par.prefetcher != NULL || profile_file != NULL ||
+		    classify || par.intervals != NULL || par.sampler != NULL || par.tlb != NULL || verbosity) {
+			printf("%s: -n needs -t and cannot be combined with -p, -P, -o, -3, -i, -m, -T or -v\n", argv[0]);
+			exit(1);
+		}
+		if (par.write_through || par.no_write_allocate) {
+			//MESI as modelled here assumes write-back, write-allocate caches.
+			printf("%s: -n needs -w wb -a wa\n", argv[0]);
+			exit(1);
+		}
+
+		init_coherence(&coherence, &par, num_cores, argv[0]);
+		read_trace = trace_open(trace_file);
+		if (read_trace == NULL) {
+			printf("%s: Could not open trace file %s\n", argv[0], trace_file);
+			exit(1);
+		}
+		run_cores(&coherence, read_trace);
+		trace_close(read_trace);
+
+		print_coherence(&coherence);
+		free_coherence(&coherence);
+		return 0;
+	}
+
 	// you need to compute S and B yourself
-	num_sets = pow(2.0, par.s);
-	block_size = bit_pow(par.b);	
-	par.hits = 0;
-	par.misses = 0;
-	par.evicts = 0;
-	
-	sim_cache = build_cache(num_sets, par.E, block_size);
+	sim_cache = setup_cache(&par, argv[0]);
+	num_sets = par.S;
+	block_size = par.B;
+
+	if (verbosity && (bench_accesses > 0 || num_workers > 1)) {
+		//Workers would interleave their lines out of trace order.
+		printf("%s: -v cannot be combined with -B or -p\n", argv[0]);
+		exit(1);
+	}
+
+	if (bench_accesses > 0) {
+		run_benchmark(&sim_cache, &par, bench_accesses);
+		print_summary(&par);
+		clear_cache(sim_cache, num_sets, par.E, block_size);
+		return 0;
+	}
  	
 	// fill in rest of the simulator routine
-	read_trace  = fopen(trace_file, "r");
+	read_trace = trace_open(trace_file);
+	if (read_trace == NULL) {
+		printf("%s: Could not open trace file %s\n", argv[0], trace_file);
+		exit(1);
+	}
 	
 	
-	if (read_trace != NULL) {
-		while (fscanf(read_trace, " %c %llx,%d", &trace_cmd, &address, &size) == 3) {
-
-		
-			switch(trace_cmd) {
-				case 'I':
-					break;
-				case 'L':
-					par = run_sim(sim_cache, par, address);
-					break;
-				case 'S':
-					par = run_sim(sim_cache, par, address);
-					break;
-				case 'M':
-					par = run_sim(sim_cache, par, address);
-					par = run_sim(sim_cache, par, address);	
-					break;
-				default:
-					break;
-			}
+	if (num_workers > 1 && (par.prefetcher != NULL || profile_file != NULL || classify ||
+				par.intervals != NULL || par.tlb != NULL)) {
+		//Prefetches, reuse distances, the shadow cache and the TLBs
+		//cross set boundaries, so the sets are not independent, and
+		//intervals need the accesses in trace order.
+		printf("%s: -P, -o, -3, -i and -T cannot be combined with -p\n", argv[0]);
+		exit(1);
+	}
+	if (par.sampler != NULL) {
+		//The estimate only covers the counters run_sim keeps.
+		if (num_workers > 1 || par.prefetcher != NULL || profile_file != NULL || classify ||
+		    par.intervals != NULL || par.tlb != NULL) {
+			printf("%s: -m cannot be combined with -p, -P, -o, -3, -i or -T\n", argv[0]);
+			exit(1);
 		}
+		init_sampler(&sampler, &par);
+	} else if (reference) {
+		printf("%s: -R needs -m\n", argv[0]);
+		exit(1);
+	}
+	if (par.tlb != NULL) {
+		init_tlb(par.tlb, argv[0]);
+	}
+	if (profile_file != NULL) {
+		init_profiler(&profiler, &par, profile_window);
+		par.profiler = &profiler;
+	}
+	if (classify) {
+		init_classifier(&classifier, &par);
+		par.classifier = &classifier;
+	}
+	if (verbosity) {
+		init_tracer(&tracer, argv[0]);
+		par.tracer = &tracer;
+	}
+
+	if (num_workers > 1) {
+		par = run_parallel(sim_cache, par, num_sets, read_trace, num_workers);
+	} else {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		run_trace(&sim_cache, &par, read_trace);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	}
+	if (par.sampler != NULL) {
+		finish_sampler(par.sampler, &par, &half_width);
+	}
+	if (par.tracer != NULL) {
+		close_tracer(par.tracer);
+	}
+	if (par.intervals != NULL && par.accesses > par.intervals->start_accesses) {
+		//The trace ended partway through an interval.
+		close_interval(par.intervals, &par, 1);
 	}
 	
-	
-    printSummary(par.hits, par.misses, par.evicts);
+    print_summary(&par);
+	printf("dirty_evictions:%lld writebacks:%lld writeback_bytes:%lld\n",
+	       par.dirty_evicts, par.writebacks, par.writeback_bytes);
+	print_straddles(&par);
+	if (par.prefetcher != NULL) {
+		print_prefetcher(&par, par.prefetcher);
+	}
+	if (par.profiler != NULL) {
+		write_profile(par.profiler, &par, profile_file);
+		free_profiler(par.profiler);
+	}
+	if (par.classifier != NULL) {
+		print_classifier(par.classifier);
+		free_classifier(par.classifier);
+	}
+	if (par.intervals != NULL) {
+		print_phases(par.intervals);
+		free_intervals(par.intervals);
+	}
+	if (par.tlb != NULL) {
+		print_tlb(par.tlb);
+		free_tlb(par.tlb);
+	}
+	if (par.sampler != NULL) {
+		print_sampler(par.sampler, &par, half_width);
+		if (reference) {
+			run_reference(&par, trace_file, seconds, half_width);
+		}
+		free_sampler(par.sampler);
+	}
 	clear_cache(sim_cache, num_sets, par.E, block_size);
-	fclose(read_trace);
+	trace_close(read_trace);
 
     return 0;
-}
\ No newline at end of file
+}
+#endif
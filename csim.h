@@ -0,0 +1,84 @@
+/*-------------------------------------------------------------------------*
+ *---                                                                   ---*
+ *---                          csim.h                                   ---*
+ *---                                                                   ---*
+ *---    This file declares the library interface to the cache         ---*
+ *---simulator in csim.c, for driving a cache from another program     ---*
+ *---without going through trace files.  Build csim.c with             ---*
+ *----DCSIM_LIBRARY to leave its main() out, and link cachelab.c.      ---*
+ *---                                                                   ---*
+ *-------------------------------------------------------------------------*/
+
+#ifndef CSIM_H
+#define CSIM_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//---Definition of constants:---//
+
+/* csim_access() result flags; an access that straddles blocks returns
+ * the flags of all of them or'ed together */
+#define		CSIM_HIT		0x1
+#define		CSIM_MISS		0x2
+#define		CSIM_EVICT		0x4
+#define		CSIM_DIRTY		0x8	/* the evicted line was dirty */
+#define		CSIM_PF_USED		0x10	/* first demand hit on a prefetched line */
+#define		CSIM_PF_UNUSED		0x20	/* evicted a prefetched line never used */
+
+
+//---Definition of types:---//
+
+typedef struct csim csim_t;
+
+typedef struct {
+	int s;				/* 2**s sets */
+	int E;				/* lines per set */
+	int b;				/* 2**b bytes per block */
+	const char *policy;		/* as csim -r; NULL for lru */
+	int write_through;		/* 0 for write-back */
+	int no_write_allocate;		/* 0 for write-allocate */
+	const char *prefetcher;		/* as csim -P; NULL for none */
+} csim_config_t;
+
+typedef struct {
+	long long accesses;		/* before splitting at block boundaries */
+	long long straddles;
+	long long hits;
+	long long misses;
+	long long evictions;
+	long long dirty_evictions;
+	long long writebacks;
+	long long writeback_bytes;
+	long long prefetches;		/* blocks the prefetcher brought in */
+	long long useful_prefetches;
+} csim_stats_t;
+
+
+//---Declaration of functions:---//
+
+/* Make a cache; NULL if config is not valid. */
+extern csim_t *csim_create(const csim_config_t *config);
+
+/* Load (is_write == 0) or store size bytes at address; returns CSIM_ flags. */
+extern int csim_access(csim_t *sim, unsigned long long address, int size, int is_write);
+
+/* Run count accesses of size bytes each.  is_write[i] says whether
+ * addresses[i] is a store; pass NULL for all loads.  Returns the
+ * number of misses. */
+extern long long csim_access_batch(csim_t *sim, const unsigned long long *addresses,
+				   const unsigned char *is_write, long long count, int size);
+
+extern void csim_get_stats(const csim_t *sim, csim_stats_t *stats);
+
+/* Zero the statistics; the cache contents are kept. */
+extern void csim_reset_stats(csim_t *sim);
+
+extern void csim_destroy(csim_t *sim);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -38,12 +38,46 @@
 
 #define		WRITE_CMD_CHAR	'w'
 
+#define		APPEND_CMD_CHAR	'a'
+
 #define		DELETE_CMD_CHAR	'd'
 
 #define		CALC_CMD_CHAR	'c'
 
+#define		STATS_CMD_CHAR	's'
+
 #define		QUIT_CMD_CHAR 	'q'
 
+//  A client that opens with FRAMED_HELLO speaks the framed protocol, and
+//the server answers with the same bytes.  Otherwise the first bytes are a
+//text command, and the connection stays with one command per 'write()'
+//and one reply per command.
+#define		FRAMED_HELLO	"MSF1"
+
+#define		FRAMED_HELLO_LEN 4
+
+//  A framed request is:  a 4-byte length of the rest of the frame, a
+//4-byte request id chosen by the client, the command char, a 4-byte file
+//number, and for a write or append, the text.  A framed reply is:  a
+//4-byte length of the rest, the id of the request it answers, FRAME_OKAY
+//or FRAME_ERROR, and the reply text.  Numbers are in network byte order.
+//Only write and append frames may be longer than MAX_FRAME_LEN:  their
+//text goes to the file as it arrives.  Requests may be sent without
+//waiting for replies.  They may run at the same time and be answered in
+//any order, so a request that needs an earlier one done (a calculation
+//of a file being written) should wait for its reply.
+#define		FRAME_LEN_SIZE	4
+
+#define		FRAME_REQUEST_LEN 9
+
+#define		FRAME_REPLY_LEN	5
+
+#define		FRAME_OKAY	0
+
+#define		FRAME_ERROR	1
+
+#define		MAX_FRAME_LEN	(1 << 20)
+
 const 	int	MIN_FILE_NUM = 0;
 
 const int	MAX_FILE_NUM = 63;
\ No newline at end of file
@@ -0,0 +1,1122 @@
+/*-------------------------------------------------------------------------*
+ *---                                                                   ---*
+ *---                          mathEval.c                               ---*
+ *---                                                                   ---*
+ *---    This file defines an in-process evaluator for simple bc        ---*
+ *---programs, so mathServer can calculate them without a bc process.   ---*
+ *---Numbers are decimal digit strings with a scale, and each operator  ---*
+ *---keeps bc's rules for the scale of its result and truncates the     ---*
+ *---same way.  Anything else makes evalBc() give up, and the caller    ---*
+ *---runs the program in bc instead.                                   ---*
+ *---                                                                   ---*
+ *-------------------------------------------------------------------------*/
+
+//---Header file inclusion---//
+
+#include "matheval.h"
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h> // For setjmp(), longjmp()
+
+
+//---Definition of constants:---//
+
+//  Bigger numbers, and what would make them, are left to bc:
+#define		MAX_DIGITS		4096
+
+#define		MAX_VARS		64
+
+#define		MAX_NAME_LEN		32
+
+#define		MAX_DEPTH		256	// Nested parentheses and operators
+
+//  bc breaks output lines this long with a backslash:
+#define		LINE_LENGTH		70
+
+
+//---Definition of types:---//
+
+//  PURPOSE:  To hold the number sign_ * digits_ / 10^scale_.  'digits_'
+//has 'len_' decimal digits, least significant first, with no leading
+//zeros beyond the ones the fraction needs.
+struct		Number
+{
+  int			sign_;		// 1 or -1
+  int			scale_;
+  int			len_;
+  unsigned char*	digits_;
+};
+
+struct		Variable
+{
+  char			name_[MAX_NAME_LEN];
+  struct Number*	valuePtr_;
+};
+
+//  PURPOSE:  To hold the state of one evalBc() run.
+struct		Evaluator
+{
+  const char*		pos_;		// Next byte of the program
+  const char*		end_;
+  int			depth_;
+  int			scale_;
+  struct Variable	vars_[MAX_VARS];
+  int			numVars_;
+
+  char*			outPtr_;
+  size_t		outLen_;	// Bytes written
+  size_t		outCap_;	// Bytes that fit, less the nul
+  int			outCol_;
+
+  struct Number*	tempPtrs_[MAX_DEPTH*2];	// Numbers to free on give up
+  int			numTemps_;
+  jmp_buf		giveUp_;
+};
+
+
+//---Definition of functions:---//
+
+//  PURPOSE:  To abandon the evaluation:  bc must run the program.
+static void	giveUp		(struct Evaluator*	evalPtr
+				)
+{
+  longjmp(evalPtr->giveUp_,1);
+}
+
+
+//  PURPOSE:  To return a new zero-valued number with room for 'len' digits.
+static struct Number*
+		newNumber	(struct Evaluator*	evalPtr,
+				 int			len
+				)
+{
+  if  (len > MAX_DIGITS)
+    giveUp(evalPtr);
+
+  struct Number*	numPtr	= (struct Number*)malloc(sizeof(struct Number));
+  unsigned char*	digits	= (unsigned char*)calloc(len + 1,1);
+
+  if  ( (numPtr == NULL)  ||  (digits == NULL) )
+  {
+    free(numPtr);
+    free(digits);
+    giveUp(evalPtr);
+  }
+
+  numPtr->sign_		= 1;
+  numPtr->scale_	= 0;
+  numPtr->len_		= len;
+  numPtr->digits_	= digits;
+  return(numPtr);
+}
+
+
+static void	freeNumber	(struct Number*		numPtr
+				)
+{
+  if  (numPtr != NULL)
+  {
+    free(numPtr->digits_);
+    free(numPtr);
+  }
+}
+
+
+//  PURPOSE:  To keep 'numPtr' where giving up will free it, while it is
+//only held on the C stack.  Returns 'numPtr'.
+static struct Number*
+		holdTemp	(struct Evaluator*	evalPtr,
+				 struct Number*		numPtr
+				)
+{
+  if  (evalPtr->numTemps_ == MAX_DEPTH*2)
+  {
+    freeNumber(numPtr);
+    giveUp(evalPtr);
+  }
+
+  evalPtr->tempPtrs_[evalPtr->numTemps_++]	= numPtr;
+  return(numPtr);
+}
+
+
+//  PURPOSE:  To stop keeping 'numPtr' for giving up, and free it if
+//'shouldFree'.
+static void	dropTemp	(struct Evaluator*	evalPtr,
+				 struct Number*		numPtr,
+				 int			shouldFree
+				)
+{
+  int	i;
+
+  for  (i = evalPtr->numTemps_ - 1;  i >= 0;  i--)
+    if  (evalPtr->tempPtrs_[i] == numPtr)
+    {
+      evalPtr->tempPtrs_[i]	= evalPtr->tempPtrs_[--evalPtr->numTemps_];
+      break;
+    }
+
+  if  (shouldFree)
+    freeNumber(numPtr);
+}
+
+
+//  PURPOSE:  To drop leading zeros from 'numPtr', keeping the integer
+//digit bc keeps for numbers below one.
+static void	trimNumber	(struct Number*		numPtr
+				)
+{
+  while  ( (numPtr->len_ > numPtr->scale_ + 1)  &&
+           (numPtr->digits_[numPtr->len_ - 1] == 0) )
+    numPtr->len_--;
+}
+
+
+static int	isZero		(const struct Number*	numPtr
+				)
+{
+  int	i;
+
+  for  (i = 0;  i < numPtr->len_;  i++)
+    if  (numPtr->digits_[i] != 0)
+      return(0);
+
+  return(1);
+}
+
+
+//  PURPOSE:  To return a copy of 'numPtr' with 'scale' fraction digits,
+//padded with zeros or truncated toward zero.
+static struct Number*
+		rescale		(struct Evaluator*	evalPtr,
+				 const struct Number*	numPtr,
+				 int			scale
+				)
+{
+  int			shift	= scale - numPtr->scale_;
+  int			len	= numPtr->len_ + shift;
+  struct Number*	resPtr;
+  int			i;
+
+  if  (len < scale + 1)
+    len	= scale + 1;
+
+  resPtr		= newNumber(evalPtr,len);
+  resPtr->sign_		= numPtr->sign_;
+  resPtr->scale_	= scale;
+
+  for  (i = 0;  i < numPtr->len_;  i++)
+    if  ( (i + shift >= 0)  &&  (i + shift < len) )
+      resPtr->digits_[i + shift]	= numPtr->digits_[i];
+
+  trimNumber(resPtr);
+  return(resPtr);
+}
+
+
+//  PURPOSE:  To compare the magnitudes of 'aPtr' and 'bPtr', which have
+//the same scale.  Returns <0, 0 or >0.
+static int	compareDigits	(const unsigned char*	a,
+				 int			aLen,
+				 const unsigned char*	b,
+				 int			bLen
+				)
+{
+  while  ( (aLen > 0)  &&  (a[aLen-1] == 0) )
+    aLen--;
+
+  while  ( (bLen > 0)  &&  (b[bLen-1] == 0) )
+    bLen--;
+
+  if  (aLen != bLen)
+    return(aLen - bLen);
+
+  while  (aLen-- > 0)
+    if  (a[aLen] != b[aLen])
+      return(a[aLen] - b[aLen]);
+
+  return(0);
+}
+
+
+//  PURPOSE:  To return 'aPtr' + 'sign' * 'bPtr', at the larger scale.
+static struct Number*
+		addNumbers	(struct Evaluator*	evalPtr,
+				 const struct Number*	aPtr,
+				 const struct Number*	bPtr,
+				 int			sign
+				)
+{
+  int			scale	= (aPtr->scale_ > bPtr->scale_) ? aPtr->scale_ : bPtr->scale_;
+  struct Number*	xPtr	= holdTemp(evalPtr,rescale(evalPtr,aPtr,scale));
+  struct Number*	yPtr	= holdTemp(evalPtr,rescale(evalPtr,bPtr,scale));
+  int			len	= ((xPtr->len_ > yPtr->len_) ? xPtr->len_ : yPtr->len_) + 1;
+  struct Number*	resPtr	= newNumber(evalPtr,len);
+  int			ySign	= yPtr->sign_ * sign;
+  int			i;
+
+  resPtr->scale_	= scale;
+
+  if  (xPtr->sign_ == ySign)
+  {
+    int	carry	= 0;
+
+    for  (i = 0;  i < len;  i++)
+    {
+      int	sum	= carry + ((i < xPtr->len_) ? xPtr->digits_[i] : 0)
+				+ ((i < yPtr->len_) ? yPtr->digits_[i] : 0);
+
+      resPtr->digits_[i]	= sum % 10;
+      carry			= sum / 10;
+    }
+
+    resPtr->sign_	= xPtr->sign_;
+  }
+  else
+  {
+    //  Subtract the smaller magnitude from the larger:
+    struct Number*	bigPtr	= xPtr;
+    struct Number*	smallPtr= yPtr;
+    int			borrow	= 0;
+
+    resPtr->sign_	= xPtr->sign_;
+
+    if  (compareDigits(xPtr->digits_,xPtr->len_,yPtr->digits_,yPtr->len_) < 0)
+    {
+      bigPtr		= yPtr;
+      smallPtr		= xPtr;
+      resPtr->sign_	= ySign;
+    }
+
+    for  (i = 0;  i < len;  i++)
+    {
+      int	diff	= ((i < bigPtr->len_) ? bigPtr->digits_[i] : 0)
+			  - ((i < smallPtr->len_) ? smallPtr->digits_[i] : 0) - borrow;
+
+      borrow		= (diff < 0);
+      resPtr->digits_[i]= diff + 10*borrow;
+    }
+  }
+
+  dropTemp(evalPtr,xPtr,1);
+  dropTemp(evalPtr,yPtr,1);
+  trimNumber(resPtr);
+
+  if  (isZero(resPtr))
+    resPtr->sign_	= 1;
+
+  return(resPtr);
+}
+
+
+//  PURPOSE:  To return 'aPtr' * 'bPtr' with all 'aPtr->scale_' +
+//'bPtr->scale_' fraction digits.
+static struct Number*
+		multiplyExact	(struct Evaluator*	evalPtr,
+				 const struct Number*	aPtr,
+				 const struct Number*	bPtr
+				)
+{
+  struct Number*	resPtr	= newNumber(evalPtr,aPtr->len_ + bPtr->len_);
+  int*			sums	= (int*)calloc(aPtr->len_ + bPtr->len_ + 1,sizeof(int));
+  int			i;
+  int			j;
+
+  if  (sums == NULL)
+  {
+    freeNumber(resPtr);
+    giveUp(evalPtr);
+  }
+
+  for  (i = 0;  i < aPtr->len_;  i++)
+    if  (aPtr->digits_[i] != 0)
+      for  (j = 0;  j < bPtr->len_;  j++)
+        sums[i+j] += aPtr->digits_[i] * bPtr->digits_[j];
+
+  for  (i = 0;  i < resPtr->len_;  i++)
+  {
+    sums[i+1]		+= sums[i] / 10;
+    resPtr->digits_[i]	= sums[i] % 10;
+  }
+
+  free(sums);
+  resPtr->sign_		= aPtr->sign_ * bPtr->sign_;
+  resPtr->scale_	= aPtr->scale_ + bPtr->scale_;
+  trimNumber(resPtr);
+  return(resPtr);
+}
+
+
+//  PURPOSE:  To return 'aPtr' * 'bPtr' as bc does:  the exact product
+//truncated to 'scale', but never to fewer fraction digits than either
+//factor has, nor more than the two have together.
+static struct Number*
+		multiplyNumbers	(struct Evaluator*	evalPtr,
+				 const struct Number*	aPtr,
+				 const struct Number*	bPtr
+				)
+{
+  int			full	= aPtr->scale_ + bPtr->scale_;
+  int			scale	= (aPtr->scale_ > bPtr->scale_) ? aPtr->scale_ : bPtr->scale_;
+  struct Number*	prodPtr	= holdTemp(evalPtr,multiplyExact(evalPtr,aPtr,bPtr));
+  struct Number*	resPtr;
+
+  if  (evalPtr->scale_ > scale)
+    scale	= evalPtr->scale_;
+
+  if  (scale > full)
+    scale	= full;
+
+  resPtr	= rescale(evalPtr,prodPtr,scale);
+  dropTemp(evalPtr,prodPtr,1);
+
+  if  (isZero(resPtr))
+    resPtr->sign_	= 1;
+
+  return(resPtr);
+}
+
+
+//  PURPOSE:  To return 'aPtr' / 'bPtr' truncated to 'scale' fraction
+//digits.  Gives up on division by zero, so bc can report it.
+static struct Number*
+		divideNumbers	(struct Evaluator*	evalPtr,
+				 const struct Number*	aPtr,
+				 const struct Number*	bPtr,
+				 int			scale
+				)
+{
+  if  (isZero(bPtr))
+    giveUp(evalPtr);
+
+  //  The quotient digits are those of the integer a * 10^shift / b, where
+  //a and b are the digit strings:
+  int			shift	= scale + bPtr->scale_ - aPtr->scale_;
+  struct Number*	numPtr	= holdTemp(evalPtr,newNumber(evalPtr,aPtr->len_ + ((shift > 0) ? shift : 0)));
+  struct Number*	denPtr	= holdTemp(evalPtr,newNumber(evalPtr,bPtr->len_ + ((shift < 0) ? -shift : 0) + 1));
+  struct Number*	resPtr	= holdTemp(evalPtr,newNumber(evalPtr,numPtr->len_ + scale + 1));
+  unsigned char*	rem	= (unsigned char*)calloc(denPtr->len_ + 2,1);
+  int			remLen	= 0;
+  int			i;
+  int			j;
+
+  if  (rem == NULL)
+    giveUp(evalPtr);
+
+  memcpy(numPtr->digits_ + ((shift > 0) ? shift : 0),aPtr->digits_,aPtr->len_);
+  memcpy(denPtr->digits_ + ((shift < 0) ? -shift : 0),bPtr->digits_,bPtr->len_);
+  denPtr->len_--;
+
+  //  Long division, a digit of the quotient at a time:
+  for  (i = numPtr->len_ - 1;  i >= 0;  i--)
+  {
+    memmove(rem + 1,rem,remLen);
+    rem[0]	= numPtr->digits_[i];
+    remLen++;
+
+    while  ( (remLen > 0)  &&  (rem[remLen-1] == 0) )
+      remLen--;
+
+    int	digit	= 0;
+
+    while  (compareDigits(rem,remLen,denPtr->digits_,denPtr->len_) >= 0)
+    {
+      int	borrow	= 0;
+
+      for  (j = 0;  j < remLen;  j++)
+      {
+        int	diff	= rem[j] - ((j < denPtr->len_) ? denPtr->digits_[j] : 0) - borrow;
+
+        borrow	= (diff < 0);
+        rem[j]	= diff + 10*borrow;
+      }
+
+      while  ( (remLen > 0)  &&  (rem[remLen-1] == 0) )
+        remLen--;
+
+      digit++;
+    }
+
+    if  (i < resPtr->len_)
+      resPtr->digits_[i]	= digit;
+  }
+
+  free(rem);
+  dropTemp(evalPtr,numPtr,1);
+  dropTemp(evalPtr,denPtr,1);
+  dropTemp(evalPtr,resPtr,0);
+
+  resPtr->sign_		= aPtr->sign_ * bPtr->sign_;
+  resPtr->scale_	= scale;
+  trimNumber(resPtr);
+
+  if  (isZero(resPtr))
+    resPtr->sign_	= 1;
+
+  return(resPtr);
+}
+
+
+//  PURPOSE:  To return 'aPtr' % 'bPtr' as bc defines it:  'aPtr' less
+//'bPtr' times their quotient to 'scale' fraction digits.
+static struct Number*
+		modNumbers	(struct Evaluator*	evalPtr,
+				 const struct Number*	aPtr,
+				 const struct Number*	bPtr
+				)
+{
+  struct Number*	quotPtr	= holdTemp(evalPtr,divideNumbers(evalPtr,aPtr,bPtr,evalPtr->scale_));
+  struct Number*	prodPtr	= holdTemp(evalPtr,multiplyExact(evalPtr,quotPtr,bPtr));
+  struct Number*	resPtr	= addNumbers(evalPtr,aPtr,prodPtr,-1);
+
+  dropTemp(evalPtr,quotPtr,1);
+  dropTemp(evalPtr,prodPtr,1);
+  return(resPtr);
+}
+
+
+//  PURPOSE:  To return 'aPtr' ^ 'bPtr' as bc does.  The exponent must be
+//an integer.  A positive power keeps at most 'scale' fraction digits, or
+//those of 'aPtr' if more, truncating the exact power without making a
+//zero result positive; a negative one is 1 / the power, to 'scale'.
+static struct Number*
+		raiseNumber	(struct Evaluator*	evalPtr,
+				 const struct Number*	aPtr,
+				 const struct Number*	bPtr
+				)
+{
+  long			exponent	= 0;
+  int			i;
+
+  //  A fraction in the exponent gets a warning from bc:
+  if  (bPtr->scale_ != 0)
+    giveUp(evalPtr);
+
+  for  (i = bPtr->len_ - 1;  i >= 0;  i--)
+  {
+    exponent	= 10*exponent + bPtr->digits_[i];
+
+    if  (exponent > MAX_DIGITS)
+      giveUp(evalPtr);
+  }
+
+  if  (exponent == 0)
+  {
+    struct Number*	onePtr	= newNumber(evalPtr,1);
+
+    onePtr->digits_[0]	= 1;
+    return(onePtr);
+  }
+
+  int	aLen	= aPtr->len_;
+
+  while  ( (aLen > 1)  &&  (aPtr->digits_[aLen-1] == 0) )
+    aLen--;
+
+  if  ( (long)aLen * exponent > MAX_DIGITS )
+    giveUp(evalPtr);
+
+  //  Square and multiply, exactly:
+  struct Number*	powerPtr	= holdTemp(evalPtr,rescale(evalPtr,aPtr,aPtr->scale_));
+  struct Number*	resPtr		= holdTemp(evalPtr,newNumber(evalPtr,1));
+  struct Number*	nextPtr;
+  long			remaining	= exponent;
+
+  resPtr->digits_[0]	= 1;
+
+  while  (1)
+  {
+    if  (remaining & 1)
+    {
+      nextPtr	= multiplyExact(evalPtr,resPtr,powerPtr);
+      dropTemp(evalPtr,resPtr,1);
+      resPtr	= holdTemp(evalPtr,nextPtr);
+    }
+
+    remaining >>= 1;
+
+    if  (remaining == 0)
+      break;
+
+    nextPtr	= multiplyExact(evalPtr,powerPtr,powerPtr);
+    dropTemp(evalPtr,powerPtr,1);
+    powerPtr	= holdTemp(evalPtr,nextPtr);
+  }
+
+  dropTemp(evalPtr,powerPtr,1);
+
+  if  (bPtr->sign_ < 0)
+  {
+    struct Number*	onePtr	= holdTemp(evalPtr,newNumber(evalPtr,1));
+
+    onePtr->digits_[0]	= 1;
+    nextPtr	= divideNumbers(evalPtr,onePtr,resPtr,evalPtr->scale_);
+    dropTemp(evalPtr,onePtr,1);
+    dropTemp(evalPtr,resPtr,1);
+    return(nextPtr);
+  }
+
+  int	scale	= (evalPtr->scale_ > aPtr->scale_) ? evalPtr->scale_ : aPtr->scale_;
+
+  if  (scale > resPtr->scale_)
+    scale	= resPtr->scale_;
+
+  nextPtr	= rescale(evalPtr,resPtr,scale);
+  dropTemp(evalPtr,resPtr,1);
+  return(nextPtr);
+}
+
+
+//  PURPOSE:  To write 'ch' as bc's output routine does, starting a new
+//line with a backslash before the last column.  Output past what fits
+//in the caller's buffer is dropped.
+static void	outChar		(struct Evaluator*	evalPtr,
+				 char			ch
+				)
+{
+  if  (ch == '\n')
+    evalPtr->outCol_	= 0;
+  else if  (++evalPtr->outCol_ == LINE_LENGTH - 1)
+  {
+    outChar(evalPtr,'\\');
+    outChar(evalPtr,'\n');
+    evalPtr->outCol_	= 1;
+  }
+
+  if  (evalPtr->outLen_ < evalPtr->outCap_)
+    evalPtr->outPtr_[evalPtr->outLen_++]	= ch;
+}
+
+
+//  PURPOSE:  To print 'numPtr' and a newline as bc does:  no integer
+//digits for a number below one, and all 'scale_' fraction digits.
+static void	printNumber	(struct Evaluator*	evalPtr,
+				 const struct Number*	numPtr
+				)
+{
+  int	i;
+
+  if  (numPtr->sign_ < 0)
+    outChar(evalPtr,'-');
+
+  if  (isZero(numPtr))
+    outChar(evalPtr,'0');
+  else
+  {
+    if  ( (numPtr->len_ > numPtr->scale_ + 1)  ||  (numPtr->digits_[numPtr->scale_] != 0) )
+      for  (i = numPtr->len_ - 1;  i >= numPtr->scale_;  i--)
+        outChar(evalPtr,'0' + numPtr->digits_[i]);
+
+    if  (numPtr->scale_ > 0)
+    {
+      outChar(evalPtr,'.');
+
+      for  (i = numPtr->scale_ - 1;  i >= 0;  i--)
+        outChar(evalPtr,'0' + numPtr->digits_[i]);
+    }
+  }
+
+  outChar(evalPtr,'\n');
+}
+
+
+//  PURPOSE:  To skip blanks, comments and escaped newlines, but not
+//newlines, which end statements.
+static void	skipBlanks	(struct Evaluator*	evalPtr
+				)
+{
+  while  (evalPtr->pos_ < evalPtr->end_)
+  {
+    const char*	p	= evalPtr->pos_;
+
+    if  ( (*p == ' ')  ||  (*p == '\t')  ||  (*p == '\r') )
+      evalPtr->pos_++;
+    else if  ( (*p == '\\')  &&  (p+1 < evalPtr->end_)  &&  (p[1] == '\n') )
+      evalPtr->pos_ += 2;
+    else if  (*p == '#')
+    {
+      while  ( (evalPtr->pos_ < evalPtr->end_)  &&  (*evalPtr->pos_ != '\n') )
+        evalPtr->pos_++;
+    }
+    else if  ( (*p == '/')  &&  (p+1 < evalPtr->end_)  &&  (p[1] == '*') )
+    {
+      const char*	closePtr;
+
+      for  (closePtr = p+2;  closePtr+1 < evalPtr->end_;  closePtr++)
+        if  ( (closePtr[0] == '*')  &&  (closePtr[1] == '/') )
+          break;
+
+      if  (closePtr+1 >= evalPtr->end_)
+        giveUp(evalPtr);
+
+      evalPtr->pos_	= closePtr + 2;
+    }
+    else
+      break;
+  }
+}
+
+
+//  PURPOSE:  To return the next character of the program after blanks,
+//without taking it, or '\0' at the end.
+static char	peekChar	(struct Evaluator*	evalPtr
+				)
+{
+  skipBlanks(evalPtr);
+  return( (evalPtr->pos_ < evalPtr->end_) ? *evalPtr->pos_ : '\0' );
+}
+
+
+//  PURPOSE:  To read a name of lower case letters, digits and '_' into
+//'name'.  Returns its length.
+static int	readName	(struct Evaluator*	evalPtr,
+				 char*			name
+				)
+{
+  int	len	= 0;
+
+  while  ( (evalPtr->pos_ < evalPtr->end_)  &&
+           ( ( (*evalPtr->pos_ >= 'a') && (*evalPtr->pos_ <= 'z') )  ||
+             ( (*evalPtr->pos_ >= '0') && (*evalPtr->pos_ <= '9') )  ||
+             (*evalPtr->pos_ == '_') ) )
+  {
+    if  (len == MAX_NAME_LEN - 1)
+      giveUp(evalPtr);
+
+    name[len++]	= *evalPtr->pos_++;
+  }
+
+  name[len]	= '\0';
+  return(len);
+}
+
+
+//  PURPOSE:  To return the variable 'name', making it (as zero) if new.
+//Only plain variables and scale are done here; bc's other names are
+//keywords, functions or special variables, so give up on them.
+static struct Variable*
+		findVariable	(struct Evaluator*	evalPtr,
+				 const char*		name
+				)
+{
+  static const char*	reserved[]	=
+				{ "auto", "break", "continue", "define", "else",
+				  "for", "halt", "ibase", "if", "last", "length",
+				  "limits", "obase", "print", "quit", "read",
+				  "return", "sqrt", "warranty", "while", NULL
+				};
+  int			i;
+
+  for  (i = 0;  reserved[i] != NULL;  i++)
+    if  (strcmp(name,reserved[i]) == 0)
+      giveUp(evalPtr);
+
+  for  (i = 0;  i < evalPtr->numVars_;  i++)
+    if  (strcmp(name,evalPtr->vars_[i].name_) == 0)
+      return(&evalPtr->vars_[i]);
+
+  if  (evalPtr->numVars_ == MAX_VARS)
+    giveUp(evalPtr);
+
+  struct Variable*	varPtr	= &evalPtr->vars_[evalPtr->numVars_++];
+
+  strcpy(varPtr->name_,name);
+  varPtr->valuePtr_	= newNumber(evalPtr,1);
+  return(varPtr);
+}
+
+
+//  PURPOSE:  To return the value of a number literal:  decimal digits
+//with at most one point.  Upper case (hex) digits and a bare point are
+//left to bc.
+static struct Number*
+		readLiteral	(struct Evaluator*	evalPtr
+				)
+{
+  const char*	startPtr	= evalPtr->pos_;
+  const char*	pointPtr	= NULL;
+  const char*	p;
+
+  for  (p = startPtr;  p < evalPtr->end_;  p++)
+  {
+    if  ( (*p == '.')  &&  (pointPtr == NULL) )
+      pointPtr	= p;
+    else if  ( (*p == '\\')  ||  ( (*p >= 'A') && (*p <= 'Z') ) )
+      giveUp(evalPtr);
+    else if  ( (*p < '0')  ||  (*p > '9') )
+      break;
+  }
+
+  int			numDigits	= (p - startPtr) - (pointPtr != NULL);
+
+  //  A lone '.' is bc's short name for 'last', not a number.
+  if  (numDigits == 0)
+    giveUp(evalPtr);
+
+  evalPtr->pos_	= p;
+
+  struct Number*	numPtr		= newNumber(evalPtr,numDigits);
+  int			i		= 0;
+
+  numPtr->scale_	= (pointPtr != NULL) ? (p - pointPtr - 1) : 0;
+
+  while  (p-- > startPtr)
+    if  (*p != '.')
+      numPtr->digits_[i++]	= *p - '0';
+
+  if  (numPtr->len_ < numPtr->scale_ + 1)
+  {
+    struct Number*	padPtr	= holdTemp(evalPtr,numPtr);
+
+    numPtr	= rescale(evalPtr,padPtr,padPtr->scale_);
+    dropTemp(evalPtr,padPtr,1);
+  }
+
+  trimNumber(numPtr);
+  return(numPtr);
+}
+
+
+static struct Number*
+		evalSum		(struct Evaluator*	evalPtr);
+
+
+//  PURPOSE:  To evaluate a number, variable, parenthesized expression or
+//negation.  In bc negation binds tighter than ^, so -2^2 is 4.
+static struct Number*
+		evalUnary	(struct Evaluator*	evalPtr
+				)
+{
+  char			ch	= peekChar(evalPtr);
+  struct Number*	resPtr;
+
+  if  (++evalPtr->depth_ > MAX_DEPTH)
+    giveUp(evalPtr);
+
+  if  (ch == '-')
+  {
+    evalPtr->pos_++;
+
+    if  (peekChar(evalPtr) == '-')
+      //  "--" is a decrement, or at least means more than this.
+      giveUp(evalPtr);
+
+    resPtr	= evalUnary(evalPtr);
+
+    if  (!isZero(resPtr))
+      resPtr->sign_	= -resPtr->sign_;
+  }
+  else if  (ch == '(')
+  {
+    evalPtr->pos_++;
+    resPtr	= holdTemp(evalPtr,evalSum(evalPtr));
+
+    if  (peekChar(evalPtr) != ')')
+      giveUp(evalPtr);
+
+    evalPtr->pos_++;
+    dropTemp(evalPtr,resPtr,0);
+  }
+  else if  ( ( (ch >= '0') && (ch <= '9') )  ||  (ch == '.') )
+    resPtr	= readLiteral(evalPtr);
+  else if  ( (ch >= 'a')  &&  (ch <= 'z') )
+  {
+    char	name[MAX_NAME_LEN];
+
+    readName(evalPtr,name);
+
+    if  ( (peekChar(evalPtr) == '(')  ||  (peekChar(evalPtr) == '[') )
+      giveUp(evalPtr);
+
+    if  (strcmp(name,"scale") == 0)
+    {
+      int		value	= evalPtr->scale_;
+      int		i;
+
+      resPtr	= newNumber(evalPtr,11);
+
+      for  (i = 0;  i < 11;  i++, value /= 10)
+        resPtr->digits_[i]	= value % 10;
+
+      trimNumber(resPtr);
+    }
+    else
+    {
+      struct Variable*	varPtr	= findVariable(evalPtr,name);
+
+      resPtr	= rescale(evalPtr,varPtr->valuePtr_,varPtr->valuePtr_->scale_);
+    }
+  }
+  else
+    giveUp(evalPtr);
+
+  //  Increments and decrements are left to bc:
+  if  ( (evalPtr->pos_ + 1 < evalPtr->end_)  &&
+        ( (evalPtr->pos_[0] == '+' && evalPtr->pos_[1] == '+')  ||
+          (evalPtr->pos_[0] == '-' && evalPtr->pos_[1] == '-') ) )
+  {
+    freeNumber(resPtr);
+    giveUp(evalPtr);
+  }
+
+  evalPtr->depth_--;
+  return(resPtr);
+}
+
+
+//  PURPOSE:  To evaluate a ^ b ^ ..., which groups to the right.
+static struct Number*
+		evalPower	(struct Evaluator*	evalPtr
+				)
+{
+  struct Number*	basePtr	= holdTemp(evalPtr,evalUnary(evalPtr));
+
+  if  (peekChar(evalPtr) != '^')
+  {
+    dropTemp(evalPtr,basePtr,0);
+    return(basePtr);
+  }
+
+  evalPtr->pos_++;
+
+  if  (peekChar(evalPtr) == '=')
+    giveUp(evalPtr);
+
+  if  (++evalPtr->depth_ > MAX_DEPTH)
+    giveUp(evalPtr);
+
+  struct Number*	expPtr	= holdTemp(evalPtr,evalPower(evalPtr));
+  struct Number*	resPtr	= raiseNumber(evalPtr,basePtr,expPtr);
+
+  evalPtr->depth_--;
+  dropTemp(evalPtr,basePtr,1);
+  dropTemp(evalPtr,expPtr,1);
+  return(resPtr);
+}
+
+
+//  PURPOSE:  To evaluate a product of powers, with * / and %.
+static struct Number*
+		evalProduct	(struct Evaluator*	evalPtr
+				)
+{
+  struct Number*	resPtr	= holdTemp(evalPtr,evalPower(evalPtr));
+
+  while  (1)
+  {
+    char		op	= peekChar(evalPtr);
+    struct Number*	rightPtr;
+    struct Number*	nextPtr;
+
+    if  ( (op != '*')  &&  (op != '/')  &&  (op != '%') )
+      break;
+
+    evalPtr->pos_++;
+
+    if  (peekChar(evalPtr) == '=')
+      giveUp(evalPtr);
+
+    rightPtr	= holdTemp(evalPtr,evalPower(evalPtr));
+
+    if  (op == '*')
+      nextPtr	= multiplyNumbers(evalPtr,resPtr,rightPtr);
+    else if  (op == '/')
+      nextPtr	= divideNumbers(evalPtr,resPtr,rightPtr,evalPtr->scale_);
+    else
+      nextPtr	= modNumbers(evalPtr,resPtr,rightPtr);
+
+    dropTemp(evalPtr,resPtr,1);
+    dropTemp(evalPtr,rightPtr,1);
+    resPtr	= holdTemp(evalPtr,nextPtr);
+  }
+
+  dropTemp(evalPtr,resPtr,0);
+  return(resPtr);
+}
+
+
+//  PURPOSE:  To evaluate a sum of products, with + and -.
+static struct Number*
+		evalSum		(struct Evaluator*	evalPtr
+				)
+{
+  struct Number*	resPtr	= holdTemp(evalPtr,evalProduct(evalPtr));
+
+  while  (1)
+  {
+    char		op	= peekChar(evalPtr);
+    struct Number*	rightPtr;
+    struct Number*	nextPtr;
+
+    if  ( (op != '+')  &&  (op != '-') )
+      break;
+
+    evalPtr->pos_++;
+
+    if  ( (peekChar(evalPtr) == '=')  ||  (peekChar(evalPtr) == op) )
+      giveUp(evalPtr);
+
+    rightPtr	= holdTemp(evalPtr,evalProduct(evalPtr));
+    nextPtr	= addNumbers(evalPtr,resPtr,rightPtr,(op == '+') ? 1 : -1);
+    dropTemp(evalPtr,resPtr,1);
+    dropTemp(evalPtr,rightPtr,1);
+    resPtr	= holdTemp(evalPtr,nextPtr);
+  }
+
+  //  Comparisons, logic and the like are left to bc:
+  char	ch	= peekChar(evalPtr);
+
+  if  ( (ch != '\0')  &&  (ch != '\n')  &&  (ch != ';')  &&  (ch != ')') )
+    giveUp(evalPtr);
+
+  dropTemp(evalPtr,resPtr,0);
+  return(resPtr);
+}
+
+
+//  PURPOSE:  To run one statement:  a string, which is printed as it is;
+//an assignment, which prints nothing; quit; or an expression, whose value
+//is printed.  Returns 0 after quit, or 1 to go on.
+static int	runStatement	(struct Evaluator*	evalPtr
+				)
+{
+  char	ch	= peekChar(evalPtr);
+
+  if  ( (ch == '\n')  ||  (ch == ';')  ||  (ch == '\0') )
+    return(1);
+
+  if  (ch == '"')
+  {
+    const char*	p;
+
+    for  (p = evalPtr->pos_ + 1;  (p < evalPtr->end_) && (*p != '"');  p++)
+      //  Backslashes may be escapes, depending on the bc:
+      if  (*p == '\\')
+        giveUp(evalPtr);
+
+    if  (p == evalPtr->end_)
+      giveUp(evalPtr);
+
+    for  (evalPtr->pos_++;  evalPtr->pos_ < p;  evalPtr->pos_++)
+      outChar(evalPtr,*evalPtr->pos_);
+
+    evalPtr->pos_++;
+    return(1);
+  }
+
+  if  ( (ch >= 'a')  &&  (ch <= 'z') )
+  {
+    const char*	startPtr	= evalPtr->pos_;
+    char	name[MAX_NAME_LEN];
+
+    readName(evalPtr,name);
+
+    if  (strcmp(name,"quit") == 0)
+      return(0);
+
+    if  ( (peekChar(evalPtr) == '=')  &&
+          ( (evalPtr->pos_ + 1 >= evalPtr->end_)  ||  (evalPtr->pos_[1] != '=') ) )
+    {
+      evalPtr->pos_++;
+
+      struct Number*	valuePtr	= holdTemp(evalPtr,evalSum(evalPtr));
+
+      if  (strcmp(name,"scale") == 0)
+      {
+        //  bc truncates the new scale to an integer.
+        int	value	= 0;
+        int	i;
+
+        if  (valuePtr->sign_ < 0)
+          giveUp(evalPtr);
+
+        for  (i = valuePtr->len_ - 1;  i >= valuePtr->scale_;  i--)
+        {
+          value	= 10*value + valuePtr->digits_[i];
+
+          if  (value > MAX_DIGITS)
+            giveUp(evalPtr);
+        }
+
+        evalPtr->scale_	= value;
+        dropTemp(evalPtr,valuePtr,1);
+      }
+      else
+      {
+        struct Variable*	varPtr	= findVariable(evalPtr,name);
+
+        freeNumber(varPtr->valuePtr_);
+        varPtr->valuePtr_	= valuePtr;
+        dropTemp(evalPtr,valuePtr,0);
+      }
+
+      return(1);
+    }
+
+    evalPtr->pos_	= startPtr;
+  }
+
+  struct Number*	valuePtr	= holdTemp(evalPtr,evalSum(evalPtr));
+
+  printNumber(evalPtr,valuePtr);
+  dropTemp(evalPtr,valuePtr,1);
+  return(1);
+}
+
+
+//  PURPOSE:  To run the bc program of 'len' bytes at 'textPtr' and put up
+//to 'outLen'-1 bytes of what bc would print for it in 'outPtr', followed
+//by a nul.  Returns 1 on success, or 0 if the program uses anything the
+//evaluator does not do exactly as bc would; it should then be given to
+//bc itself.
+int		evalBc		(const char*	textPtr,
+				 size_t		len,
+				 char*		outPtr,
+				 size_t		outLen
+				)
+{
+  struct Evaluator*	evalPtr	= (struct Evaluator*)calloc(1,sizeof(struct Evaluator));
+  volatile int		status	= 1;
+  int			i;
+
+  if  ( (evalPtr == NULL)  ||  (outLen == 0) )
+  {
+    free(evalPtr);
+    return(0);
+  }
+
+  evalPtr->pos_		= textPtr;
+  evalPtr->end_		= textPtr + len;
+  evalPtr->outPtr_	= outPtr;
+  evalPtr->outCap_	= outLen - 1;
+
+  if  (setjmp(evalPtr->giveUp_) == 0)
+  {
+    while  (runStatement(evalPtr))
+    {
+      char	ch	= peekChar(evalPtr);
+
+      if  (ch == '\0')
+        break;
+
+      if  ( (ch != '\n')  &&  (ch != ';') )
+        giveUp(evalPtr);
+
+      evalPtr->pos_++;
+      evalPtr->depth_	= 0;
+    }
+  }
+  else
+    status	= 0;
+
+  outPtr[evalPtr->outLen_]	= '\0';
+
+  for  (i = 0;  i < evalPtr->numTemps_;  i++)
+    freeNumber(evalPtr->tempPtrs_[i]);
+
+  for  (i = 0;  i < evalPtr->numVars_;  i++)
+    freeNumber(evalPtr->vars_[i].valuePtr_);
+
+  free(evalPtr);
+  return(status);
+}
@@ -0,0 +1,31 @@
+/*-------------------------------------------------------------------------*
+ *---                                                                   ---*
+ *---                          mathEval.h                               ---*
+ *---                                                                   ---*
+ *---    This file declares an in-process evaluator for the simple      ---*
+ *---bc programs mathServer is usually asked to calculate:  numbers of  ---*
+ *---any length, + - * / % ^, parentheses, variables, scale and string  ---*
+ *---statements, printed the way GNU bc prints them.                   ---*
+ *---                                                                   ---*
+ *-------------------------------------------------------------------------*/
+
+#ifndef		MATH_EVAL_H
+#define		MATH_EVAL_H
+
+#include <stddef.h>
+
+
+//---Declaration of functions:---//
+
+//  PURPOSE:  To run the bc program of 'len' bytes at 'textPtr' and put up
+//to 'outLen'-1 bytes of what bc would print for it in 'outPtr', followed
+//by a nul.  Returns 1 on success, or 0 if the program uses anything the
+//evaluator does not do exactly as bc would (functions, control flow,
+//ibase and obase, errors, ...); it should then be given to bc itself.
+extern int	evalBc		(const char*	textPtr,
+				 size_t		len,
+				 char*		outPtr,
+				 size_t		outLen
+				);
+
+#endif
@@ -0,0 +1,622 @@
+/*-------------------------------------------------------------------------*
+ *---                                                                   ---*
+ *---                          mathLoad.c                               ---*
+ *---                                                                   ---*
+ *---    This file defines a C program that loads a mathServer with     ---*
+ *---many client connections, each sending a few commands and then      ---*
+ *---quitting, and reports connections per second and the latency      ---*
+ *---of connecting and of each command.                                ---*
+ *---                                                                   ---*
+ *-------------------------------------------------------------------------*/
+
+//Compile with:
+//$ gcc mathLoad.c -o mathLoad -lpthread
+//Run with, for example:
+//$ ./mathLoad -c 10000 -j 64 -n 4 -m "l" localhost 20001
+
+//Or, with the framed protocol and 16 requests in flight per connection:
+//$ ./mathLoad -c 1000 -n 64 -p 16 -m "c 5" localhost 20001
+//Or, writing 64 MB to 5.bc each time:
+//$ ./mathLoad -c 10 -n 1 -p 1 -s 67108864 -m "w 5" localhost 20001
+
+//---Header file inclusion---//
+
+#include "mathClientServer.h"
+#include <pthread.h> // For pthread_create()
+#include <getopt.h> // For getopt()
+#include <time.h> // For clock_gettime()
+#include <netinet/tcp.h> // For TCP_NODELAY
+
+
+//---Definition of constants:---//
+
+#define		THIS_PROGRAM_NAME	"mathLoad"
+
+#define		DEFAULT_NUM_CONNS	1000
+
+#define		DEFAULT_NUM_THREADS	16
+
+#define		DEFAULT_NUM_REQUESTS	4
+
+#define		DEFAULT_COMMAND		"l"
+
+#define		REPLY_LEN		4096
+
+//  Framed replies, which may be whole files, are read this much at a time:
+#define		DRAIN_LEN		(1 << 18)
+
+#define		QUIT_CMD		"q"
+
+#define		MAX_PIPE_DEPTH		64
+
+
+//---Definition of global vars:---//
+
+const char*		hostName;
+
+const char*		portName;
+
+const char*		command		= DEFAULT_COMMAND;
+
+int			numConns	= DEFAULT_NUM_CONNS;
+
+int			numRequests	= DEFAULT_NUM_REQUESTS;
+
+int			pipeDepth	= 0;	// Framed requests in flight, or 0
+					// for text commands
+char			frameCommand;		// 'command', parsed for framing
+int			frameFileNum;
+char			frameText[BUFFER_LEN];
+
+size_t			textSize	= 0;	// Framed text of this many bytes in
+					// place of 'frameText', if not 0
+
+int			nextConn	= 0;	// Next connection to make
+
+int			numFailures	= 0;
+
+int			numErrorReplies	= 0;	// Framed replies of FRAME_ERROR
+
+double			replyBytes	= 0;	// Of framed replies
+
+pthread_mutex_t		countLock	= PTHREAD_MUTEX_INITIALIZER;
+
+double*			connectTimes;		// 'numConns' of them, in seconds,
+
+double*			requestTimes;		// and 'numConns*numRequests';
+						// -1 for those that failed
+
+struct addrinfo*	serverAddrPtr;
+
+
+//---Definition of functions:---//
+
+//  PURPOSE:  To return the time now, in seconds.
+double		now		()
+{
+  struct timespec	ts;
+
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return(ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+
+//  PURPOSE:  To return a socket connected to the server, or -1 on failure.
+int		connectToServer	()
+{
+  int	fd	= socket(serverAddrPtr->ai_family,
+			 serverAddrPtr->ai_socktype,
+			 serverAddrPtr->ai_protocol
+			);
+  int	one	= 1;
+
+  if  (fd < 0)
+    return(-1);
+
+  if  (connect(fd,serverAddrPtr->ai_addr,serverAddrPtr->ai_addrlen) < 0)
+  {
+    close(fd);
+    return(-1);
+  }
+
+  setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&one,sizeof(one));
+  return(fd);
+}
+
+
+//  PURPOSE:  To send 'cmdPtr' on 'fd' and wait for its reply, as
+//mathClient does:  one 'write()' out, one 'read()' back.  Returns 0 on
+//success or -1 on failure.
+int		doRequest	(int		fd,
+				 const char*	cmdPtr
+				)
+{
+  char	buffer[REPLY_LEN];
+
+  if  (write(fd,cmdPtr,strlen(cmdPtr)) < 0)
+    return(-1);
+
+  return( (read(fd,buffer,REPLY_LEN) > 0) ? 0 : -1 );
+}
+
+
+//  PURPOSE:  To read exactly 'len' bytes from 'fd' into 'bufPtr'.  Returns
+//0 on success or -1 on failure.
+int		readFully	(int		fd,
+				 void*		bufPtr,
+				 size_t		len
+				)
+{
+  size_t	got	= 0;
+
+  while  (got < len)
+  {
+    ssize_t	numRead	= read(fd,(char*)bufPtr + got,len - got);
+
+    if  (numRead <= 0)
+      return(-1);
+
+    got	+= numRead;
+  }
+
+  return(0);
+}
+
+
+//  PURPOSE:  To write exactly 'len' bytes at 'bufPtr' to 'fd'.  Returns 0
+//on success or -1 on failure.
+int		writeFully	(int		fd,
+				 const void*	bufPtr,
+				 size_t		len
+				)
+{
+  size_t	done	= 0;
+
+  while  (done < len)
+  {
+    ssize_t	numWritten	= write(fd,(const char*)bufPtr + done,len - done);
+
+    if  (numWritten <= 0)
+      return(-1);
+
+    done	+= numWritten;
+  }
+
+  return(0);
+}
+
+
+//  PURPOSE:  To put a framed request of 'cmd' on 'fileNum', with the
+//'textLen' bytes at 'textPtr' as its text and id 'id', at 'bufPtr'.  If
+//'textPtr' is NULL only the header is put, and the text must follow it.
+//Returns the length put.
+size_t		putFrame	(char*		bufPtr,
+				 uint32_t	id,
+				 char		cmd,
+				 int		fileNum,
+				 const char*	textPtr,
+				 size_t		textLen
+				)
+{
+  uint32_t	field;
+
+  field	= htonl(FRAME_REQUEST_LEN + textLen);
+  memcpy(bufPtr,&field,sizeof(field));
+  field	= htonl(id);
+  memcpy(bufPtr + FRAME_LEN_SIZE,&field,sizeof(field));
+  bufPtr[FRAME_LEN_SIZE + 4]	= cmd;
+  field	= htonl(fileNum);
+  memcpy(bufPtr + FRAME_LEN_SIZE + 5,&field,sizeof(field));
+
+  if  (textPtr == NULL)
+    return(FRAME_LEN_SIZE + FRAME_REQUEST_LEN);
+
+  memcpy(bufPtr + FRAME_LEN_SIZE + FRAME_REQUEST_LEN,textPtr,textLen);
+  return(FRAME_LEN_SIZE + FRAME_REQUEST_LEN + textLen);
+}
+
+
+//  PURPOSE:  To read one framed reply from 'fd', adding its length to
+//'*bytesPtr' and setting '*isErrorPtr' to whether it is FRAME_ERROR.
+//Returns its request id, or -1 on failure.
+long		readFrame	(int	fd,
+				 double*	bytesPtr,
+				 int*		isErrorPtr
+				)
+{
+  char		buffer[DRAIN_LEN];
+  uint32_t	field;
+  unsigned char	status;
+  size_t	len;
+  size_t	chunk;
+
+  if  (readFully(fd,&field,sizeof(field)) < 0)
+    return(-1);
+
+  len		= ntohl(field);
+  *bytesPtr	+= FRAME_LEN_SIZE + len;
+
+  if  ( (len < FRAME_REPLY_LEN)  ||
+        (readFully(fd,&field,sizeof(field)) < 0)  ||
+        (readFully(fd,&status,sizeof(status)) < 0) )
+    return(-1);
+
+  *isErrorPtr	= (status != FRAME_OKAY);
+
+  for  (len -= FRAME_REPLY_LEN;  len > 0;  len -= chunk)
+  {
+    chunk	= (len < DRAIN_LEN) ? len : DRAIN_LEN;
+
+    if  (readFully(fd,buffer,chunk) < 0)
+      return(-1);
+  }
+
+  return(ntohl(field));
+}
+
+
+//  PURPOSE:  To run the connection 'fd' with the framed protocol:  send
+//'numRequests' framed copies of 'command', keeping up to 'pipeDepth' of
+//them unanswered, then quit.  Each latency, from a request being sent to
+//its reply coming back, in whatever order, goes in 'times[]'.  Returns 0
+//on success or -1 on failure, which includes any FRAME_ERROR reply.
+int		doFramedRequests(int		fd,
+				 double*	times
+				)
+{
+  char		buffer[MAX_PIPE_DEPTH * (FRAME_LEN_SIZE + FRAME_REQUEST_LEN + BUFFER_LEN)];
+  char		hello[FRAMED_HELLO_LEN];
+  int		numSent		= 0;
+  int		numAnswered	= 0;
+  int		numErrors	= 0;
+  int		isError;
+  long		id;
+  double	bytes		= 0;
+
+  if  ( (write(fd,FRAMED_HELLO,FRAMED_HELLO_LEN) < 0)  ||
+        (readFully(fd,hello,FRAMED_HELLO_LEN) < 0)  ||
+        (memcmp(hello,FRAMED_HELLO,FRAMED_HELLO_LEN) != 0) )
+    return(-1);
+
+  while  (numAnswered < numRequests)
+  {
+    size_t	len	= 0;
+
+    //  Top up the requests in flight, all in one 'write()', unless they
+    //have 'textSize' bytes of text each:
+    while  ( (numSent < numRequests)  &&  (numSent - numAnswered < pipeDepth) )
+    {
+      times[numSent]	= now();
+
+      if  (textSize == 0)
+      {
+        len	+= putFrame(buffer + len,numSent++,frameCommand,frameFileNum,
+			    frameText,strlen(frameText)
+			   );
+        continue;
+      }
+
+      size_t	left	= textSize;
+
+      len	= putFrame(buffer,numSent++,frameCommand,frameFileNum,NULL,textSize);
+
+      if  (writeFully(fd,buffer,len) < 0)
+        return(-1);
+
+      for  (len = 0;  left > 0;  left -= len)
+      {
+        len	= (left < sizeof(buffer)) ? left : sizeof(buffer);
+        memset(buffer,'x',len);
+
+        if  (writeFully(fd,buffer,len) < 0)
+          return(-1);
+      }
+
+      len	= 0;
+    }
+
+    if  ( (len > 0)  &&  (writeFully(fd,buffer,len) < 0) )
+      return(-1);
+
+    id	= readFrame(fd,&bytes,&isError);
+
+    if  ( (id < 0)  ||  (id >= numSent) )
+      return(-1);
+
+    times[id]	= now() - times[id];
+    numAnswered++;
+    numErrors	+= isError;
+  }
+
+  if  (writeFully(fd,buffer,putFrame(buffer,numRequests,QUIT_CMD_CHAR,0,"",0)) < 0)
+    return(-1);
+
+  id	= readFrame(fd,&bytes,&isError);
+  pthread_mutex_lock(&countLock);
+  replyBytes	+= bytes;
+  numErrorReplies += numErrors;
+  pthread_mutex_unlock(&countLock);
+  return( ( (id == numRequests)  &&  (numErrors == 0) ) ? 0 : -1 );
+}
+
+
+//  PURPOSE:  To note one failed connection.
+void		countFailure	()
+{
+  pthread_mutex_lock(&countLock);
+  numFailures++;
+  pthread_mutex_unlock(&countLock);
+}
+
+
+//  PURPOSE:  To make connections, until 'numConns' have been made by all
+//threads together, each sending 'numRequests' commands and then quitting.
+//'vPtr' is ignored.
+void*		doClient	(void*	vPtr
+				)
+{
+  while  (1)
+  {
+    int		connNum;
+    int		fd;
+    int		i;
+    double	start;
+
+    pthread_mutex_lock(&countLock);
+    connNum	= nextConn++;
+    pthread_mutex_unlock(&countLock);
+
+    if  (connNum >= numConns)
+      break;
+
+    start	= now();
+    fd		= connectToServer();
+
+    if  (fd < 0)
+    {
+      countFailure();
+      continue;
+    }
+
+    connectTimes[connNum]	= now() - start;
+
+    if  (pipeDepth > 0)
+    {
+      if  (doFramedRequests(fd,requestTimes + (long)connNum*numRequests) < 0)
+      {
+        //  Failed requests do not count toward the latencies.
+        for  (i = 0;  i < numRequests;  i++)
+          requestTimes[(long)connNum*numRequests + i]	= -1;
+
+        countFailure();
+      }
+
+      close(fd);
+      continue;
+    }
+
+    for  (i = 0;  i < numRequests;  i++)
+    {
+      start	= now();
+
+      if  (doRequest(fd,command) < 0)
+        break;
+
+      requestTimes[(long)connNum*numRequests + i]	= now() - start;
+    }
+
+    if  ( (i < numRequests)  ||  (doRequest(fd,QUIT_CMD) < 0) )
+      countFailure();
+
+    close(fd);
+  }
+
+  return(NULL);
+}
+
+
+//  PURPOSE:  To compare the doubles pointed to by 'aPtr' and 'bPtr'.
+int		compareDoubles	(const void*	aPtr,
+				 const void*	bPtr
+				)
+{
+  double	a	= *(const double*)aPtr;
+  double	b	= *(const double*)bPtr;
+
+  return( (a > b) - (a < b) );
+}
+
+
+//  PURPOSE:  To print the median, 99th percentile and maximum of the
+//times in 'times[]' that are not -1, labelled 'what'.  'n' is the length
+//of 'times[]', which is rearranged.
+void		printLatency	(const char*	what,
+				 double*	times,
+				 long		n
+				)
+{
+  long	kept	= 0;
+  long	i;
+
+  for  (i = 0;  i < n;  i++)
+    if  (times[i] >= 0)
+      times[kept++]	= times[i];
+
+  n	= kept;
+
+  if  (n == 0)
+    return;
+
+  qsort(times,n,sizeof(double),compareDoubles);
+  printf("%s latency: p50 %.1f us  p99 %.1f us  max %.1f us\n",
+	 what,
+	 times[n/2] * 1e6,
+	 times[(long)(n*0.99)] * 1e6,
+	 times[n-1] * 1e6
+	);
+}
+
+
+//  PURPOSE:  To print how to run this program and exit.
+void		usage		(const char*	progName
+				)
+{
+  fprintf(stderr,
+	  "Usage: %s [-c <conns>] [-j <threads>] [-n <requests>] [-m <command>]\n"
+	  "       %*s [-i <idle>] [-p <depth> [-s <bytes>]] <host> <port>\n"
+	  "  -c  Connections to make in all (default %d).\n"
+	  "  -j  Client threads, each with one connection open at a time (default %d).\n"
+	  "  -n  Commands sent per connection before quitting (default %d).\n"
+	  "  -m  Command to send (default \"%s\").\n"
+	  "  -i  Extra connections held open, idle, for the whole run (default 0).\n"
+		  "  -p  Use the framed protocol, with up to this many requests in flight\n"
+		  "      per connection (default 0:  text commands, one at a time).\n"
+		  "  -s  With -p, send this many bytes of text with each command, in place\n"
+		  "      of the quoted text; for large writes and appends.\n",
+	  progName,(int)strlen(progName),"",
+	  DEFAULT_NUM_CONNS,DEFAULT_NUM_THREADS,DEFAULT_NUM_REQUESTS,DEFAULT_COMMAND
+	 );
+  exit(EXIT_FAILURE);
+}
+
+
+int		main		(int	argc,
+				 char*	argv[]
+				)
+{
+  //  I.  Application validity check:
+  int		numThreads	= DEFAULT_NUM_THREADS;
+  int		numIdle		= 0;
+  int		c;
+
+  while  ( (c = getopt(argc,argv,"c:j:n:m:i:p:s:h")) != -1 )
+  {
+    switch  (c)
+    {
+    case 'c' :
+      numConns	= strtol(optarg,NULL,0);
+      break;
+    case 'j' :
+      numThreads	= strtol(optarg,NULL,0);
+      break;
+    case 'n' :
+      numRequests	= strtol(optarg,NULL,0);
+      break;
+    case 'm' :
+      command	= optarg;
+      break;
+    case 'i' :
+      numIdle	= strtol(optarg,NULL,0);
+      break;
+    case 'p' :
+      pipeDepth	= strtol(optarg,NULL,0);
+      break;
+    case 's' :
+      textSize	= strtoul(optarg,NULL,0);
+      break;
+    default :
+      usage(argv[0]);
+    }
+  }
+
+  if  ( (argc - optind != 2)  ||  (numConns < 1)  ||  (numThreads < 1)  ||
+        (numRequests < 0)  ||  (numIdle < 0)  ||  (command[0] == '\0')  ||
+        (pipeDepth < 0)  ||  (pipeDepth > MAX_PIPE_DEPTH)  ||
+        ( (textSize > 0)  &&  ( (pipeDepth == 0)  ||  (textSize > 0xFFFFFFFFUL - FRAME_REQUEST_LEN) ) ) )
+    usage(argv[0]);
+
+  sscanf(command,"%c %d \"%[^\"]\"",&frameCommand,&frameFileNum,frameText);
+
+  hostName	= argv[optind];
+  portName	= argv[optind+1];
+
+  struct addrinfo	hints;
+
+  memset(&hints,'\0',sizeof(hints));
+  hints.ai_family	= AF_INET;
+  hints.ai_socktype	= SOCK_STREAM;
+
+  if  (getaddrinfo(hostName,portName,&hints,&serverAddrPtr) != 0)
+  {
+    fprintf(stderr,"Could not find %s port %s\n",hostName,portName);
+    return(EXIT_FAILURE);
+  }
+
+  //  II.  Load the server:
+  //  II.A.  Connect the idle clients:
+  int*		idleFds	= (int*)malloc((numIdle+1) * sizeof(int));
+  int		i;
+
+  for  (i = 0;  i < numIdle;  i++)
+  {
+    idleFds[i]	= connectToServer();
+
+    if  (idleFds[i] < 0)
+    {
+      fprintf(stderr,"Could only open %d idle connections\n",i);
+      return(EXIT_FAILURE);
+    }
+  }
+
+  //  II.B.  Run the busy ones:
+  pthread_t*	threadIds	= (pthread_t*)malloc(numThreads * sizeof(pthread_t));
+  double	start;
+  double	elapsed;
+
+  long		numTimes	= (long)numConns*numRequests;
+  long		j;
+
+  connectTimes	= (double*)malloc(numConns * sizeof(double));
+  requestTimes	= (double*)malloc((numTimes + 1) * sizeof(double));
+
+  if  ( (threadIds == NULL)  ||  (connectTimes == NULL)  ||  (requestTimes == NULL) )
+  {
+    fprintf(stderr,"Not enough memory\n");
+    return(EXIT_FAILURE);
+  }
+
+  for  (j = 0;  j < numConns;  j++)
+    connectTimes[j]	= -1;
+
+  for  (j = 0;  j < numTimes;  j++)
+    requestTimes[j]	= -1;
+
+  start	= now();
+
+  for  (i = 0;  i < numThreads;  i++)
+    pthread_create(&threadIds[i],NULL,doClient,NULL);
+
+  for  (i = 0;  i < numThreads;  i++)
+    pthread_join(threadIds[i],NULL);
+
+  elapsed	= now() - start;
+
+  //  III.  Report:
+  printf("%d connections (%d failed), %d commands each, %d threads, %d idle, %s\n",
+	 numConns,numFailures,numRequests,numThreads,numIdle,
+	 (pipeDepth > 0) ? "framed" : "text"
+	);
+  printf("%.3f s: %.0f connections/s, %.0f commands/s\n",
+	 elapsed,
+	 numConns / elapsed,
+	 (double)numConns * numRequests / elapsed
+	);
+
+  if  (pipeDepth > 0)
+    printf("%.1f MB of replies: %.1f MB/s, %d errors\n",
+	   replyBytes / 1e6,replyBytes / 1e6 / elapsed,numErrorReplies
+	  );
+
+  printLatency("connect",connectTimes,numConns);
+  printLatency("command",requestTimes,numTimes);
+
+  for  (i = 0;  i < numIdle;  i++)
+    close(idleFds[i]);
+
+  freeaddrinfo(serverAddrPtr);
+  free(idleFds);
+  free(threadIds);
+  free(connectTimes);
+  free(requestTimes);
+  return( (numFailures == 0) ? EXIT_SUCCESS : EXIT_FAILURE );
+}
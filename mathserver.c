@@ -3,9 +3,10 @@
  *---                          mathServer.c                             ---*
  *---                                                                   ---*
  *---    This file defines a C program that gets file-sys commands      ---*
- *---from client via a socket, executes those commands in their own     ---*
- *---threads, and returns the corresponding output back to the          ---*
- *---client.                                                            ---*
+ *---from clients via sockets and returns their output.  One thread     ---*
+ *---runs an epoll loop that accepts connections, reads and parses      ---*
+ *---commands, and queues them; a fixed pool of worker threads runs     ---*
+ *---the queued commands (files, bc) and sends the replies.             ---*
  *---                                                                   ---*
  *---  ----  ----  ---- ----  ----  ----  ----   ----                   ---*
  *---                                                                   ---*
@@ -14,13 +15,23 @@
  *-------------------------------------------------------------------------*/
 
 //Compile with:
-//$ gcc mathServer.c -o mathServer -lpthread
+//$ gcc mathServer.c matheval.c -o mathServer -lpthread
+//Run with:
+//$ ./mathServer <port> [<numWorkers>]
 
 //---Header file inclusion---//
 
+#define		_GNU_SOURCE // For accept4() and pipe2()
 #include "mathClientServer.h"
+#include "matheval.h"
 #include <errno.h> // For perror()
 #include <pthread.h> // For pthread_create()
+#include <sys/epoll.h> // For epoll_create1(), epoll_ctl(), epoll_wait()
+#include <poll.h> // For poll()
+#include <signal.h> // For kill(), signal()
+#include <netinet/tcp.h> // For TCP_NODELAY
+#include <sys/sendfile.h> // For sendfile()
+#include <time.h> // For clock_gettime()
 
 
 //---Definition of constants:---//
@@ -35,245 +46,2226 @@
 
 #define		FILENAME_EXTENSION	".bc"
 
-#define		OUTPUT_FILENAME		"out.txt"
+#define		CALC_PROGNAME		"/usr/bin/bc"
 
-#define		ERROR_FILENAME		"err.txt"
+//  bc prints this after a file's own output, so the end of the output can
+//be found without bc exiting:
+#define		CALC_SENTINEL		"@@mathServer-calc-done@@"
+
+//  The sentinel starts a line of its own, as bc splits long lines, and is
+//followed by a printed 0 so that 'last' does not carry one file's result
+//into the next.  CALC_TAIL_OUT is what bc prints for CALC_TAIL:
+#define		CALC_TAIL		"\n\"\n" CALC_SENTINEL "\"\n0\n"
+
+#define		CALC_TAIL_OUT		"\n" CALC_SENTINEL "0\n"
+
+#ifndef		CALC_TIMEOUT_MS
+#define		CALC_TIMEOUT_MS		10000
+#endif
+
+#define		CALC_CHUNK		4096
+
+//  Bigger files go straight to bc rather than to evalBc(), and are not
+//cached:
+#define		CALC_EVAL_MAX		16384
+
+//  Calculation results kept, least recently used dropped first.  Each
+//takes under 512 bytes:
+#define		CALC_CACHE_SIZE		1024
+
+//  Must be a power of 2:
+#define		CALC_CACHE_BUCKETS	256
+
+#define		DEFAULT_NUM_WORKERS	8
+
+#define		MAX_NUM_WORKERS		256
+
+#define		MAX_EVENTS		256
+
+#define		LISTEN_BACKLOG		1024
+
+#define		MODE_UNKNOWN		0
+
+#define		MODE_TEXT		1
+
+#define		MODE_FRAMED		2
+
+//  Requests one framed connection may have queued or running at a time:
+#define		MAX_IN_FLIGHT		64
+
+//  Unsent reply bytes beyond which a framed connection is not read:
+#define		MAX_OUT_BACKLOG		(1 << 20)
+
+#define		READ_CHUNK		65536
+
+//  The most one 'splice()' moves from a socket into a connection's pipe:
+#define		SPLICE_CHUNK		65536
+
+//  The most 'splice()'s the epoll thread does for one framed write per
+//wakeup, before it goes on to the other connections:
+#define		SPLICES_PER_WAKEUP	4
+
+//  What a connection's pipe is asked to hold, so that the epoll thread can
+//fill it while a worker empties it into the file:
+#define		PIPE_SIZE		(2 * SPLICES_PER_WAKEUP * SPLICE_CHUNK)
+
+//  The most a framed reply's 4-byte length can cover of a file:
+#define		MAX_FILE_REPLY		(0xFFFFFFFFUL - FRAME_REPLY_LEN)
 
-#define		CALC_PROGNAME		"/usr/bin/bc"
 
-extern void*	handleClient(void* vPtr);
-extern void*	 dirCommand(int fd);
-extern void*	 readCommand(int clientFd, int fileNum);
-extern void*	writeCommand(int clientFd, int fileNum, void* text);
-extern void*   deleteCommand(int clientFd, int fileNum);
-extern void* 	 calcCommand(int clientFd, int fileNum);
+//---Definition of types:---//
+
+//  PURPOSE:  To hold a file, or what is left of it, to be sent once the
+//first 'at_' reply bytes of its connection are out.
+struct		FileSend
+{
+  int			fd_;
+  off_t			offset_;
+  size_t		left_;
+  size_t		at_;
+  struct FileSend*	nextPtr_;
+};
+
+//  PURPOSE:  To hold the state of one client connection.  The epoll thread
+//reads its commands and queues them as requests; workers run them and add
+//the replies to 'outPtr_'.  The text of a framed write goes from the
+//socket into 'pipeFds_' on the epoll thread, and from there into its file
+//on a worker.  'lock_' guards everything but 'fd_' and 'connNum_'.  Only
+//the epoll thread frees a connection, and only once no request of it is
+//queued or running.
+struct		Connection
+{
+  int			fd_;
+  int			connNum_;	// For log messages
+  pthread_mutex_t	lock_;
+  int			mode_;		// MODE_UNKNOWN until the first bytes come
+  char*			inPtr_;		// Bytes read but not yet made requests
+  size_t		inLen_;
+  size_t		inCap_;
+  char*			outPtr_;	// Reply bytes, 'outSent_' of them sent
+  size_t		outLen_;
+  size_t		outSent_;
+  size_t		outCap_;
+  struct FileSend*	fileHeadPtr_;	// Files to send between reply bytes,
+  struct FileSend*	fileTailPtr_;	// in order
+  int			numPending_;	// Requests queued or running
+  int			isWriting_;	// A framed write being streamed in:
+  int			writeFd_;	//  its file (-1 until a worker opens it),
+  int			writeFileNum_;
+  char			writeCommand_;
+  uint32_t		writeId_;	//  request id,
+  size_t		writeLeft_;	//  text bytes still to read,
+  size_t		writeInPipe_;	//  and to move from the pipe to the file,
+  int			writeFailed_;	//  whether it went wrong,
+  int			isWriteQueued_;	//  and whether a worker has it
+  int			pipeFds_[2];	// For 'splice()'; -1 until needed
+  size_t		pipeSize_;
+  int			shouldClose_;	// Close once the replies are out
+  int			isBroken_;	// Close without sending more
+};
+
+//  PURPOSE:  To hold one command of a connection, from when it is read until
+//its reply is added to the connection's output.
+struct		Request
+{
+  struct Connection*	connPtr_;
+  int			isFramed_;
+  uint32_t		id_;		// Framed requests only
+  char			command_;
+  int			fileNum_;
+  char*			textPtr_;	// For writes; nul-terminated
+  size_t		textLen_;
+  int			isStream_;	// Moves on its connection's framed write
+  char*			outPtr_;	// The reply
+  size_t		outLen_;
+  size_t		outCap_;
+  int			fileFd_;	// A file to send after 'outPtr_', or -1
+  size_t		fileLen_;
+  int			isError_;
+  struct Request*	nextPtr_;	// In the work queue
+};
+
+//  PURPOSE:  To hold one long-lived bc coprocess, which reads calculations
+//from 'toFd_' and writes their output and errors to 'fromFd_'.
+struct		Calculator
+{
+  pid_t			pid_;		// -1 when there is no bc running
+  int			toFd_;
+  int			fromFd_;
+  int			isBusy_;	// Running a calculation or being started
+};
+
+//  PURPOSE:  To follow the strings, comments and brackets of bc input as
+//it is read, so that a program left open at its end, which would swallow
+//CALC_TAIL, can be told apart.
+struct		CalcBalance
+{
+  char			inString_;
+  char			inComment_;	// '/' for /* */, '#' to end of line
+  char			prevChar_;
+  int			numOpen_[3];	// () [] {}
+  int			isBroken_;	// Closed more than was opened
+};
+
+//  PURPOSE:  To hold what N.bc calculated to, for as long as its text and
+//modification time stay the same.  Results are chained from a bucket of
+//'cacheBuckets' by file number, and listed most recently used first.
+struct		CalcResult
+{
+  int			fileNum_;
+  uint64_t		hash_;		// Of the text
+  struct stat		stat_;		// Of the file:  its size and mtime
+  char			out_[BUFFER_LEN];// The reply, nul padded
+  struct CalcResult*	nextPtr_;	// In its bucket
+  struct CalcResult*	newerPtr_;	// In the LRU list
+  struct CalcResult*	olderPtr_;
+};
+
+extern void*	handleRequest(struct Request* reqPtr);
+extern void*	 dirCommand(struct Request* reqPtr);
+extern void*	 readCommand(struct Request* reqPtr, int fileNum);
+extern void*	writeCommand(struct Request* reqPtr, int fileNum, void* text);
+extern void*   deleteCommand(struct Request* reqPtr, int fileNum);
+extern void* 	 calcCommand(struct Request* reqPtr, int fileNum);
+extern void*	statsCommand(struct Request* reqPtr);
+extern void	forgetCalcResult(int fileNum);
+extern void	startCalculators();
+extern void	refillCalculators();
+extern void	putCalculator(struct Calculator* calcPtr);
 
 const int	ERROR_FD= -1;
 
 
+//---Definition of global vars:---//
+
+int			epollFd;
+
+int			numWorkers	= DEFAULT_NUM_WORKERS;
+
+//  Requests waiting for a worker, oldest first:
+pthread_mutex_t		queueLock	= PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t		queueNotEmpty	= PTHREAD_COND_INITIALIZER;
+struct Request*		queueHeadPtr	= NULL;
+struct Request*		queueTailPtr	= NULL;
+
+//  One bc per worker, so a calculation never waits for a bc:
+struct Calculator*	calcPool;
+pthread_mutex_t		calcLock	= PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t		calcIdle	= PTHREAD_COND_INITIALIZER;
+
+//  Calculation results, and how calculations have gone, under 'cacheLock':
+pthread_mutex_t		cacheLock	= PTHREAD_MUTEX_INITIALIZER;
+struct CalcResult*	cacheBuckets[CALC_CACHE_BUCKETS];
+struct CalcResult*	cacheNewestPtr	= NULL;
+struct CalcResult*	cacheOldestPtr	= NULL;
+int			cacheSize	= 0;
+unsigned long		numCacheHits	= 0;
+unsigned long		numCacheMisses	= 0;
+unsigned long		numCacheEvictions = 0;
+double			hitMicrosecs	= 0;	// In all
+double			missMicrosecs	= 0;
+double			maxHitMicrosecs	= 0;
+double			maxMissMicrosecs= 0;
+
+
 //---Definition of functions:---//
 
+//  PURPOSE:  To make the buffer '*ptrPtr', which has room for '*capPtr'
+//bytes, hold at least 'needed' bytes.
+void		growBuffer	(char**		ptrPtr,
+				 size_t*	capPtr,
+				 size_t		needed
+				)
+{
+  if  (needed <= *capPtr)
+    return;
+
+  size_t	newCap	= (*capPtr == 0) ? BUFFER_LEN : 2 * *capPtr;
+
+  while  (newCap < needed)
+    newCap *= 2;
+
+  char*		newPtr	= (char*)realloc(*ptrPtr,newCap);
+
+  if  (newPtr == NULL)
+  {
+    fprintf(stderr,"Could not grow buffer\n");
+    exit(EXIT_FAILURE);
+  }
+
+  *ptrPtr	= newPtr;
+  *capPtr	= newCap;
+}
+
+
+//  PURPOSE:  To append 'len' bytes at 'bufPtr' to the buffer '*ptrPtr',
+//which holds '*lenPtr' bytes and has room for '*capPtr', growing it as
+//needed.
+void		appendBytes	(char**		ptrPtr,
+				 size_t*	lenPtr,
+				 size_t*	capPtr,
+				 const void*	bufPtr,
+				 size_t		len
+				)
+{
+  growBuffer(ptrPtr,capPtr,*lenPtr + len);
+  memcpy(*ptrPtr + *lenPtr,bufPtr,len);
+  *lenPtr += len;
+}
+
+
+//  PURPOSE:  To append 'len' bytes at 'bufPtr' to the reply of 'reqPtr'.
+//The reply is sent once the command is done.
+void		reply		(struct Request*	reqPtr,
+				 const void*		bufPtr,
+				 size_t			len
+				)
+{
+  appendBytes(&reqPtr->outPtr_,&reqPtr->outLen_,&reqPtr->outCap_,bufPtr,len);
+}
+
+
+//  PURPOSE:  To reply to 'reqPtr' that its command failed.
+void		replyError	(struct Request*	reqPtr
+				)
+{
+  reqPtr->isError_	= 1;
+  reply(reqPtr,STD_ERROR_MSG,strlen(STD_ERROR_MSG));
+}
+
+
+//  PURPOSE:  To make 'fd' non-blocking.
+void		setNonBlocking	(int	fd
+				)
+{
+  fcntl(fd,F_SETFL,fcntl(fd,F_GETFL,0) | O_NONBLOCK);
+}
+
+
+//  PURPOSE:  To return 1 if 'connPtr' has reply bytes or files not yet sent,
+//or 0 otherwise.  'lock_' must be held.
+int		hasOutput	(const struct Connection*	connPtr
+				)
+{
+  return( (connPtr->outSent_ < connPtr->outLen_)  ||  (connPtr->fileHeadPtr_ != NULL) );
+}
+
+
+//  PURPOSE:  To return 1 if more commands should be read from 'connPtr' now,
+//or 0 otherwise.  A text client waits for each reply before it sends its
+//next command.  A framed one may have up to MAX_IN_FLIGHT requests out,
+//as long as it keeps reading its replies.  'lock_' must be held.
+int		wantsInput	(const struct Connection*	connPtr
+				)
+{
+  if  (connPtr->shouldClose_  ||  connPtr->isBroken_)
+    return(0);
+
+  if  (connPtr->mode_ != MODE_FRAMED)
+    return( (connPtr->numPending_ == 0)  &&  !hasOutput(connPtr) );
+
+  //  The text of a framed write waits for room in the pipe, or, with no
+  //pipe, for a worker to take the last of it.  The frames after it wait
+  //until its file is done.
+  if  ( connPtr->isWriting_  &&
+        ( (connPtr->writeLeft_ == 0)  ||
+          ( (connPtr->pipeFds_[0] < 0)
+            ? connPtr->isWriteQueued_
+            : (connPtr->writeInPipe_ >= connPtr->pipeSize_) ) ) )
+    return(0);
+
+  return( (connPtr->numPending_ < MAX_IN_FLIGHT)  &&
+          (connPtr->outLen_ - connPtr->outSent_ < MAX_OUT_BACKLOG) );
+}
+
+
+//  PURPOSE:  To return 1 if 'connPtr' should be closed once no request of
+//it is queued or running, or 0 otherwise.  'lock_' must be held.
+int		isFinished	(const struct Connection*	connPtr
+				)
+{
+  return( connPtr->isBroken_  ||
+          (connPtr->shouldClose_  &&  !hasOutput(connPtr)) );
+}
+
+
+//  PURPOSE:  To hand 'connPtr' back to epoll, waiting once for what it
+//needs next.  A finished connection is made readable by shutting down its
+//input, so the epoll thread wakes up to close it.  'lock_' must be held.
+void		rearm		(struct Connection*	connPtr
+				)
+{
+  struct epoll_event	event;
+
+  event.events	= EPOLLONESHOT;
+  event.data.ptr= connPtr;
+
+  if  (isFinished(connPtr))
+  {
+    //  The last worker to finish with it comes back here.
+    if  (connPtr->numPending_ > 0)
+      return;
+
+    shutdown(connPtr->fd_,SHUT_RD);
+    event.events |= EPOLLIN;
+  }
+  else
+  {
+    if  (wantsInput(connPtr))
+      event.events |= EPOLLIN | EPOLLRDHUP;
+
+    if  (hasOutput(connPtr))
+      event.events |= EPOLLOUT;
+  }
+
+  if  (epoll_ctl(epollFd,EPOLL_CTL_MOD,connPtr->fd_,&event) < 0)
+  {
+    perror(THIS_PROGRAM_NAME);
+    exit(EXIT_FAILURE);
+  }
+}
+
+
+//  PURPOSE:  To close and free 'connPtr'.
+void		closeConnection	(struct Connection*	connPtr
+				)
+{
+  printf("Connection %d quitting. \n",connPtr->connNum_);
+  epoll_ctl(epollFd,EPOLL_CTL_DEL,connPtr->fd_,NULL);
+  close(connPtr->fd_);
+
+  if  (connPtr->writeFd_ >= 0)
+    close(connPtr->writeFd_);
+
+  //  A write cut off partway has still changed its file:
+  if  (connPtr->isWriting_)
+    forgetCalcResult(connPtr->writeFileNum_);
+
+  if  (connPtr->pipeFds_[0] >= 0)
+  {
+    close(connPtr->pipeFds_[0]);
+    close(connPtr->pipeFds_[1]);
+  }
+
+  while  (connPtr->fileHeadPtr_ != NULL)
+  {
+    struct FileSend*	filePtr	= connPtr->fileHeadPtr_;
+
+    connPtr->fileHeadPtr_	= filePtr->nextPtr_;
+    close(filePtr->fd_);
+    free(filePtr);
+  }
+
+  pthread_mutex_destroy(&connPtr->lock_);
+  free(connPtr->inPtr_);
+  free(connPtr->outPtr_);
+  free(connPtr);
+}
+
+
+//  PURPOSE:  To send as much of the output of 'connPtr' as the socket takes
+//without blocking:  reply bytes, and the files queued between them, which
+//go from the page cache to the socket with 'sendfile()'.  'lock_' must be
+//held.
+void		sendReplies	(struct Connection*	connPtr
+				)
+{
+  while  (!connPtr->isBroken_)
+  {
+    struct FileSend*	filePtr	= connPtr->fileHeadPtr_;
+    size_t		bytesEnd= (filePtr == NULL) ? connPtr->outLen_ : filePtr->at_;
+    ssize_t		numSent;
+
+    if  (connPtr->outSent_ < bytesEnd)
+      numSent	= send(connPtr->fd_,
+		       connPtr->outPtr_ + connPtr->outSent_,
+		       bytesEnd - connPtr->outSent_,
+		       MSG_NOSIGNAL
+		      );
+    else if  (filePtr != NULL)
+      numSent	= sendfile(connPtr->fd_,filePtr->fd_,&filePtr->offset_,filePtr->left_);
+    else
+      break;
+
+    if  (numSent > 0)
+    {
+      if  (connPtr->outSent_ < bytesEnd)
+        connPtr->outSent_ += numSent;
+      else if  ( (filePtr->left_ -= numSent) == 0 )
+      {
+        connPtr->fileHeadPtr_	= filePtr->nextPtr_;
+
+        if  (connPtr->fileHeadPtr_ == NULL)
+          connPtr->fileTailPtr_	= NULL;
+
+        close(filePtr->fd_);
+        free(filePtr);
+      }
+    }
+    else if  ( (numSent < 0)  &&  (errno == EINTR) )
+      continue;
+    else if  ( (numSent < 0)  &&  ( (errno == EAGAIN) || (errno == EWOULDBLOCK) ) )
+      break;
+    else
+    {
+      //  Includes a file that shrank after its length was sent:  the
+      //client cannot find the next reply, so it gets none.
+      connPtr->isBroken_	= 1;
+      break;
+    }
+  }
+
+  //  Keep the unsent bytes at the front, so the buffer does not creep:
+  size_t	shift	= 0;
+
+  if  ( (connPtr->outSent_ == connPtr->outLen_)  ||
+        (connPtr->outSent_ >= connPtr->outLen_ / 2) )
+    shift	= connPtr->outSent_;
+
+  if  (shift > 0)
+  {
+    struct FileSend*	filePtr;
+
+    memmove(connPtr->outPtr_,connPtr->outPtr_ + shift,connPtr->outLen_ - shift);
+    connPtr->outLen_	-= shift;
+    connPtr->outSent_	= 0;
+
+    for  (filePtr = connPtr->fileHeadPtr_;  filePtr != NULL;  filePtr = filePtr->nextPtr_)
+      filePtr->at_	-= shift;
+  }
+}
+
+
+//  PURPOSE:  To queue 'len' bytes of the open file 'fd' to be sent after
+//the reply bytes 'connPtr' has now.  'fd' is closed once sent.  'lock_'
+//must be held.
+void		queueFile	(struct Connection*	connPtr,
+				 int			fd,
+				 size_t			len
+				)
+{
+  struct FileSend*	filePtr	= (struct FileSend*)calloc(1,sizeof(struct FileSend));
+
+  if  (filePtr == NULL)
+  {
+    close(fd);
+    connPtr->isBroken_	= 1;
+    return;
+  }
+
+  filePtr->fd_		= fd;
+  filePtr->left_	= len;
+  filePtr->at_		= connPtr->outLen_;
+
+  if  (connPtr->fileTailPtr_ == NULL)
+    connPtr->fileHeadPtr_	= filePtr;
+  else
+    connPtr->fileTailPtr_->nextPtr_	= filePtr;
+
+  connPtr->fileTailPtr_	= filePtr;
+}
+
+
+//  PURPOSE:  To add the reply of 'len' bytes at 'bufPtr' to the output of
+//'connPtr', followed by 'fileLen' bytes of a file queued after it.  A
+//framed reply gets a header with request id 'id' and the status of
+//'isError', and loses the nul padding text clients expect.  'lock_' must
+//be held.
+void		addReply	(struct Connection*	connPtr,
+				 int			isFramed,
+				 uint32_t		id,
+				 int			isError,
+				 const char*		bufPtr,
+				 size_t			len,
+				 size_t			fileLen
+				)
+{
+  if  (isFramed)
+  {
+    unsigned char	header[FRAME_LEN_SIZE + FRAME_REPLY_LEN];
+    uint32_t		field;
+
+    while  ( (len > 0)  &&  (bufPtr[len-1] == '\0') )
+      len--;
+
+    field	= htonl(FRAME_REPLY_LEN + len + fileLen);
+    memcpy(header,&field,sizeof(field));
+    field	= htonl(id);
+    memcpy(header + FRAME_LEN_SIZE,&field,sizeof(field));
+    header[FRAME_LEN_SIZE + 4]	= isError ? FRAME_ERROR : FRAME_OKAY;
+    appendBytes(&connPtr->outPtr_,&connPtr->outLen_,&connPtr->outCap_,header,sizeof(header));
+  }
+
+  appendBytes(&connPtr->outPtr_,&connPtr->outLen_,&connPtr->outCap_,bufPtr,len);
+}
+
+
+//  PURPOSE:  To queue 'reqPtr' for the next free worker.
+void		enqueue		(struct Request*	reqPtr
+				)
+{
+  reqPtr->nextPtr_	= NULL;
+  pthread_mutex_lock(&queueLock);
+
+  if  (queueTailPtr == NULL)
+    queueHeadPtr	= reqPtr;
+  else
+    queueTailPtr->nextPtr_	= reqPtr;
+
+  queueTailPtr	= reqPtr;
+  pthread_cond_signal(&queueNotEmpty);
+  pthread_mutex_unlock(&queueLock);
+}
+
+
+//  PURPOSE:  To run queued requests, forever.  'vPtr' is ignored.
+void*		doWorker	(void*	vPtr
+				)
+{
+  struct Request*	reqPtr;
+
+  while  (1)
+  {
+    pthread_mutex_lock(&queueLock);
+
+    while  (queueHeadPtr == NULL)
+      pthread_cond_wait(&queueNotEmpty,&queueLock);
+
+    reqPtr	= queueHeadPtr;
+    queueHeadPtr= reqPtr->nextPtr_;
+
+    if  (queueHeadPtr == NULL)
+      queueTailPtr	= NULL;
+
+    pthread_mutex_unlock(&queueLock);
+    handleRequest(reqPtr);
+  }
+
+  return(NULL);
+}
+
+
+//  PURPOSE:  To make a request of 'command' on 'fileNum' for 'connPtr', with
+//the 'textLen' bytes at 'textPtr' as its text, and queue it.  'lock_' must
+//be held.
+void		addRequest	(struct Connection*	connPtr,
+				 uint32_t		id,
+				 char			command,
+				 int			fileNum,
+				 const char*		textPtr,
+				 size_t			textLen
+				)
+{
+  struct Request*	reqPtr	= (struct Request*)calloc(1,sizeof(struct Request));
+
+  if  (reqPtr == NULL)
+  {
+    connPtr->isBroken_	= 1;
+    return;
+  }
+
+  reqPtr->connPtr_	= connPtr;
+  reqPtr->isFramed_	= (connPtr->mode_ == MODE_FRAMED);
+  reqPtr->id_		= id;
+  reqPtr->command_	= command;
+  reqPtr->fileNum_	= fileNum;
+  reqPtr->fileFd_	= -1;
+
+  if  ( (command == WRITE_CMD_CHAR)  ||  (command == APPEND_CMD_CHAR) )
+  {
+    reqPtr->textPtr_	= (char*)malloc(textLen + 1);
+
+    if  (reqPtr->textPtr_ == NULL)
+    {
+      free(reqPtr);
+      connPtr->isBroken_	= 1;
+      return;
+    }
+
+    memcpy(reqPtr->textPtr_,textPtr,textLen);
+    reqPtr->textPtr_[textLen]	= '\0';
+    reqPtr->textLen_	= textLen;
+  }
+
+  //  Nothing is read after a quit; the connection closes once the replies
+  //to everything before it are out.
+  if  (command == QUIT_CMD_CHAR)
+    connPtr->shouldClose_	= 1;
+
+  connPtr->numPending_++;
+  enqueue(reqPtr);
+}
+
+
+//  PURPOSE:  To finish the framed write being streamed into 'connPtr':
+//close its file and reply.  'lock_' must be held.
+void		finishWrite	(struct Connection*	connPtr
+				)
+{
+  if  ( (connPtr->writeFd_ >= 0)  &&  (close(connPtr->writeFd_) < 0) )
+    connPtr->writeFailed_	= 1;
+
+  connPtr->writeFd_	= -1;
+  connPtr->isWriting_	= 0;
+  forgetCalcResult(connPtr->writeFileNum_);
+  printf("Connection %d wrote %d%s: %s\n",
+	 connPtr->connNum_,connPtr->writeFileNum_,FILENAME_EXTENSION,
+	 connPtr->writeFailed_ ? "error" : "okay"
+	);
+
+  if  (connPtr->writeFailed_)
+    addReply(connPtr,1,connPtr->writeId_,1,STD_ERROR_MSG,strlen(STD_ERROR_MSG),0);
+  else
+    addReply(connPtr,1,connPtr->writeId_,0,STD_OKAY_MSG,strlen(STD_OKAY_MSG),0);
+}
+
+
+//  PURPOSE:  To queue a request for a worker to carry on with the framed
+//write of 'connPtr':  to write the 'len' bytes at 'textPtr' to its file,
+//then whatever is in the connection's pipe.  'lock_' must be held.
+void		queueWriteText	(struct Connection*	connPtr,
+				 const char*		textPtr,
+				 size_t			len
+				)
+{
+  struct Request*	reqPtr	= (struct Request*)calloc(1,sizeof(struct Request));
+
+  if  ( (reqPtr == NULL)  ||  ( (reqPtr->textPtr_ = (char*)malloc(len + 1)) == NULL ) )
+  {
+    free(reqPtr);
+    connPtr->isBroken_	= 1;
+    return;
+  }
+
+  memcpy(reqPtr->textPtr_,textPtr,len);
+  reqPtr->textPtr_[len]	= '\0';
+  reqPtr->textLen_	= len;
+  reqPtr->connPtr_	= connPtr;
+  reqPtr->isFramed_	= 1;
+  reqPtr->isStream_	= 1;
+  reqPtr->id_		= connPtr->writeId_;
+  reqPtr->command_	= connPtr->writeCommand_;
+  reqPtr->fileNum_	= connPtr->writeFileNum_;
+  reqPtr->fileFd_	= -1;
+  connPtr->isWriteQueued_	= 1;
+  connPtr->numPending_++;
+  enqueue(reqPtr);
+}
+
+
+//  PURPOSE:  To start streaming the 'len' bytes of text of framed request
+//'id', a 'command' of WRITE_CMD_CHAR or APPEND_CMD_CHAR, into N.bc for
+//'fileNum':  in place of what it held, or added to its end.  Only the
+//state is set up here; a worker opens the file in streamWrite().  The
+//caller hands the text already read to 'queueWriteText()', even if there
+//is none.  'lock_' must be held.
+void		startWrite	(struct Connection*	connPtr,
+				 uint32_t		id,
+				 char			command,
+				 int			fileNum,
+				 size_t			len
+				)
+{
+  connPtr->isWriting_	= 1;
+  connPtr->writeFd_	= -1;
+  connPtr->writeFileNum_= fileNum;
+  connPtr->writeCommand_= command;
+  connPtr->writeId_	= id;
+  connPtr->writeLeft_	= len;
+  connPtr->writeInPipe_	= 0;
+  connPtr->writeFailed_	= 0;
+
+  if  (connPtr->pipeFds_[0] >= 0)
+    return;
+
+  if  (pipe2(connPtr->pipeFds_,O_CLOEXEC|O_NONBLOCK) < 0)
+  {
+    connPtr->pipeFds_[0]	= connPtr->pipeFds_[1]	= -1;
+    return;
+  }
+
+  int	size;
+
+  fcntl(connPtr->pipeFds_[1],F_SETPIPE_SZ,PIPE_SIZE);
+  size	= fcntl(connPtr->pipeFds_[1],F_GETPIPE_SZ);
+  connPtr->pipeSize_	= (size > 0) ? size : SPLICE_CHUNK;
+}
+
+
+//  PURPOSE:  To move up to SPLICES_PER_WAKEUP chunks of the current write's
+//text from the socket of 'connPtr' into its pipe with 'splice()', so it
+//never passes through this process, and have a worker move it on to the
+//file.  With no pipe to be had, a chunk is read and handed over instead.
+//'lock_' must be held.
+void		spliceWrite	(struct Connection*	connPtr
+				)
+{
+  int	numSplices;
+
+  for  (numSplices = 0;  (numSplices < SPLICES_PER_WAKEUP) && wantsInput(connPtr);  numSplices++)
+  {
+    size_t	maxMove	= (connPtr->writeLeft_ < SPLICE_CHUNK) ? connPtr->writeLeft_ : SPLICE_CHUNK;
+    ssize_t	numMoved;
+
+    if  (connPtr->pipeFds_[0] < 0)
+    {
+      growBuffer(&connPtr->inPtr_,&connPtr->inCap_,maxMove);
+      numMoved	= read(connPtr->fd_,connPtr->inPtr_,maxMove);
+
+      if  (numMoved > 0)
+      {
+        connPtr->writeLeft_ -= numMoved;
+        queueWriteText(connPtr,connPtr->inPtr_,numMoved);
+        continue;
+      }
+    }
+    else
+    {
+      if  (maxMove > connPtr->pipeSize_ - connPtr->writeInPipe_)
+        maxMove	= connPtr->pipeSize_ - connPtr->writeInPipe_;
+
+      numMoved	= splice(connPtr->fd_,NULL,connPtr->pipeFds_[1],NULL,maxMove,
+			 SPLICE_F_MOVE | SPLICE_F_NONBLOCK
+			);
+
+      if  (numMoved > 0)
+      {
+        connPtr->writeLeft_ -= numMoved;
+        connPtr->writeInPipe_ += numMoved;
+        continue;
+      }
+    }
+
+    if  (numMoved == 0)
+    {
+      //  The client hung up partway through the text.
+      connPtr->writeFailed_	= 1;
+      connPtr->writeLeft_	= 0;
+      connPtr->shouldClose_	= 1;
+      break;
+    }
+
+    if  (errno == EINTR)
+      continue;
+
+    if  ( (errno != EAGAIN)  &&  (errno != EWOULDBLOCK) )
+      connPtr->isBroken_	= 1;
+
+    break;
+  }
+
+  //  A worker takes what came, or replies once the text is all in:
+  if  ( !connPtr->isWriteQueued_  &&
+        ( (connPtr->writeInPipe_ > 0)  ||  (connPtr->writeLeft_ == 0) ) )
+    queueWriteText(connPtr,"",0);
+}
+
+
+//  PURPOSE:  To make requests of the complete frames read from 'connPtr',
+//and start streaming in a write or append as soon as its header is here.
+//A frame that cannot be right breaks the connection.  'lock_' must be
+//held.
+void		parseFrames	(struct Connection*	connPtr
+				)
+{
+  size_t	pos	= 0;
+
+  while  ( !connPtr->shouldClose_  &&  !connPtr->isBroken_  &&
+           !connPtr->isWriting_  &&
+           (connPtr->inLen_ - pos >= FRAME_LEN_SIZE + FRAME_REQUEST_LEN) )
+  {
+    const unsigned char*	framePtr	= (const unsigned char*)connPtr->inPtr_ + pos;
+    uint32_t			frameLen;
+    uint32_t			id;
+    char			command		= framePtr[FRAME_LEN_SIZE + 4];
+    uint32_t			fileNum;
+
+    memcpy(&frameLen,framePtr,sizeof(frameLen));
+    memcpy(&id,framePtr + FRAME_LEN_SIZE,sizeof(id));
+    memcpy(&fileNum,framePtr + FRAME_LEN_SIZE + 5,sizeof(fileNum));
+    frameLen	= ntohl(frameLen);
+    id		= ntohl(id);
+    fileNum	= ntohl(fileNum);
+
+    int	isWrite	= (command == WRITE_CMD_CHAR)  ||  (command == APPEND_CMD_CHAR);
+
+    if  ( (frameLen < FRAME_REQUEST_LEN)  ||  ( !isWrite  &&  (frameLen > MAX_FRAME_LEN) ) )
+    {
+      fprintf(stderr,"Connection %d sent a bad frame\n",connPtr->connNum_);
+      connPtr->isBroken_	= 1;
+      break;
+    }
+
+    if  ( !isWrite  &&  (connPtr->inLen_ - pos < FRAME_LEN_SIZE + frameLen) )
+      break;
+
+    printf("Connection %d request %u: %c %d\n",connPtr->connNum_,id,command,(int)fileNum);
+    pos	+= FRAME_LEN_SIZE + FRAME_REQUEST_LEN;
+
+    if  (isWrite)
+    {
+      //  The text read so far; readInput() splices in the rest.  The
+      //frames after it are parsed once its file is done.
+      size_t	len	= connPtr->inLen_ - pos;
+
+      startWrite(connPtr,id,command,(int)fileNum,frameLen - FRAME_REQUEST_LEN);
+
+      if  (len > connPtr->writeLeft_)
+        len	= connPtr->writeLeft_;
+
+      connPtr->writeLeft_ -= len;
+      queueWriteText(connPtr,connPtr->inPtr_ + pos,len);
+      pos	+= len;
+      continue;
+    }
+
+    addRequest(connPtr,
+	       id,
+	       command,
+	       (int)fileNum,
+	       (const char*)framePtr + FRAME_LEN_SIZE + FRAME_REQUEST_LEN,
+	       frameLen - FRAME_REQUEST_LEN
+	      );
+    pos	+= frameLen - FRAME_REQUEST_LEN;
+  }
+
+  memmove(connPtr->inPtr_,connPtr->inPtr_ + pos,connPtr->inLen_ - pos);
+  connPtr->inLen_ -= pos;
+}
+
+
+//  PURPOSE:  To make a request of the one text command read from 'connPtr',
+//as clients send them:  one 'write()' each.  'lock_' must be held.
+void		parseCommand	(struct Connection*	connPtr
+				)
+{
+  char  	command = '\0';
+  int  		fileNum = 0;
+  char		text[BUFFER_LEN];
+
+  memset(text,'\0',BUFFER_LEN);
+  connPtr->inPtr_[connPtr->inLen_]	= '\0';
+  printf("Connection %d received: %s\n",connPtr->connNum_,connPtr->inPtr_);
+  sscanf(connPtr->inPtr_,"%c %d \"%[^\"]\"",&command,&fileNum,text);
+  connPtr->inLen_	= 0;
+  addRequest(connPtr,0,command,fileNum,text,strlen(text));
+}
+
+
+//  PURPOSE:  To read what 'connPtr' has sent and queue the requests in it.
+//The first bytes decide the protocol:  FRAMED_HELLO, or a text command.
+//'lock_' must be held.
+void		readInput	(struct Connection*	connPtr
+				)
+{
+  while  (wantsInput(connPtr))
+  {
+    //  Only so much of a write per wakeup, so that other connections
+    //get their turn:
+    if  (connPtr->isWriting_)
+    {
+      spliceWrite(connPtr);
+      return;
+    }
+
+    //  Text commands are one 'read()' each, as before.
+    size_t	maxRead	= (connPtr->mode_ == MODE_FRAMED) ? READ_CHUNK : BUFFER_LEN-1;
+
+    growBuffer(&connPtr->inPtr_,&connPtr->inCap_,connPtr->inLen_ + maxRead + 1);
+
+    ssize_t	numRead	= read(connPtr->fd_,connPtr->inPtr_ + connPtr->inLen_,maxRead);
+
+    if  ( (numRead < 0)  &&  (errno == EINTR) )
+      continue;
+
+    if  ( (numRead < 0)  &&  ( (errno == EAGAIN) || (errno == EWOULDBLOCK) ) )
+      return;
+
+    if  (numRead <= 0)
+    {
+      //  The client hung up without quitting:  finish what it asked for.
+      connPtr->shouldClose_	= 1;
+      return;
+    }
+
+    connPtr->inLen_ += numRead;
+
+    if  (connPtr->mode_ == MODE_UNKNOWN)
+    {
+      if  (connPtr->inPtr_[0] != FRAMED_HELLO[0])
+        connPtr->mode_	= MODE_TEXT;
+      else if  (connPtr->inLen_ < FRAMED_HELLO_LEN)
+        continue;
+      else if  (memcmp(connPtr->inPtr_,FRAMED_HELLO,FRAMED_HELLO_LEN) == 0)
+      {
+        connPtr->mode_	= MODE_FRAMED;
+        connPtr->inLen_ -= FRAMED_HELLO_LEN;
+        memmove(connPtr->inPtr_,connPtr->inPtr_ + FRAMED_HELLO_LEN,connPtr->inLen_);
+        appendBytes(&connPtr->outPtr_,&connPtr->outLen_,&connPtr->outCap_,
+		    FRAMED_HELLO,FRAMED_HELLO_LEN
+		   );
+      }
+      else
+      {
+        connPtr->isBroken_	= 1;
+        return;
+      }
+    }
+
+    if  (connPtr->mode_ == MODE_FRAMED)
+      parseFrames(connPtr);
+    else
+      parseCommand(connPtr);
+  }
+}
+
+
+//  PURPOSE:  To 'accept()' every client waiting on 'listenFd' and add it to
+//the epoll set.
+void		acceptClients	(int	listenFd
+				)
+{
+  static int		connCount	= 0;
+  struct epoll_event	event;
+
+  while  (1)
+  {
+    int  fd = accept4(listenFd,NULL,NULL,SOCK_CLOEXEC);
+
+    if  (fd < 0)
+    {
+      if  ( (errno == EAGAIN) || (errno == EWOULDBLOCK) )
+        return;
+
+      if  ( (errno == EINTR) || (errno == ECONNABORTED) )
+        continue;
+
+      //  Out of descriptors and the like: let the clients already here
+      //finish rather than giving up on them.
+      perror("Error on accept attempt");
+      return;
+    }
+
+    struct Connection*	connPtr	= (struct Connection*)calloc(1,sizeof(struct Connection));
+
+    if  (connPtr == NULL)
+    {
+      close(fd);
+      continue;
+    }
+
+    //  Framed replies go out one by one as workers finish them; Nagle
+    //would hold each back until the one before was acknowledged.
+    int  one = 1;
+
+    setNonBlocking(fd);
+    setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&one,sizeof(one));
+    pthread_mutex_init(&connPtr->lock_,NULL);
+    connPtr->fd_	= fd;
+    connPtr->connNum_	= connCount++;
+    connPtr->mode_	= MODE_UNKNOWN;
+    connPtr->writeFd_	= -1;
+    connPtr->pipeFds_[0]= connPtr->pipeFds_[1] = -1;
+    event.events	= EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    event.data.ptr	= connPtr;
+
+    if  (epoll_ctl(epollFd,EPOLL_CTL_ADD,fd,&event) < 0)
+    {
+      perror(THIS_PROGRAM_NAME);
+      close(fd);
+      pthread_mutex_destroy(&connPtr->lock_);
+      free(connPtr);
+    }
+  }
+}
+
+
+//  PURPOSE:  To do what the epoll 'events' for 'connPtr' call for:  send
+//replies there is now room for, read and queue new commands, and close the
+//connection once it is finished and no worker holds it.
+void		handleConnection(struct Connection*	connPtr,
+				 unsigned int		events
+				)
+{
+  pthread_mutex_lock(&connPtr->lock_);
+
+  if  (events & (EPOLLERR | EPOLLHUP))
+    connPtr->isBroken_	= 1;
+
+  if  ( !connPtr->isBroken_  &&  (events & EPOLLOUT) )
+    sendReplies(connPtr);
+
+  if  (events & (EPOLLIN | EPOLLRDHUP))
+  {
+    readInput(connPtr);
+
+    //  The hello, if that is what came:
+    if  (hasOutput(connPtr))
+      sendReplies(connPtr);
+  }
+
+  if  (isFinished(connPtr)  &&  (connPtr->numPending_ == 0))
+  {
+    pthread_mutex_unlock(&connPtr->lock_);
+    closeConnection(connPtr);
+    return;
+  }
+
+  rearm(connPtr);
+  pthread_mutex_unlock(&connPtr->lock_);
+}
+
+
 //  PURPOSE:  To run the server by 'accept()'-ing client requests from
-//'listenFd' and doing them.
+//'listenFd' and doing them.  One thread waits in epoll_wait() for
+//connections and reads their commands; the commands go to a fixed pool
+//of 'numWorkers' worker threads, since they may block on files and bc.
+//The text of a framed write is spliced into a pipe here, a few chunks at
+//a time, and a worker moves it on to the file.  Replies a worker cannot
+//send at once are finished here when the socket
+//has room.
 void		doServer(int		listenFd) {
     //  I.  Application validiity check:
 
     //  II.  Server clients:
     pthread_t		threadId;
     pthread_attr_t	threadAttr;
-    int			threadCount= 0;
-    int* 			iPtr;
+    int			threadCount;
+    struct epoll_event	event;
+    struct epoll_event	events[MAX_EVENTS];
+
+    listen(listenFd,LISTEN_BACKLOG);
+    setNonBlocking(listenFd);
 
-    // YOUR CODE HERE
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if  (epollFd < 0) {
+        perror(THIS_PROGRAM_NAME);
+        exit(EXIT_FAILURE);
+    }
+
+    //  The listening socket is the one entry with no connection:
+    event.events   = EPOLLIN;
+    event.data.ptr = NULL;
+    epoll_ctl(epollFd,EPOLL_CTL_ADD,listenFd,&event);
 
-    listen(listenFd,5);  
+    startCalculators();
 
     pthread_attr_init(&threadAttr);
+    pthread_attr_setdetachstate(&threadAttr,PTHREAD_CREATE_DETACHED);
+    for  (threadCount = 0;  threadCount < numWorkers;  threadCount++) {
+        if  (pthread_create(&threadId,&threadAttr,doWorker,NULL) != 0) {
+            fprintf(stderr,"Could not start worker threads\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    pthread_attr_destroy(&threadAttr);
+
     while (1)  {
-        printf("pre connectDesc \n");
-        int  fd = accept(listenFd,NULL,NULL);    
-        if (fd < 0) {
-            perror("Error on accept attempt\n");
+        int	numEvents = epoll_wait(epollFd,events,MAX_EVENTS,-1);
+        int	i;
+
+        if  (numEvents < 0) {
+            if  (errno == EINTR)
+                continue;
+            perror(THIS_PROGRAM_NAME);
             exit(EXIT_FAILURE);
-        }      
+        }
 
-        iPtr = (int*)calloc(2,sizeof(int*));
-        iPtr[0] = fd;
-        iPtr[1] = getpid();
-        threadCount++;
+        for  (i = 0;  i < numEvents;  i++) {
+            struct Connection*	connPtr = (struct Connection*)events[i].data.ptr;
 
-        pthread_attr_setdetachstate(&threadAttr,PTHREAD_CREATE_DETACHED);
-        pthread_create(&threadId,&threadAttr,handleClient,(void*)iPtr);
-    
+            if  (connPtr == NULL)
+                acceptClients(listenFd);
+            else
+                handleConnection(connPtr,events[i].events);
+        }
     }
-    pthread_attr_destroy(&threadAttr);    
 }
 
-void* handleClient(void* vPtr) {
-  int* 	iPtr 	 = (int*)vPtr;
-  int 	fd 	 = iPtr[0];
-  int* 	threadId = &iPtr[1];
-  free(vPtr);
+//  PURPOSE:  To write the 'len' bytes at 'bufPtr' to 'fileFd'.  Returns 0
+//on success or -1 on failure.
+int		writeText	(int		fileFd,
+				 const char*	bufPtr,
+				 size_t		len
+				)
+{
+  size_t	done	= 0;
 
-  //  II.B.  Read command:
-  char  	buffer[BUFFER_LEN];
-  char  	command;
-  int  		fileNum;
-  char		text[BUFFER_LEN];
-  int 		shouldContinue= 1;
-  char*		textPtr;
-  
-  while  (shouldContinue)
-  {
-      memset(buffer,'\0',BUFFER_LEN);
-      memset(text  ,'\0',BUFFER_LEN);
-      read(fd,buffer,BUFFER_LEN);
-      printf("Thread %d received: %s\n",*threadId,buffer);
-      sscanf(buffer,"%c %d \"%[^\"]\"",&command,&fileNum,text);
-
-    // YOUR CODE HERE    
-    if (command == DIR_CMD_CHAR) {
-        dirCommand(fd);
+  while  (done < len)
+  {
+    ssize_t	numWritten	= write(fileFd,bufPtr + done,len - done);
+
+    if  (numWritten > 0)
+      done	+= numWritten;
+    else if  ( (numWritten < 0)  &&  (errno == EINTR) )
+      continue;
+    else
+      return(-1);
+  }
+
+  return(0);
+}
+
+
+//  PURPOSE:  To move 'len' bytes from the pipe 'pipeFd' to the file
+//'fileFd' with 'splice()', or to drop them if 'fileFd' is -1.  Once the
+//file takes no more, the rest is dropped too.  Returns 0 if it all went
+//to the file, -1 if it did not, or -2 if the pipe could not be emptied.
+int		spliceText	(int		pipeFd,
+				 int		fileFd,
+				 size_t		len
+				)
+{
+  char		dropBuffer[SPLICE_CHUNK];
+  int		status	= (fileFd < 0) ? -1 : 0;
+
+  while  (len > 0)
+  {
+    ssize_t	numOut;
+
+    if  (status == 0)
+      numOut	= splice(pipeFd,NULL,fileFd,NULL,len,SPLICE_F_MOVE);
+    else
+      numOut	= read(pipeFd,dropBuffer,(len < SPLICE_CHUNK) ? len : SPLICE_CHUNK);
+
+    if  (numOut > 0)
+      len -= numOut;
+    else if  ( (numOut < 0)  &&  (errno == EINTR) )
+      continue;
+    else if  (status == 0)
+      status	= -1;
+    else
+      return(-2);
+  }
+
+  return(status);
+}
+
+
+//  PURPOSE:  To do the file side of the framed write of the connection of
+//'reqPtr', off the epoll thread:  open N.bc the first time, write the text
+//of 'reqPtr', then empty the connection's pipe into the file for as long
+//as the epoll thread keeps filling it.  The last of the text finishes the
+//write and lets the frames after it be parsed.
+void		streamWrite	(struct Request*	reqPtr
+				)
+{
+  struct Connection*	connPtr	= reqPtr->connPtr_;
+  int			fileFd;
+  int			status	= 0;
+
+  pthread_mutex_lock(&connPtr->lock_);
+
+  if  ( (connPtr->writeFd_ < 0)  &&  !connPtr->writeFailed_ )
+  {
+    char	fileName[BUFFER_LEN];
+    int		flags	= (reqPtr->command_ == APPEND_CMD_CHAR) ? 0 : O_TRUNC;
+
+    pthread_mutex_unlock(&connPtr->lock_);
+    snprintf(fileName,BUFFER_LEN,"%d%s",reqPtr->fileNum_,FILENAME_EXTENSION);
+    fileFd	= open(fileName,O_WRONLY|O_CREAT|O_CLOEXEC|flags,0660);
+
+    //  'splice()' will not write to an O_APPEND file, so an append starts
+    //at the end instead:
+    if  ( (fileFd >= 0)  &&  (reqPtr->command_ == APPEND_CMD_CHAR)  &&
+          (lseek(fileFd,0,SEEK_END) < 0) )
+    {
+      close(fileFd);
+      fileFd	= -1;
+    }
+
+    pthread_mutex_lock(&connPtr->lock_);
+    connPtr->writeFd_	= fileFd;
+    connPtr->writeFailed_ |= (fileFd < 0);
+  }
+
+  fileFd	= connPtr->writeFailed_ ? -1 : connPtr->writeFd_;
+  pthread_mutex_unlock(&connPtr->lock_);
+
+  if  ( (fileFd >= 0)  &&  (reqPtr->textLen_ > 0) )
+    status	= writeText(fileFd,reqPtr->textPtr_,reqPtr->textLen_);
+
+  pthread_mutex_lock(&connPtr->lock_);
+  connPtr->writeFailed_ |= (status < 0);
+
+  while  ( (connPtr->writeInPipe_ > 0)  &&  !connPtr->isBroken_ )
+  {
+    size_t	len	= connPtr->writeInPipe_;
+
+    fileFd	= connPtr->writeFailed_ ? -1 : connPtr->writeFd_;
+    pthread_mutex_unlock(&connPtr->lock_);
+    status	= spliceText(connPtr->pipeFds_[0],fileFd,len);
+    pthread_mutex_lock(&connPtr->lock_);
+
+    //  The epoll thread stopped reading when the pipe filled up:
+    int	wasFull	= (connPtr->writeInPipe_ >= connPtr->pipeSize_);
+
+    connPtr->writeInPipe_ -= len;
+
+    if  (status == -2)
+      connPtr->isBroken_	= 1;
+    else if  (status < 0)
+      connPtr->writeFailed_	= 1;
+
+    if  (wasFull)
+      rearm(connPtr);
+  }
+
+  connPtr->isWriteQueued_	= 0;
+
+  if  (connPtr->isBroken_)
+    connPtr->writeFailed_	= 1;
+
+  if  ( connPtr->isBroken_  ||
+        ( (connPtr->writeLeft_ == 0)  &&  (connPtr->writeInPipe_ == 0) ) )
+  {
+    finishWrite(connPtr);
+    parseFrames(connPtr);
+  }
+
+  pthread_mutex_unlock(&connPtr->lock_);
+}
+
+
+//  PURPOSE:  To run the command of 'reqPtr', add its reply to the output of
+//its connection, and start sending it.  A framed reply gets a header, and
+//loses the nul padding text clients expect.
+void* handleRequest(struct Request* reqPtr) {
+  struct Connection*	connPtr	= reqPtr->connPtr_;
+  char			command	= reqPtr->command_;
+  int			fileNum	= reqPtr->fileNum_;
+
+    if (reqPtr->isStream_) {
+        streamWrite(reqPtr);
+    } else if (command == DIR_CMD_CHAR) {
+        dirCommand(reqPtr);
     } else if (command == READ_CMD_CHAR) {
-        readCommand(fd,fileNum);
-    } else if (command == WRITE_CMD_CHAR) {
-        textPtr = (char*)malloc(sizeof(char)*strlen(text));
-        strncpy(textPtr,text,strlen(text));
-        writeCommand(fd,fileNum,(void*)textPtr);
+        readCommand(reqPtr,fileNum);
+    } else if (command == WRITE_CMD_CHAR  ||  command == APPEND_CMD_CHAR) {
+        writeCommand(reqPtr,fileNum,(void*)reqPtr->textPtr_);
+        reqPtr->textPtr_ = NULL;
     } else if (command == DELETE_CMD_CHAR) {
-        deleteCommand(fd,fileNum);
+        deleteCommand(reqPtr,fileNum);
     } else if (command == CALC_CMD_CHAR) {
-        calcCommand(fd,fileNum);
+        calcCommand(reqPtr,fileNum);
+    } else if (command == STATS_CMD_CHAR) {
+        statsCommand(reqPtr);
     } else if (command == QUIT_CMD_CHAR) {
-        write(fd,STD_BYE_MSG,strlen(STD_BYE_MSG));
-        shouldContinue = 0;
-        close(fd);
-        fflush(stdout);
-        return(EXIT_SUCCESS);
+        reply(reqPtr,STD_BYE_MSG,strlen(STD_BYE_MSG));
+    } else if (reqPtr->isFramed_) {
+        replyError(reqPtr);
     }
-  }
-  printf("Thread %d quitting. \n",*threadId);
+
+  pthread_mutex_lock(&connPtr->lock_);
+
+  //  finishWrite() replies to a framed write.
+  if  (!reqPtr->isStream_)
+    addReply(connPtr,
+	     reqPtr->isFramed_,
+	     reqPtr->id_,
+	     reqPtr->isError_,
+	     reqPtr->outPtr_,
+	     reqPtr->outLen_,
+	     reqPtr->fileLen_
+	    );
+
+  if  (reqPtr->fileFd_ >= 0)
+    queueFile(connPtr,reqPtr->fileFd_,reqPtr->fileLen_);
+
+  if  (!connPtr->isBroken_)
+    sendReplies(connPtr);
+
+  connPtr->numPending_--;
+  rearm(connPtr);
+  pthread_mutex_unlock(&connPtr->lock_);
+
+  free(reqPtr->textPtr_);
+  free(reqPtr->outPtr_);
+  free(reqPtr);
+
+  //  Replace any bc the command retired, now that the client has its reply:
+  if  (command == CALC_CMD_CHAR)
+    refillCalculators();
+
   return(NULL); 
 }
 
-void* 		dirCommand(int 	fd) {
+void* 		dirCommand(struct Request*	reqPtr) {
     DIR* dirPtr = opendir(".");
 
     if (dirPtr == NULL) {
-        write(fd,STD_ERROR_MSG,strlen(STD_ERROR_MSG));
+        replyError(reqPtr);
+        return(NULL);
     }
 
     struct    dirent*   entryPtr;
     char 		buffer[BUFFER_LEN];
     char*		filename;
+
+    memset(buffer,'\0',BUFFER_LEN);
     while ( (entryPtr = readdir(dirPtr)) != NULL ) 
     {
         filename = entryPtr->d_name;
-        strncat(buffer,filename,BUFFER_LEN);
-        strncat(buffer,"\n",BUFFER_LEN);  
+        strncat(buffer,filename,BUFFER_LEN-1-strlen(buffer));
+        strncat(buffer,"\n",BUFFER_LEN-1-strlen(buffer));  
     }
     closedir(dirPtr);
-    write(fd,buffer,BUFFER_LEN);
+    reply(reqPtr,buffer,BUFFER_LEN);
+    return(NULL);
 }
 
-void* 		readCommand(int 	clientFd, 
+//  PURPOSE:  To send back N.bc.  Framed clients get all of it, sent from
+//the page cache after the reply header; text clients get what fits in a
+//BUFFER_LEN buffer, as mathClient expects.
+void* 		readCommand(struct Request*	reqPtr, 
                 	    int		fileNum) {
     char 	fileName[BUFFER_LEN];
     snprintf(fileName,BUFFER_LEN,"%d%s",fileNum,FILENAME_EXTENSION);
 
     char 	buffer[BUFFER_LEN];
-    int 	fileFd = open(fileName,O_RDONLY,0440); //
+    int 	fileFd = open(fileName,O_RDONLY|O_CLOEXEC,0440); //
 
     if (fileFd == -1) {
-        write(clientFd,STD_ERROR_MSG,strlen(STD_ERROR_MSG));
+        replyError(reqPtr);
+        return(NULL);
     }
 
-    read(fileFd,buffer,BUFFER_LEN);
-    strcat(buffer,"\0");
-    write(clientFd,buffer,strlen(buffer));
+    if (reqPtr->isFramed_) {
+        struct stat	statBuf;
+
+        if  ( (fstat(fileFd,&statBuf) < 0)  ||  (statBuf.st_size > MAX_FILE_REPLY) ) {
+            close(fileFd);
+            replyError(reqPtr);
+            return(NULL);
+        }
+
+        reqPtr->fileFd_  = fileFd;
+        reqPtr->fileLen_ = statBuf.st_size;
+        return(NULL);
+    }
+
+    memset(buffer,'\0',BUFFER_LEN);
+    read(fileFd,buffer,BUFFER_LEN-1);
+    reply(reqPtr,buffer,strlen(buffer));
     close(fileFd);
+    return(NULL);
 }
 
 
-void* 		writeCommand(int	clientFd,
+//  PURPOSE:  To write the text of a text-mode command to N.bc, in place of
+//what it held, or added to its end for an append.  Framed writes are
+//streamed in by startWrite() and streamWrite() instead.
+void* 		writeCommand(struct Request*	reqPtr,
                              int  	fileNum,
                              void* 	textPtr) {
     char* tPtr = (char*)textPtr;
     char fileName[BUFFER_LEN];
     snprintf(fileName,BUFFER_LEN,"%d%s",fileNum,FILENAME_EXTENSION);
     int textLen = strlen(tPtr);
-    int numWritten;
+    int numWritten = -1;
+    int flags = (reqPtr->command_ == APPEND_CMD_CHAR) ? O_APPEND : O_TRUNC;
 
-    int fileFd = open(fileName,O_WRONLY|O_CREAT, 0660);
-    if (textLen <= BUFFER_LEN) {
-        printf("writeCmd: entered textLen <= buffLen cond, textLen = %d \n", textLen);
+    int fileFd = open(fileName,O_WRONLY|O_CREAT|O_CLOEXEC|flags, 0660);
+    if (fileFd != -1) {
+        printf("writeCmd: textLen = %d \n", textLen);
         numWritten = write(fileFd,tPtr,textLen);
-    } else {
-        printf("writeCmd: entered textLen > buffLen cond, textLen = %d \n", textLen);
-        numWritten = write(fileFd,tPtr,BUFFER_LEN);
+        close(fileFd);
+        forgetCalcResult(fileNum);
     }
-    if (numWritten != -1 && fileFd != -1) {
+    if (numWritten != -1) {
         printf("writeCmd: no errors \n");
-        fprintf(stdout,STD_OKAY_MSG);
-        write(clientFd,STD_OKAY_MSG,strlen(STD_OKAY_MSG));
+        reply(reqPtr,STD_OKAY_MSG,strlen(STD_OKAY_MSG));
     } else {
         printf("writeCmd: there was an error");
         fprintf(stderr,STD_ERROR_MSG);
-        write(clientFd,STD_ERROR_MSG,strlen(STD_ERROR_MSG));
+        replyError(reqPtr);
     }
     free(textPtr);
-    close(fileFd);
+    return(NULL);
 }
 
-void* 		deleteCommand(int 	clientFd,
+void* 		deleteCommand(struct Request*	reqPtr,
 			      int 	fileNum  ) {
     char	fileName[BUFFER_LEN];
     int 	status;
     snprintf(fileName,BUFFER_LEN,"%d%s",fileNum,FILENAME_EXTENSION);
     status = unlink(fileName);
+    forgetCalcResult(fileNum);
     if (status != -1) {
         printf("deleteCmd: unlink executed properly\n");
-        write(clientFd,STD_OKAY_MSG,strlen(STD_OKAY_MSG));
+        reply(reqPtr,STD_OKAY_MSG,strlen(STD_OKAY_MSG));
     } else {
         printf("deleteCmd: unlink ended abnormally \n");
-        write(clientFd,STD_ERROR_MSG,strlen(STD_ERROR_MSG));
+        replyError(reqPtr);
     }
+    return(NULL);
 }
 
 
-void* 		calcCommand(int 	clientFd,
-                            int 	fileNum  ) {
-    pid_t 	childId = fork();
-    int 	status;
-    char 	buffer[BUFFER_LEN];
+//  PURPOSE:  To start a bc for '*calcPtr'.  Returns 0 on success or -1
+//on failure.
+int		startCalculator	(struct Calculator*	calcPtr
+				)
+{
+  int	toPipe[2];
+  int	fromPipe[2];
+
+  //  Close-on-exec, so no bc holds another bc's pipes open:
+  if  (pipe2(toPipe,O_CLOEXEC) < 0)
+    return(-1);
+
+  if  (pipe2(fromPipe,O_CLOEXEC) < 0)
+  {
+    close(toPipe[0]);
+    close(toPipe[1]);
+    return(-1);
+  }
+
+  pid_t	childId	= fork();
+
+  if  (childId == 0)
+  {
+    dup2(toPipe[0],0);
+    dup2(fromPipe[1],1);
+    dup2(fromPipe[1],2);
+    execl(CALC_PROGNAME,CALC_PROGNAME,NULL);
+    fprintf(stderr,"CALC_PROGNAME failed to run \n");
+    _exit(EXIT_FAILURE);
+  }
+
+  close(toPipe[0]);
+  close(fromPipe[1]);
+
+  if  (childId < 0)
+  {
+    close(toPipe[1]);
+    close(fromPipe[0]);
+    return(-1);
+  }
+
+  calcPtr->pid_		= childId;
+  calcPtr->toFd_	= toPipe[1];
+  calcPtr->fromFd_	= fromPipe[0];
+  return(0);
+}
+
+
+//  PURPOSE:  To stop the bc of '*calcPtr', if it has one.
+void		stopCalculator	(struct Calculator*	calcPtr
+				)
+{
+  if  (calcPtr->pid_ < 0)
+    return;
+
+  if  (calcPtr->toFd_ >= 0)
+    close(calcPtr->toFd_);
+  close(calcPtr->fromFd_);
+  kill(calcPtr->pid_,SIGKILL);
+  waitpid(calcPtr->pid_,NULL,0);
+  calcPtr->pid_	= -1;
+}
+
+
+//  PURPOSE:  To start the pool of bc coprocesses, one per worker.
+void		startCalculators()
+{
+  int	i;
+
+  calcPool	= (struct Calculator*)calloc(numWorkers,sizeof(struct Calculator));
+
+  if  (calcPool == NULL)
+  {
+    fprintf(stderr,"Could not allocate calculators\n");
+    exit(EXIT_FAILURE);
+  }
+
+  for  (i = 0;  i < numWorkers;  i++)
+    if  (startCalculator(&calcPool[i]) < 0)
+      calcPool[i].pid_	= -1;
+}
+
+
+//  PURPOSE:  To start a new bc in place of each one that was retired.
+void		refillCalculators()
+{
+  int	i;
+
+  for  (i = 0;  i < numWorkers;  i++)
+  {
+    pthread_mutex_lock(&calcLock);
+
+    if  ( (calcPool[i].pid_ >= 0)  ||  calcPool[i].isBusy_ )
+    {
+      pthread_mutex_unlock(&calcLock);
+      continue;
+    }
+
+    calcPool[i].isBusy_	= 1;
+    pthread_mutex_unlock(&calcLock);
+
+    if  (startCalculator(&calcPool[i]) < 0)
+      calcPool[i].pid_	= -1;
+
+    pthread_mutex_lock(&calcLock);
+    calcPool[i].isBusy_	= 0;
+    pthread_cond_signal(&calcIdle);
+    pthread_mutex_unlock(&calcLock);
+  }
+}
+
+
+//  PURPOSE:  To wait for, claim and return an idle calculator with a bc
+//running, or NULL if none can be started.
+struct Calculator*
+		getCalculator	()
+{
+  struct Calculator*	calcPtr	= NULL;
+  int			i;
+
+  pthread_mutex_lock(&calcLock);
+
+  while  (calcPtr == NULL)
+  {
+    for  (i = 0;  i < numWorkers;  i++)
+      if  (!calcPool[i].isBusy_)
+      {
+        calcPtr	= &calcPool[i];
+
+        if  (calcPtr->pid_ >= 0)
+          break;
+      }
+
+    if  (calcPtr == NULL)
+      pthread_cond_wait(&calcIdle,&calcLock);
+  }
+
+  calcPtr->isBusy_	= 1;
+  pthread_mutex_unlock(&calcLock);
+
+  //  Only a retired one was idle:  start it here rather than wait.
+  if  ( (calcPtr->pid_ < 0)  &&  (startCalculator(calcPtr) < 0) )
+  {
+    calcPtr->pid_	= -1;
+    putCalculator(calcPtr);
+    return(NULL);
+  }
 
-    if (childId < 0) {
-        write(clientFd,STD_ERROR_MSG,strlen(STD_ERROR_MSG));
-    } else if (childId == 0) {
-        char	fileName[BUFFER_LEN];
-        snprintf(fileName,BUFFER_LEN,"%d%s",fileNum,FILENAME_EXTENSION);
+  return(calcPtr);
+}
+
+
+//  PURPOSE:  To give '*calcPtr' back to the pool.
+void		putCalculator	(struct Calculator*	calcPtr
+				)
+{
+  pthread_mutex_lock(&calcLock);
+  calcPtr->isBusy_	= 0;
+  pthread_cond_signal(&calcIdle);
+  pthread_mutex_unlock(&calcLock);
+}
+
+
+//  PURPOSE:  To return 1 if bc input 'textPtr' of 'len' bytes, following
+//the byte 'prevChar', may change what bc does with later input, or 0
+//otherwise.  Assignments (scale, ibase and obase included) need an '=',
+//function definitions a '{', and increments "++" or "--".  Comparisons
+//and plain blocks are caught too, which only costs a new bc.
+int		mayLeaveState	(const char*	textPtr,
+				 size_t		len,
+				 char		prevChar
+				)
+{
+  size_t	i;
+
+  for  (i = 0;  i < len;  i++)
+  {
+    if  ( (textPtr[i] == '=')  ||  (textPtr[i] == '{') )
+      return(1);
+
+    if  ( ( (textPtr[i] == '+') || (textPtr[i] == '-') )  &&  (textPtr[i] == prevChar) )
+      return(1);
+
+    prevChar	= textPtr[i];
+  }
+
+  return(0);
+}
+
+
+//  PURPOSE:  To follow the 'len' bytes of bc input at 'textPtr' in
+//'*balPtr'.
+void		noteBalance	(struct CalcBalance*	balPtr,
+				 const char*		textPtr,
+				 size_t			len
+				)
+{
+  size_t	i;
+
+  for  (i = 0;  i < len;  i++)
+  {
+    char	ch	= textPtr[i];
+    char	prev	= balPtr->prevChar_;
+    const char*	bracketPtr;
+
+    balPtr->prevChar_	= ch;
+
+    if  (balPtr->inString_)
+      balPtr->inString_	= (ch != '"');
+    else if  (balPtr->inComment_ == '#')
+      balPtr->inComment_= (ch == '\n') ? '\0' : '#';
+    else if  (balPtr->inComment_ == '/')
+    {
+      if  ( (prev == '*')  &&  (ch == '/') )
+      {
+        balPtr->inComment_	= '\0';
+        balPtr->prevChar_	= '\0';
+      }
+    }
+    else if  (ch == '"')
+      balPtr->inString_	= 1;
+    else if  (ch == '#')
+      balPtr->inComment_= '#';
+    else if  ( (prev == '/')  &&  (ch == '*') )
+    {
+      //  So that "/*/" does not also end the comment:
+      balPtr->inComment_= '/';
+      balPtr->prevChar_	= '\0';
+    }
+    else if  ( (ch != '\0')  &&  ( (bracketPtr = strchr("([{",ch)) != NULL ) )
+      balPtr->numOpen_[bracketPtr - "([{"]++;
+    else if  ( (ch != '\0')  &&  ( (bracketPtr = strchr(")]}",ch)) != NULL ) )
+    {
+      if  (--balPtr->numOpen_[bracketPtr - ")]}"] < 0)
+        balPtr->isBroken_	= 1;
+    }
+  }
+}
+
+
+//  PURPOSE:  To return 1 if the input followed by '*balPtr' ends with its
+//strings, comments and brackets all closed, and not on a '\' that would
+//join CALC_TAIL to its last line, or 0 otherwise.
+int		isBalanced	(const struct CalcBalance*	balPtr
+				)
+{
+  return( !balPtr->inString_  &&  (balPtr->inComment_ != '/')  &&
+          !balPtr->isBroken_  &&  (balPtr->prevChar_ != '\\')  &&
+          (balPtr->numOpen_[0] == 0)  &&  (balPtr->numOpen_[1] == 0)  &&
+          (balPtr->numOpen_[2] == 0) );
+}
+
+
+//  PURPOSE:  To run the bc program in 'fileFd' on '*calcPtr', putting up to
+//'outLen'-1 bytes of its output, text and errors both, in 'outPtr'
+//(nul-terminated).  Input is written while output is read, so neither
+//pipe can fill up and stall bc.  A program that ends unbalanced gets no
+//CALC_TAIL:  bc's input is closed instead, and its output runs until it
+//exits.  Returns 0 if bc finished the program
+//and is ready for the next, 1 if it finished but must be retired (it
+//quit, or may have kept variables or settings), or -1 on failure.
+int		runCalculator	(struct Calculator*	calcPtr,
+				 int			fileFd,
+				 char*			outPtr,
+				 size_t			outLen
+				)
+{
+  char		inBuffer[CALC_CHUNK];
+  size_t	inLen		= 0;	// Bytes of 'inBuffer' still to write
+  size_t	inSent		= 0;
+  int		inDone		= 0;	// The file has all been read
+  int		tailSent	= 0;	// CALC_TAIL too
+  int		retire		= 0;
+  char		prevChar	= '\0';
+  struct CalcBalance	balance;
+  char		fromBuffer[CALC_CHUNK];
+  char		tail[sizeof(CALC_TAIL_OUT)-1];	// Last output bytes, for
+  size_t	tailLen		= 0;		// the sentinel check
+  size_t	numOut		= 0;		// Output bytes kept
+  size_t	totalOut	= 0;		// and read
+  struct pollfd	fds[2];
+
+  memset(outPtr,'\0',outLen);
+  memset(&balance,'\0',sizeof(balance));
+
+  while  (1)
+  {
+    //  I.  Refill the input:
+    if  ( (inSent == inLen)  &&  !tailSent )
+    {
+      inSent	= 0;
+
+      if  (!inDone)
+      {
+        ssize_t	numRead	= read(fileFd,inBuffer,CALC_CHUNK);
 
-        int	inFd= open(fileName,O_RDONLY,0);
-        int	outFd= open(OUTPUT_FILENAME,O_WRONLY|O_CREAT|O_TRUNC,0660);
-        int	errFd= open(ERROR_FILENAME, O_WRONLY|O_CREAT|O_TRUNC,0660);
+        if  (numRead < 0)
+          return(-1);
 
-        if  ( (inFd < 0) || (outFd < 0) || (errFd < 0) )
+        if  (numRead == 0)
+          inDone	= 1;
+
+        inLen	= numRead;
+
+        if  (inLen > 0)
         {
-            fprintf(stderr,"Could not open one or more files\n");
-            exit(EXIT_FAILURE);
+          retire |= mayLeaveState(inBuffer,inLen,prevChar);
+          prevChar	= inBuffer[inLen-1];
+          noteBalance(&balance,inBuffer,inLen);
+        }
+      }
+
+      if  (inDone  &&  isBalanced(&balance))
+      {
+        memcpy(inBuffer,CALC_TAIL,strlen(CALC_TAIL));
+        inLen	= strlen(CALC_TAIL);
+        tailSent= 1;
+      }
+      else if  (inDone)
+      {
+        //  CALC_TAIL would be read as part of the program:  let bc see
+        //the end of its input, and retire it.
+        close(calcPtr->toFd_);
+        calcPtr->toFd_	= -1;
+        inLen	= 0;
+        tailSent= 1;
+        retire	= 1;
+      }
+    }
+
+    //  II.  Wait for room to write or output to read:
+    int	numFds	= 0;
+
+    fds[numFds].fd	= calcPtr->fromFd_;
+    fds[numFds++].events= POLLIN;
+
+    if  (inSent < inLen)
+    {
+      fds[numFds].fd	= calcPtr->toFd_;
+      fds[numFds++].events= POLLOUT;
+    }
+
+    int	status	= poll(fds,numFds,CALC_TIMEOUT_MS);
+
+    if  ( (status < 0)  &&  (errno == EINTR) )
+      continue;
+
+    if  (status <= 0)
+      return(-1);
+
+    //  III.  Write:
+    if  ( (numFds > 1)  &&  (fds[1].revents & (POLLOUT | POLLERR)) )
+    {
+      ssize_t	numWritten = write(calcPtr->toFd_,inBuffer + inSent,inLen - inSent);
+
+      if  (numWritten > 0)
+        inSent += numWritten;
+      else if  (errno == EPIPE)
+      {
+        //  bc quit partway: read what it said before it went.
+        inSent	= inLen;
+        inDone	= tailSent = 1;
+      }
+      else if  (errno != EINTR)
+        return(-1);
+    }
+
+    //  IV.  Read:
+    if  (fds[0].revents & (POLLIN | POLLHUP | POLLERR))
+    {
+      ssize_t	numRead	= read(calcPtr->fromFd_,fromBuffer,CALC_CHUNK);
+      ssize_t	i;
+
+      if  (numRead == 0)
+        //  bc quit:  this is all the output there is.
+        return(1);
+
+      if  (numRead < 0)
+      {
+        if  (errno == EINTR)
+          continue;
+        return(-1);
+      }
+
+      for  (i = 0;  i < numRead;  i++)
+      {
+        if  (numOut < outLen - 1)
+          outPtr[numOut++] = fromBuffer[i];
+
+        if  (tailLen == sizeof(tail))
+        {
+          memmove(tail,tail + 1,sizeof(tail) - 1);
+          tailLen--;
         }
- 
-        close(0);
-        dup(inFd);
-        close(1);
-        dup(outFd);
-        close(2);
-        dup(errFd);
-	execl(CALC_PROGNAME,CALC_PROGNAME,NULL);
-	fprintf(stderr,"CALC_PROGNAME failed to run \n");
-	exit(EXIT_FAILURE);
-    }
-
-    childId = wait(&status);
-    int	        fileFd = open(OUTPUT_FILENAME,O_RDONLY,0440);
-    int         errFd= open(ERROR_FILENAME, O_WRONLY|O_CREAT|O_TRUNC,0660);
-    char 	errBuffer[BUFFER_LEN];
-
-    if (WIFEXITED(status)) {
-        if (WEXITSTATUS(status) != EXIT_SUCCESS) {
-            write(clientFd, STD_ERROR_MSG,strlen(STD_ERROR_MSG));
-        } else {
-            read(fileFd,buffer,BUFFER_LEN);
-            if (strlen(buffer) <BUFFER_LEN) {
-                read(errFd,errBuffer,BUFFER_LEN);
-                strncat(buffer,errBuffer,BUFFER_LEN);           
-            }
+
+        tail[tailLen++]	= fromBuffer[i];
+      }
+
+      totalOut += numRead;
+
+      //  CALC_TAIL_OUT ends the output; take it off.
+      if  ( (tailLen == sizeof(tail))  &&
+            (memcmp(tail,CALC_TAIL_OUT,sizeof(tail)) == 0) )
+      {
+        size_t	realOut	= totalOut - sizeof(tail);
+
+        if  (numOut > realOut)
+          memset(outPtr + realOut,'\0',numOut - realOut);
+
+        return(retire);
+      }
+    }
+  }
+}
+
+
+//  PURPOSE:  To read the program in 'fileFd' into the CALC_EVAL_MAX+1 bytes
+//at 'textPtr', and set '*lenPtr' to its length.  Returns 1 if it was all
+//read, or 0 if it is longer than CALC_EVAL_MAX or could not be read:  bc
+//must then run it, from the start of 'fileFd'.
+int		readCalcText	(int		fileFd,
+				 char*		textPtr,
+				 size_t*	lenPtr
+				)
+{
+  size_t	textLen	= 0;
+  ssize_t	numRead	= 0;
+
+  while  ( (textLen <= CALC_EVAL_MAX)  &&
+           ( (numRead = read(fileFd,textPtr+textLen,CALC_EVAL_MAX+1-textLen)) > 0 ) )
+    textLen	+= numRead;
+
+  *lenPtr	= textLen;
+  return( (numRead >= 0)  &&  (textLen <= CALC_EVAL_MAX) );
+}
+
+
+//  PURPOSE:  To return a 64-bit FNV-1a hash of the 'len' bytes at
+//'textPtr'.
+uint64_t	hashText	(const char*	textPtr,
+				 size_t		len
+				)
+{
+  uint64_t	hash	= 14695981039346656037ULL;
+  size_t	i;
+
+  for  (i = 0;  i < len;  i++)
+  {
+    hash ^= (unsigned char)textPtr[i];
+    hash *= 1099511628211ULL;
+  }
+
+  return(hash);
+}
+
+
+//  PURPOSE:  To return 1 if '*statPtr' and '*otherPtr' give a file the
+//same size and modification time, or 0 otherwise.
+int		isUnchanged	(const struct stat*	statPtr,
+				 const struct stat*	otherPtr
+				)
+{
+  return( (statPtr->st_size == otherPtr->st_size)  &&
+          (statPtr->st_mtim.tv_sec  == otherPtr->st_mtim.tv_sec)  &&
+          (statPtr->st_mtim.tv_nsec == otherPtr->st_mtim.tv_nsec) );
+}
+
+
+//  PURPOSE:  To return the bucket of 'cacheBuckets' for 'fileNum'.
+struct CalcResult**
+		bucketOf	(int	fileNum
+				)
+{
+  return(&cacheBuckets[(unsigned)fileNum & (CALC_CACHE_BUCKETS-1)]);
+}
+
+
+//  PURPOSE:  To take '*resultPtr' out of the LRU list.  'cacheLock' must be
+//held.
+void		unlistResult	(struct CalcResult*	resultPtr
+				)
+{
+  if  (resultPtr->newerPtr_ != NULL)
+    resultPtr->newerPtr_->olderPtr_	= resultPtr->olderPtr_;
+  else
+    cacheNewestPtr	= resultPtr->olderPtr_;
+
+  if  (resultPtr->olderPtr_ != NULL)
+    resultPtr->olderPtr_->newerPtr_	= resultPtr->newerPtr_;
+  else
+    cacheOldestPtr	= resultPtr->newerPtr_;
+}
+
+
+//  PURPOSE:  To put '*resultPtr' at the newest end of the LRU list.
+//'cacheLock' must be held.
+void		listResult	(struct CalcResult*	resultPtr
+				)
+{
+  resultPtr->newerPtr_	= NULL;
+  resultPtr->olderPtr_	= cacheNewestPtr;
+
+  if  (cacheNewestPtr != NULL)
+    cacheNewestPtr->newerPtr_	= resultPtr;
+  else
+    cacheOldestPtr	= resultPtr;
+
+  cacheNewestPtr	= resultPtr;
+}
+
+
+//  PURPOSE:  To take '*resultPtr' out of the cache and free it.
+//'cacheLock' must be held.
+void		dropResult	(struct CalcResult*	resultPtr
+				)
+{
+  struct CalcResult**	linkPtr	= bucketOf(resultPtr->fileNum_);
+
+  while  (*linkPtr != resultPtr)
+    linkPtr	= &(*linkPtr)->nextPtr_;
+
+  *linkPtr	= resultPtr->nextPtr_;
+  unlistResult(resultPtr);
+  cacheSize--;
+  free(resultPtr);
+}
+
+
+//  PURPOSE:  To return the cached result for 'fileNum', or NULL if there
+//is none.  'cacheLock' must be held.
+struct CalcResult*
+		lookupResult	(int	fileNum
+				)
+{
+  struct CalcResult*	resultPtr	= *bucketOf(fileNum);
+
+  while  ( (resultPtr != NULL)  &&  (resultPtr->fileNum_ != fileNum) )
+    resultPtr	= resultPtr->nextPtr_;
+
+  return(resultPtr);
+}
+
+
+//  PURPOSE:  To copy the cached result of N.bc for 'fileNum' into the
+//BUFFER_LEN bytes at 'outPtr', if it was cached when the file had the
+//text that hashes to 'hash' and the size and modification time in
+//'*statPtr'.  Returns 1 if so, or 0 otherwise.
+int		findCalcResult	(int			fileNum,
+				 uint64_t		hash,
+				 const struct stat*	statPtr,
+				 char*			outPtr
+				)
+{
+  struct CalcResult*	resultPtr;
+  int			isFound	= 0;
+
+  pthread_mutex_lock(&cacheLock);
+  resultPtr	= lookupResult(fileNum);
+
+  if  ( (resultPtr != NULL)  &&  (resultPtr->hash_ == hash)  &&
+        isUnchanged(&resultPtr->stat_,statPtr) )
+  {
+    memcpy(outPtr,resultPtr->out_,BUFFER_LEN);
+    unlistResult(resultPtr);
+    listResult(resultPtr);
+    isFound	= 1;
+  }
+
+  pthread_mutex_unlock(&cacheLock);
+  return(isFound);
+}
+
+
+//  PURPOSE:  To cache the BUFFER_LEN bytes at 'outPtr' as the result of
+//N.bc for 'fileNum', with the text that hashes to 'hash' and the size and
+//modification time in '*statPtr'.  It replaces any result of the file's
+//other versions, and the least recently used result goes if the cache is
+//full.
+void		keepCalcResult	(int			fileNum,
+				 uint64_t		hash,
+				 const struct stat*	statPtr,
+				 const char*		outPtr
+				)
+{
+  struct CalcResult*	resultPtr	= (struct CalcResult*)malloc(sizeof(struct CalcResult));
+  struct CalcResult*	oldPtr;
+
+  if  (resultPtr == NULL)
+    return;
+
+  resultPtr->fileNum_	= fileNum;
+  resultPtr->hash_	= hash;
+  resultPtr->stat_	= *statPtr;
+  memcpy(resultPtr->out_,outPtr,BUFFER_LEN);
+
+  pthread_mutex_lock(&cacheLock);
+
+  if  ( (oldPtr = lookupResult(fileNum)) != NULL )
+    dropResult(oldPtr);
+  else if  (cacheSize >= CALC_CACHE_SIZE)
+  {
+    dropResult(cacheOldestPtr);
+    numCacheEvictions++;
+  }
+
+  resultPtr->nextPtr_	= *bucketOf(fileNum);
+  *bucketOf(fileNum)	= resultPtr;
+  listResult(resultPtr);
+  cacheSize++;
+  pthread_mutex_unlock(&cacheLock);
+}
+
+
+//  PURPOSE:  To drop the cached result of N.bc for 'fileNum', after it has
+//been written to, appended to or deleted.
+void		forgetCalcResult(int	fileNum
+				)
+{
+  struct CalcResult*	resultPtr;
+
+  pthread_mutex_lock(&cacheLock);
+
+  if  ( (resultPtr = lookupResult(fileNum)) != NULL )
+    dropResult(resultPtr);
+
+  pthread_mutex_unlock(&cacheLock);
+}
+
+
+//  PURPOSE:  To count a calculation begun at '*startPtr' (CLOCK_MONOTONIC)
+//as a cache hit if 'isHit', or a miss otherwise, and add its time to the
+//stats.
+void		noteCalcTime	(int			isHit,
+				 const struct timespec*	startPtr
+				)
+{
+  struct timespec	now;
+  double		microsecs;
+
+  clock_gettime(CLOCK_MONOTONIC,&now);
+  microsecs	= (now.tv_sec  - startPtr->tv_sec)  * 1e6 +
+		  (now.tv_nsec - startPtr->tv_nsec) / 1e3;
+
+  pthread_mutex_lock(&cacheLock);
+
+  if  (isHit)
+  {
+    numCacheHits++;
+    hitMicrosecs += microsecs;
+
+    if  (microsecs > maxHitMicrosecs)
+      maxHitMicrosecs	= microsecs;
+  }
+  else
+  {
+    numCacheMisses++;
+    missMicrosecs += microsecs;
+
+    if  (microsecs > maxMissMicrosecs)
+      maxMissMicrosecs	= microsecs;
+  }
+
+  pthread_mutex_unlock(&cacheLock);
+}
+
+
+//  PURPOSE:  To calculate N.bc and send back what bc prints for it, errors
+//included.  A file of up to CALC_EVAL_MAX bytes gets the cached result
+//for its text, size and modification time if there is one.  Otherwise
+//plain arithmetic is done here by evalBc(); the rest goes through one of
+//the pooled bc coprocesses.
+void* 		calcCommand(struct Request*	reqPtr,
+                            int 	fileNum  ) {
+    char	fileName[BUFFER_LEN];
+    char 	buffer[BUFFER_LEN];
+    char	text[CALC_EVAL_MAX+1];
+    size_t	textLen	= 0;
+    struct stat	before;
+    struct stat	after;
+    struct timespec	startTime;
+
+    clock_gettime(CLOCK_MONOTONIC,&startTime);
+    snprintf(fileName,BUFFER_LEN,"%d%s",fileNum,FILENAME_EXTENSION);
+
+    int		fileFd = open(fileName,O_RDONLY|O_CLOEXEC,0);
+
+    if (fileFd < 0) {
+        replyError(reqPtr);
+        return(NULL);
+    }
+
+    memset(buffer,'\0',BUFFER_LEN);
+
+    int		isWhole	= (fstat(fileFd,&before) == 0)  &&
+			  readCalcText(fileFd,text,&textLen);
+    uint64_t	hash	= isWhole ? hashText(text,textLen) : 0;
+
+    if  (isWhole  &&  findCalcResult(fileNum,hash,&before,buffer)) {
+        close(fileFd);
+        reply(reqPtr,buffer,BUFFER_LEN);
+        noteCalcTime(1,&startTime);
+        return(NULL);
+    }
+
+    int		status	= -1;
+
+    if  (isWhole  &&  evalBc(text,textLen,buffer,BUFFER_LEN)) {
+        status = 0;
+    } else {
+        struct Calculator*	calcPtr = getCalculator();
+
+        lseek(fileFd,0,SEEK_SET);
+
+        if  (calcPtr != NULL) {
+            status = runCalculator(calcPtr,fileFd,buffer,BUFFER_LEN);
+
+            //  Refilled by handleRequest() once the reply is on its way:
+            if  (status != 0)
+                stopCalculator(calcPtr);
+
+            putCalculator(calcPtr);
         }
-        write(clientFd,buffer,BUFFER_LEN);
     }
+
+    //  Kept only if the file did not change while it was being calculated:
+    if  ( (status >= 0)  &&  isWhole  &&  (fstat(fileFd,&after) == 0)  &&
+          isUnchanged(&before,&after) )
+        keepCalcResult(fileNum,hash,&before,buffer);
+
     close(fileFd);
-    close(errFd); 
-    return(EXIT_SUCCESS);
+
+    if  (status < 0)
+        replyError(reqPtr);
+    else
+        reply(reqPtr,buffer,BUFFER_LEN);
+
+    noteCalcTime(0,&startTime);
+    return(NULL);
+}
+
+
+//  PURPOSE:  To send back how many calculations the cache answered, and how
+//long calculations took with and without it.
+void*		statsCommand(struct Request*	reqPtr) {
+    char 	buffer[BUFFER_LEN];
+
+    memset(buffer,'\0',BUFFER_LEN);
+    pthread_mutex_lock(&cacheLock);
+
+    unsigned long	numCalcs = numCacheHits + numCacheMisses;
+
+    snprintf(buffer,BUFFER_LEN,
+	     "Calc cache: %lu hits, %lu misses (%.1f%% hit rate), %d of %d kept, %lu evicted\n"
+	     "Calc hit latency: %.1f us avg, %.1f us max\n"
+	     "Calc miss latency: %.1f us avg, %.1f us max\n",
+	     numCacheHits,numCacheMisses,
+	     (numCalcs == 0) ? 0.0 : 100.0 * numCacheHits / numCalcs,
+	     cacheSize,CALC_CACHE_SIZE,numCacheEvictions,
+	     (numCacheHits == 0) ? 0.0 : hitMicrosecs / numCacheHits,maxHitMicrosecs,
+	     (numCacheMisses == 0) ? 0.0 : missMicrosecs / numCacheMisses,maxMissMicrosecs
+	    );
+    pthread_mutex_unlock(&cacheLock);
+    reply(reqPtr,buffer,BUFFER_LEN);
+    return(NULL);
 }
 
 
@@ -371,6 +2363,18 @@ int  main (int argc,
   int      listenFd= getServerFileDescriptor(port);
   int      status= EXIT_FAILURE;
 
+  if  (argc >= 3)
+    numWorkers = strtol(argv[2],NULL,0);
+
+  //  A bc that quits early must not kill the server:
+  signal(SIGPIPE,SIG_IGN);
+
+  if  ( (numWorkers < 1) || (numWorkers > MAX_NUM_WORKERS) )
+  {
+    fprintf(stderr,"Number of workers must be between 1 and %d\n",MAX_NUM_WORKERS);
+    return(EXIT_FAILURE);
+  }
+
   if  (listenFd >= 0)
   {
     doServer(listenFd);
@@ -0,0 +1,582 @@
+/*-------------------------------------------------------------------------*
+ *---                                                                   ---*
+ *---                          tracegen.c                               ---*
+ *---                                                                   ---*
+ *---    This file writes synthetic memory traces for csim from the     ---*
+ *---access patterns of common kernels: naive and blocked transpose     ---*
+ *---and matrix multiply, pointer chasing, strided scans, hash-table    ---*
+ *---probes and the DigitNode list traversals of byDigitAdder.c.       ---*
+ *---Traces are csim's text format or its binary records (-f binary),  ---*
+ *---which csim reads without parsing.                                 ---*
+ *---                                                                   ---*
+ *-------------------------------------------------------------------------*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <getopt.h>
+#include <string.h>
+#include <strings.h>
+
+typedef unsigned long long int mem_addr_t;
+
+//---Definition of constants:---//
+
+/* binary trace layout; must agree with the trace reader in csim.c */
+#define TRACE_MAGIC	"CSIMTRC1"
+#define TRACE_MAGIC_LEN	8
+#define TRACE_RECORD	16
+#define NO_THREAD	0xFFFF
+
+#define REGION_BASE	0x10000000ULL	/* where the first array starts */
+#define PAGE_SIZE	4096
+#define OUT_RECORDS	4096		/* binary records buffered per fwrite */
+
+#define MALLOC_CHUNK	32		/* a 16-byte DigitNode plus malloc overhead */
+#define SCATTER_FACTOR	8		/* -S spreads nodes over this much more heap */
+
+
+//---Definition of types:---//
+
+typedef struct {
+	FILE *file;
+	int binary;
+	unsigned char *buffer;		/* OUT_RECORDS records, binary only */
+	int buffered;
+	long long records;
+} trace_out_t;
+
+typedef struct {
+	long long n;			/* problem size; its meaning is per kernel */
+	long long tile;			/* -B, blocked kernels */
+	int elem;			/* bytes per element or node */
+	long long stride;		/* -s, in elements */
+	long long iterations;
+	int scatter;			/* -S, list: scatter nodes over the heap */
+	mem_addr_t next_region;
+	unsigned long long rng;
+} gen_t;
+
+typedef struct {
+	const char *name;
+	void (*run)(gen_t *gen, trace_out_t *out);
+	int elem;			/* default -e */
+	const char *help;
+} kernel_t;
+
+
+//---Definition of global functions:---//
+
+void printUsage(char *argv[]);
+
+/* xorshift64; the same -r seed gives the same trace */
+unsigned long long next_random(gen_t *gen)
+{
+	gen->rng ^= gen->rng << 13;
+	gen->rng ^= gen->rng >> 7;
+	gen->rng ^= gen->rng << 17;
+	return gen->rng;
+}
+
+/* region - a page-aligned base for bytes of fresh address space */
+mem_addr_t region(gen_t *gen, mem_addr_t bytes)
+{
+	mem_addr_t base = gen->next_region;
+
+	gen->next_region += (bytes + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE + PAGE_SIZE;
+	return base;
+}
+
+void flush_out(trace_out_t *out)
+{
+	if (out->buffered > 0 &&
+	    fwrite(out->buffer, TRACE_RECORD, out->buffered, out->file) != (size_t) out->buffered) {
+		printf("Could not write the trace\n");
+		exit(1);
+	}
+	out->buffered = 0;
+}
+
+/* emit - write one access: op is 'L', 'S' or 'M' */
+void emit(trace_out_t *out, char op, mem_addr_t address, int size)
+{
+	unsigned char *p;
+	int index;
+
+	out->records ++;
+	if (!out->binary) {
+		fprintf(out->file, " %c %llx,%d\n", op, address, size);
+		return;
+	}
+
+	p = out->buffer + (long) out->buffered * TRACE_RECORD;
+	for (index = 0; index < 8; index ++) {
+		p[index] = (unsigned char) (address >> (8 * index));
+	}
+	for (index = 0; index < 4; index ++) {
+		p[8 + index] = (unsigned char) ((unsigned int) size >> (8 * index));
+	}
+	p[12] = NO_THREAD & 0xFF;
+	p[13] = NO_THREAD >> 8;
+	p[14] = (unsigned char) op;
+	p[15] = 0;
+	if (++out->buffered == OUT_RECORDS) {
+		flush_out(out);
+	}
+}
+
+/* B[j][i] = A[i][j] over n x n matrices, row by row */
+void gen_transpose(gen_t *gen, trace_out_t *out)
+{
+	long long n = gen->n;
+	mem_addr_t a = region(gen, n * n * gen->elem);
+	mem_addr_t b = region(gen, n * n * gen->elem);
+	long long i, j;
+
+	for (i = 0; i < n; i ++) {
+		for (j = 0; j < n; j ++) {
+			emit(out, 'L', a + (i * n + j) * gen->elem, gen->elem);
+			emit(out, 'S', b + (j * n + i) * gen->elem, gen->elem);
+		}
+	}
+}
+
+/* the same transpose one tile x tile block at a time */
+void gen_transpose_blocked(gen_t *gen, trace_out_t *out)
+{
+	long long n = gen->n;
+	long long t = gen->tile;
+	mem_addr_t a = region(gen, n * n * gen->elem);
+	mem_addr_t b = region(gen, n * n * gen->elem);
+	long long ii, jj, i, j;
+
+	for (ii = 0; ii < n; ii += t) {
+		for (jj = 0; jj < n; jj += t) {
+			for (i = ii; i < ii + t && i < n; i ++) {
+				for (j = jj; j < jj + t && j < n; j ++) {
+					emit(out, 'L', a + (i * n + j) * gen->elem, gen->elem);
+					emit(out, 'S', b + (j * n + i) * gen->elem, gen->elem);
+				}
+			}
+		}
+	}
+}
+
+/* C[i][j] += A[i][k] * B[k][j] in ijk order, the sum kept in a register */
+void gen_matmul(gen_t *gen, trace_out_t *out)
+{
+	long long n = gen->n;
+	mem_addr_t a = region(gen, n * n * gen->elem);
+	mem_addr_t b = region(gen, n * n * gen->elem);
+	mem_addr_t c = region(gen, n * n * gen->elem);
+	long long i, j, k;
+
+	for (i = 0; i < n; i ++) {
+		for (j = 0; j < n; j ++) {
+			emit(out, 'L', c + (i * n + j) * gen->elem, gen->elem);
+			for (k = 0; k < n; k ++) {
+				emit(out, 'L', a + (i * n + k) * gen->elem, gen->elem);
+				emit(out, 'L', b + (k * n + j) * gen->elem, gen->elem);
+			}
+			emit(out, 'S', c + (i * n + j) * gen->elem, gen->elem);
+		}
+	}
+}
+
+/* the same product over tile x tile blocks of C, A and B */
+void gen_matmul_blocked(gen_t *gen, trace_out_t *out)
+{
+	long long n = gen->n;
+	long long t = gen->tile;
+	mem_addr_t a = region(gen, n * n * gen->elem);
+	mem_addr_t b = region(gen, n * n * gen->elem);
+	mem_addr_t c = region(gen, n * n * gen->elem);
+	long long ii, jj, kk, i, j, k;
+
+	for (ii = 0; ii < n; ii += t) {
+		for (jj = 0; jj < n; jj += t) {
+			for (kk = 0; kk < n; kk += t) {
+				for (i = ii; i < ii + t && i < n; i ++) {
+					for (j = jj; j < jj + t && j < n; j ++) {
+						emit(out, 'L', c + (i * n + j) * gen->elem, gen->elem);
+						for (k = kk; k < kk + t && k < n; k ++) {
+							emit(out, 'L', a + (i * n + k) * gen->elem, gen->elem);
+							emit(out, 'L', b + (k * n + j) * gen->elem, gen->elem);
+						}
+						emit(out, 'S', c + (i * n + j) * gen->elem, gen->elem);
+					}
+				}
+			}
+		}
+	}
+}
+
+/* follow next pointers around one random cycle through n nodes */
+void gen_chase(gen_t *gen, trace_out_t *out)
+{
+	long long n = gen->n;
+	mem_addr_t base = region(gen, n * gen->elem);
+	long long *next = malloc(n * sizeof(long long));
+	long long i, j, tmp, node;
+
+	if (next == NULL) {
+		printf("Could not allocate %lld nodes\n", n);
+		exit(1);
+	}
+
+	//Sattolo's shuffle: a single cycle, so every node is visited.
+	for (i = 0; i < n; i ++) {
+		next[i] = i;
+	}
+	for (i = n - 1; i > 0; i --) {
+		j = (long long) (next_random(gen) % (unsigned long long) i);
+		tmp = next[i];
+		next[i] = next[j];
+		next[j] = tmp;
+	}
+
+	node = 0;
+	for (i = 0; i < n; i ++) {
+		emit(out, 'L', base + node * gen->elem, 8);
+		node = next[node];
+	}
+	free(next);
+}
+
+/* read every stride'th of n elements */
+void gen_stride(gen_t *gen, trace_out_t *out)
+{
+	long long n = gen->n;
+	mem_addr_t base = region(gen, n * gen->elem);
+	long long i;
+
+	for (i = 0; i < n; i += gen->stride) {
+		emit(out, 'L', base + i * gen->elem, gen->elem);
+	}
+}
+
+/*
+ * gen_hash - an open-addressing table of n entries with linear probing:
+ * fill it half full, then look up n/2 keys of which half are present.
+ */
+void gen_hash(gen_t *gen, trace_out_t *out)
+{
+	long long n = gen->n;
+	mem_addr_t base = region(gen, n * gen->elem);
+	unsigned long long *keys = calloc(n, sizeof(unsigned long long));
+	unsigned long long *inserted = malloc((n / 2 + 1) * sizeof(unsigned long long));
+	unsigned long long key;
+	long long count = 0;
+	long long i, slot;
+
+	if (keys == NULL || inserted == NULL) {
+		printf("Could not allocate a table of %lld entries\n", n);
+		exit(1);
+	}
+
+	//0 marks an empty entry, so keys are never 0.
+	for (i = 0; i < n / 2; i ++) {
+		key = next_random(gen) | 1;
+		slot = (long long) (key % (unsigned long long) n);
+		while (1) {
+			emit(out, 'L', base + slot * gen->elem, gen->elem);
+			if (keys[slot] == 0 || keys[slot] == key) {
+				break;
+			}
+			slot = (slot + 1) % n;
+		}
+		if (keys[slot] == 0) {
+			inserted[count ++] = key;
+		}
+		keys[slot] = key;
+		emit(out, 'S', base + slot * gen->elem, gen->elem);
+	}
+
+	for (i = 0; i < n / 2; i ++) {
+		if ((i & 1) && count > 0) {
+			key = inserted[next_random(gen) % (unsigned long long) count];
+		} else {
+			key = next_random(gen) | 1;
+		}
+		slot = (long long) (key % (unsigned long long) n);
+		while (1) {
+			emit(out, 'L', base + slot * gen->elem, gen->elem);
+			if (keys[slot] == 0 || keys[slot] == key) {
+				break;
+			}
+			slot = (slot + 1) % n;
+		}
+	}
+	free(keys);
+	free(inserted);
+}
+
+/*
+ * List kernel: byDigitAdder.c's DigitNode is an int digit_ at offset 0
+ * and a nextPtr_ at offset 8.  Nodes come from a bump allocator that
+ * hands out MALLOC_CHUNK-byte blocks in order, as a fresh malloc heap
+ * would, or from random chunks of a heap SCATTER_FACTOR times larger
+ * with -S, as an aged one would.
+ */
+typedef struct {
+	mem_addr_t base;
+	long long chunks;		/* chunks the heap holds */
+	long long used;
+	unsigned char *taken;		/* -S only */
+} node_heap_t;
+
+mem_addr_t node_alloc(gen_t *gen, node_heap_t *heap)
+{
+	long long chunk = heap->used ++;
+
+	if (heap->taken != NULL) {
+		do {
+			chunk = (long long) (next_random(gen) % (unsigned long long) heap->chunks);
+		} while (heap->taken[chunk]);
+		heap->taken[chunk] = 1;
+	}
+	return heap->base + chunk * MALLOC_CHUNK;
+}
+
+/*
+ * gen_number_list - numberList(): a sentinel head, then one node per
+ * digit appended at the tail; the sentinel is freed and list[] gets
+ * the digit nodes in order.
+ */
+void gen_number_list(gen_t *gen, node_heap_t *heap, trace_out_t *out, mem_addr_t *list,
+		     long long digits)
+{
+	mem_addr_t head = node_alloc(gen, heap);
+	mem_addr_t tail = head;
+	long long i;
+
+	for (i = 0; i < digits; i ++) {
+		list[i] = node_alloc(gen, heap);
+		emit(out, 'S', list[i], 4);		//x->digit_
+		emit(out, 'S', list[i] + 8, 8);		//x->nextPtr_
+		emit(out, 'S', tail + 8, 8);		//tail->nextPtr_
+		tail = list[i];
+	}
+	emit(out, 'L', head + 8, 8);			//head->nextPtr_
+}
+
+void gen_list(gen_t *gen, trace_out_t *out)
+{
+	long long digits = gen->n;
+	node_heap_t heap;
+	mem_addr_t *list0 = malloc(3 * digits * sizeof(mem_addr_t));
+	mem_addr_t *list1 = list0 + digits;
+	mem_addr_t *sum = list1 + digits;
+	mem_addr_t head, tail;
+	long long i;
+
+	//Three lists of digits plus their sentinels.
+	heap.chunks = 3 * (digits + 1) * (gen->scatter ? SCATTER_FACTOR : 1);
+	heap.base = region(gen, heap.chunks * MALLOC_CHUNK);
+	heap.used = 0;
+	heap.taken = gen->scatter ? calloc(heap.chunks, 1) : NULL;
+	if (list0 == NULL || (gen->scatter && heap.taken == NULL)) {
+		printf("Could not allocate a heap of %lld nodes\n", heap.chunks);
+		exit(1);
+	}
+
+	gen_number_list(gen, &heap, out, list0, digits);
+	gen_number_list(gen, &heap, out, list1, digits);
+
+	//add(): walk both lists in step, appending one sum node per digit.
+	head = node_alloc(gen, &heap);
+	tail = head;
+	for (i = 0; i < digits; i ++) {
+		emit(out, 'L', list0[i], 4);		//list0->digit_
+		emit(out, 'L', list1[i], 4);		//list1->digit_
+		sum[i] = node_alloc(gen, &heap);
+		emit(out, 'S', sum[i], 4);
+		emit(out, 'S', sum[i] + 8, 8);
+		emit(out, 'S', tail + 8, 8);
+		tail = sum[i];
+		emit(out, 'L', list0[i] + 8, 8);	//list0->nextPtr_
+		emit(out, 'L', list1[i] + 8, 8);
+	}
+	emit(out, 'L', head + 8, 8);
+
+	//Printing the sum walks it once more, digit then next.
+	for (i = 0; i < digits; i ++) {
+		emit(out, 'L', sum[i], 4);
+		emit(out, 'L', sum[i] + 8, 8);
+	}
+	free(list0);
+	free(heap.taken);
+}
+
+kernel_t kernels[] = {
+	{"transpose", gen_transpose, 4, "B = A^T over n x n ints, row by row"},
+	{"transpose-blocked", gen_transpose_blocked, 4, "the same in -B x -B tiles"},
+	{"matmul", gen_matmul, 8, "C += A * B over n x n doubles, ijk order"},
+	{"matmul-blocked", gen_matmul_blocked, 8, "the same in -B x -B tiles"},
+	{"chase", gen_chase, 64, "follow a random cycle through n nodes"},
+	{"stride", gen_stride, 8, "read every -s'th of n elements"},
+	{"hash", gen_hash, 16, "fill and probe an n-entry linear-probing table"},
+	{"list", gen_list, 16, "build and add two n-digit DigitNode lists"},
+};
+
+#define NUM_KERNELS	((int) (sizeof(kernels) / sizeof(kernels[0])))
+
+void printUsage(char *argv[])
+{
+    int index;
+
+    printf("Usage: %s -k <kernel> -n <num> [-B <num>] [-e <bytes>] [-s <num>]\n", argv[0]);
+    printf("       %*s [-i <num>] [-r <seed>] [-f text|binary] [-o <file>] [-Sh]\n", (int) strlen(argv[0]), "");
+    printf("Options:\n");
+    printf("  -h         Print this help message.\n");
+    printf("  -k <name>  Kernel to trace (below).\n");
+    printf("  -n <num>   Problem size: matrix order, nodes, elements, entries or digits.\n");
+    printf("  -B <num>   Tile size of the blocked kernels (default 8).\n");
+    printf("  -e <bytes> Bytes per element or node (default per kernel).\n");
+    printf("  -s <num>   Stride in elements for stride (default 1).\n");
+    printf("  -i <num>   Run the kernel <num> times over the same data (default 1).\n");
+    printf("  -r <seed>  Seed for chase, hash and list -S (default 1).\n");
+    printf("  -f <fmt>   text (default), or binary for csim to read faster.\n");
+    printf("  -o <file>  Write the trace to <file> instead of stdout.\n");
+    printf("  -S         list: scatter nodes over the heap instead of allocating in order.\n");
+    printf("Kernels:\n");
+    for (index = 0; index < NUM_KERNELS; index ++) {
+        printf("  %-18s %s\n", kernels[index].name, kernels[index].help);
+    }
+    printf("\nExamples:\n");
+    printf("  linux>  %s -k transpose-blocked -n 64 -B 8 -o tr.trace\n", argv[0]);
+    printf("  linux>  %s -k chase -n 100000 -f binary -o chase.bin\n", argv[0]);
+    exit(0);
+}
+
+int main(int argc, char **argv)
+{
+	gen_t gen;
+	trace_out_t out;
+	kernel_t *kernel = NULL;
+	char *out_file = NULL;
+	long long iteration;
+	unsigned long long seed;
+	int index;
+	char c;
+
+	bzero(&gen, sizeof(gen));
+	bzero(&out, sizeof(out));
+	gen.tile = 8;
+	gen.stride = 1;
+	gen.iterations = 1;
+	gen.rng = 1;
+
+    while( (c=getopt(argc,argv,"k:n:B:e:s:i:r:f:o:Sh")) != -1)
+	{
+        switch(c)
+		{
+        case 'k':
+            for (index = 0; index < NUM_KERNELS; index ++) {
+                if (strcmp(optarg, kernels[index].name) == 0) {
+                    kernel = &kernels[index];
+                }
+            }
+            if (kernel == NULL) {
+                printf("Unknown kernel %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'n':
+            gen.n = atoll(optarg);
+            break;
+        case 'B':
+            gen.tile = atoll(optarg);
+            break;
+        case 'e':
+            gen.elem = atoi(optarg);
+            break;
+        case 's':
+            gen.stride = atoll(optarg);
+            break;
+        case 'i':
+            gen.iterations = atoll(optarg);
+            break;
+        case 'r':
+            gen.rng = strtoull(optarg, NULL, 0);
+            break;
+        case 'f':
+            if (strcmp(optarg, "binary") == 0) {
+                out.binary = 1;
+            } else if (strcmp(optarg, "text") != 0) {
+                printf("-f must be text or binary\n");
+                exit(1);
+            }
+            break;
+        case 'o':
+            out_file = optarg;
+            break;
+        case 'S':
+            gen.scatter = 1;
+            break;
+        case 'h':
+            printUsage(argv);
+            exit(0);
+        default:
+            printUsage(argv);
+            exit(1);
+        }
+    }
+
+	if (kernel == NULL || gen.n <= 0) {
+		printf("%s: Missing required command line argument\n", argv[0]);
+		printUsage(argv);
+		exit(1);
+	}
+	if (gen.elem == 0) {
+		gen.elem = kernel->elem;
+	}
+	if (gen.elem < 1 || gen.tile < 1 || gen.stride < 1 || gen.iterations < 1) {
+		printf("-e, -B, -s and -i must be positive\n");
+		exit(1);
+	}
+	if (kernel->run == gen_list && gen.elem != 16) {
+		printf("list models the 16-byte DigitNode; -e does not apply\n");
+		exit(1);
+	}
+	if (gen.rng == 0) {
+		//xorshift never leaves 0.
+		gen.rng = 1;
+	}
+
+	out.file = stdout;
+	if (out_file != NULL) {
+		out.file = fopen(out_file, out.binary ? "wb" : "w");
+		if (out.file == NULL) {
+			printf("%s: Could not open %s\n", argv[0], out_file);
+			exit(1);
+		}
+	}
+	if (out.binary) {
+		out.buffer = malloc((long) OUT_RECORDS * TRACE_RECORD);
+		if (out.buffer == NULL) {
+			printf("Could not allocate the output buffer\n");
+			exit(1);
+		}
+		fwrite(TRACE_MAGIC, 1, TRACE_MAGIC_LEN, out.file);
+	}
+
+	//Each iteration replays the kernel over the same addresses, so
+	//later ones see whatever the earlier ones left in the cache.
+	seed = gen.rng;
+	for (iteration = 0; iteration < gen.iterations; iteration ++) {
+		gen.next_region = REGION_BASE;
+		gen.rng = seed;
+		kernel->run(&gen, &out);
+	}
+
+	if (out.binary) {
+		flush_out(&out);
+		free(out.buffer);
+	}
+	if (fflush(out.file) != 0 || (out.file != stdout && fclose(out.file) != 0)) {
+		printf("Could not write the trace\n");
+		exit(1);
+	}
+	fprintf(stderr, "%lld accesses\n", out.records);
+	return 0;
+}